@@ -0,0 +1,41 @@
+/*
+ * x86-64 上的协程上下文
+ *
+ * 协程切换总是发生在一次普通的函数调用(swapxmcontext)里面, 按照 System V x86-64 ABI,
+ * 调用者保存的寄存器(rax, rcx, rdx, rsi, rdi, r8-r11, xmm0-15)在调用点已经被编译器认为
+ * 失效了, 所以只需要保存被调用者保存的寄存器: rsp, rbx, rbp, r12-r15, 以及 ABI 要求跨调用
+ * 保持的 MXCSR 和 x87 控制字. 段寄存器在用户态 64 位下没有意义, 也不需要保存.
+ */
+
+#define setcontext(u) assert(0) /* 只能通过 swapcontext 切换 */
+#define getcontext(u) 0         /* makecontext 会填好所有需要的字段 */
+#define swapcontext(o, u) swapxmcontext(&(o)->uc_xmcontext, &(u)->uc_xmcontext)
+
+/* 换个名字, 不要覆盖 libc 里面的 makecontext, 程序自己还可以正常使用 <ucontext.h> */
+#define makecontext makexmcontext
+
+typedef struct xmcontext xmcontext_t;
+typedef struct xucontext xucontext_t;
+
+/* asm.S 里面按偏移访问这些字段, 修改布局需要同步修改汇编 */
+struct xmcontext {
+    long mc_rsp;     /* 0 */
+    long mc_rbx;     /* 8 */
+    long mc_rbp;     /* 16 */
+    long mc_r12;     /* 24 */
+    long mc_r13;     /* 32 */
+    long mc_r14;     /* 40 */
+    long mc_r15;     /* 48 */
+    uint mc_mxcsr;   /* 56 */
+    ushort mc_fpucw; /* 60 */
+    ushort __spare__;
+};
+
+struct xucontext {
+    sigset_t uc_sigmask;
+    xmcontext_t uc_xmcontext;
+    stack_t uc_stack;
+};
+
+extern void makecontext(xucontext_t *, void (*)(), int, ...);
+extern int swapxmcontext(xmcontext_t *, const xmcontext_t *);
@@ -0,0 +1,228 @@
+/*
+ * 通道的吞吐.
+ *
+ *  - pingpong: 两个协程在无缓冲通道上一个发一个收
+ *  - buffered: 同样, 通道有 BUF 个缓冲
+ *  - batched: 同样, 用 chansendn/chanrecvn 一次收发最多 BATCH 个
+ *  - fanin: NSEND 个协程往同一个无缓冲通道发, 一个协程收. 随机和 FIFO 两种配对策略,
+ *    maxgap 是同一个发送者的两次发送之间最多隔了几次接收, FIFO 是 NSEND, 随机的时候
+ *    有的发送者会被晾很久
+ *  - select: 一个协程每次在 {收 c, 收 d} 上 chanalt, 另一个协程往 d 发, c 上另外挂着
+ *    1 个或 NPARK 个接收者. 每次挂起都要在 c 上登记再撤掉, 开销不应该跟着 c 上的等待者变多
+ *
+ * 用法: benchchan [n], 默认 1000000 次.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <task.h>
+#include <time.h>
+
+enum { STACK = 16384, BUF = 64, BATCH = 32, NSEND = 8, NPARK = 10000 };
+
+static int n;
+static int stop;
+static int last[NSEND];
+static Channel *c;
+static Channel *d;
+static Channel *done;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sender(void *v)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        chansendul(c, i);
+    chansendul(done, 0);
+}
+
+void batchsender(void *v)
+{
+    int i, j, m;
+    unsigned long buf[BATCH];
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < BATCH ? n - i : BATCH;
+        for (j = 0; j < m; j++)
+            buf[j] = i + j;
+        for (j = 0; j < m; j += chansendn(c, buf + j, m - j))
+            ;
+    }
+    chansendul(done, 0);
+}
+
+void batchreceiver(void *v)
+{
+    int i;
+    unsigned long buf[BATCH];
+
+    for (i = 0; i < n; i += chanrecvn(c, buf, n - i < BATCH ? n - i : BATCH))
+        ;
+    chansendul(done, 0);
+}
+
+/* fanin 的发送者, 收够了之后 stop */
+void fansender(void *v)
+{
+    long id;
+
+    id = (long)v;
+    while (!stop)
+        chansendul(c, id);
+    chansendul(done, 0);
+}
+
+void receiver(void *v)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        chanrecvul(c);
+    chansendul(done, 0);
+}
+
+/* select 里挂在 c 上的接收者, c 关闭之后退出 */
+void parked(void *v)
+{
+    chanrecvul(c);
+}
+
+void pinger(void *v)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        chansendul(d, i);
+    chansendul(done, 0);
+}
+
+static void report(char *name, uint64_t t0, int maxgap)
+{
+    uint64_t t;
+
+    t = now() - t0;
+    if (maxgap < 0)
+        printf("%-18s %8.1f ns/op %10.0f ops/s\n", name, (double)t / n, n * 1e9 / t);
+    else
+        printf("%-18s %8.1f ns/op %10.0f ops/s  maxgap %d\n", name, (double)t / n, n * 1e9 / t, maxgap);
+}
+
+static void fanin(char *name, int fifo)
+{
+    int i, id, gap, maxgap, ndone;
+    unsigned long v;
+    uint64_t t0;
+
+    c = chancreate(sizeof(unsigned long), 0);
+    chanfifo(c, fifo);
+    stop = 0;
+    t0 = now();
+    for (i = 0; i < NSEND; i++) {
+        last[i] = 0;
+        taskcreate(fansender, (void *)(long)i, STACK);
+    }
+    maxgap = 0;
+    for (i = 1; i <= n; i++) {
+        id = chanrecvul(c);
+        if ((gap = i - last[id]) > maxgap && last[id] != 0)
+            maxgap = gap;
+        last[id] = i;
+    }
+    stop = 1;
+    report(name, t0, maxgap);
+
+    /* 放掉还堵在 chansendul 里的发送者, 等它们都退出 */
+    for (ndone = 0; ndone < NSEND;) {
+        while (channbrecv(c, &v) > 0)
+            ;
+        if (channbrecv(done, &v) > 0)
+            ndone++;
+        else
+            taskyield();
+    }
+    chanfree(c);
+}
+
+static void selectn(char *name, int npark, int fifo)
+{
+    int i;
+    unsigned long v;
+    uint64_t t0;
+    Alt a[3];
+
+    c = chancreate(sizeof(unsigned long), 0);
+    d = chancreate(sizeof(unsigned long), 0);
+    chanfifo(c, fifo);
+    for (i = 0; i < npark; i++)
+        taskcreate(parked, 0, 8192);
+    taskyield();
+
+    t0 = now();
+    taskcreate(pinger, 0, STACK);
+    a[0].c = c;
+    a[0].v = &v;
+    a[0].op = CHANRCV;
+    a[1].c = d;
+    a[1].v = &v;
+    a[1].op = CHANRCV;
+    a[2].op = CHANEND;
+    for (i = 0; i < n; i++)
+        chanalt(a);
+    chanrecvul(done);
+    report(name, t0, -1);
+
+    chanfree(c);
+    chanfree(d);
+    taskyield();
+}
+
+void taskmain(int argc, char **argv)
+{
+    uint64_t t0;
+
+    n = argc > 1 ? atoi(argv[1]) : 1000000;
+    done = chancreate(sizeof(unsigned long), NSEND);
+
+    c = chancreate(sizeof(unsigned long), 0);
+    t0 = now();
+    taskcreate(sender, 0, STACK);
+    taskcreate(receiver, 0, STACK);
+    chanrecvul(done);
+    chanrecvul(done);
+    report("pingpong", t0, -1);
+    chanfree(c);
+
+    c = chancreate(sizeof(unsigned long), BUF);
+    t0 = now();
+    taskcreate(sender, 0, STACK);
+    taskcreate(receiver, 0, STACK);
+    chanrecvul(done);
+    chanrecvul(done);
+    report("buffered", t0, -1);
+    chanfree(c);
+
+    c = chancreate(sizeof(unsigned long), BUF);
+    t0 = now();
+    taskcreate(batchsender, 0, STACK);
+    taskcreate(batchreceiver, 0, STACK);
+    chanrecvul(done);
+    chanrecvul(done);
+    report("batched", t0, -1);
+    chanfree(c);
+
+    fanin("fanin random", 0);
+    fanin("fanin fifo", 1);
+    selectn("select 1", 1, 0);
+    selectn("select 10000", NPARK, 0);
+    selectn("select fifo 1", 1, 1);
+    selectn("select fifo 10000", NPARK, 1);
+    taskexitall(0);
+}
@@ -0,0 +1,105 @@
+/*
+ * fdwait 的注册和唤醒开销随等待者数量的变化.
+ *
+ * 每个等待者一个 eventfd, 对每个规模 n 测两项:
+ *  - reg: n 个协程各自第一次 fdwait(注册)的平均开销
+ *  - wake: 每次只唤醒其中一个(大部分连接空闲的场景), 从 write 到对方醒来再回到 fdwait 的平均开销
+ *
+ * 用法: benchfd [n ...], 默认 1000 10000 100000. 超过 RLIMIT_NOFILE 的规模会跳过.
+ * 分别用 make 和 make DEFS=-DUSE_POLL 编译可以对比 epoll 和 poll.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <task.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { STACK = 16384, NWAKE = 2000 };
+
+Rendez woke;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void waiter(void *v)
+{
+    int fd;
+    uint64_t cnt;
+
+    fd = (int)(intptr_t)v;
+    for (;;) {
+        fdwait(fd, 'r');
+        if (read(fd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+            break;
+        taskwakeup(&woke);
+    }
+}
+
+void bench(int n)
+{
+    int i, *fds;
+    uint64_t t0, reg, wake, one;
+
+    fds = malloc(n * sizeof fds[0]);
+    for (i = 0; i < n; i++) {
+        if ((fds[i] = eventfd(0, EFD_NONBLOCK)) < 0) {
+            fprintf(stderr, "eventfd: %s\n", strerror(errno));
+            taskexitall(1);
+        }
+        taskcreate(waiter, (void *)(intptr_t)fds[i], STACK);
+    }
+
+    /* 让所有等待者跑一遍, 每个都停在第一次 fdwait 上 */
+    t0 = now();
+    taskyield();
+    reg = now() - t0;
+
+    one = 1;
+    t0 = now();
+    for (i = 0; i < NWAKE; i++) {
+        write(fds[random() % n], &one, sizeof one);
+        tasksleep(&woke);
+    }
+    wake = now() - t0;
+
+    printf("n=%-7d reg %6.0f ns/waiter   wake %6.0f ns/wakeup\n", n, (double)reg / n,
+           (double)wake / NWAKE);
+
+    for (i = 0; i < n; i++)
+        fdclose(fds[i]);
+    taskyield();
+    free(fds);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int i, n;
+    struct rlimit rl;
+    static int def[] = {1000, 10000, 100000};
+
+    /* 尽量放开 fd 数量限制 */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    for (i = 0; i < (argc > 1 ? argc - 1 : 3); i++) {
+        n = argc > 1 ? atoi(argv[i + 1]) : def[i];
+        if ((rlim_t)n + 16 > rl.rlim_cur) {
+            printf("n=%-7d skipped, RLIMIT_NOFILE is %lu\n", n, (unsigned long)rl.rlim_cur);
+            continue;
+        }
+        bench(n);
+    }
+    taskexitall(0);
+}
@@ -0,0 +1,59 @@
+/*
+ * 协程创建和退出的开销.
+ *
+ * 每轮创建 batch 个协程, 每个协程在栈上用掉一点空间就退出, taskmain 睡在 finished 上
+ * 等这一轮全部退出, 再开始下一轮. 报告每个协程从创建到退出回收的平均时间.
+ * 分别测几种栈大小: 栈来自 stack.c 的缓冲池, 第一轮以后就不再有 mmap/munmap.
+ *
+ * 用法: benchspawn [n [batch]], 默认 n=200000 个协程, 每轮 batch=100 个.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <task.h>
+#include <time.h>
+
+static int left;
+static Rendez finished;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void churn(void *v)
+{
+    volatile char buf[1024];
+
+    memset((char *)buf, 0, sizeof buf);
+    if (--left == 0)
+        taskwakeup(&finished);
+}
+
+void taskmain(int argc, char **argv)
+{
+    static uint sizes[] = {8192, 32768, 262144};
+    int n, batch, i, j, k;
+    uint64_t t0, t;
+
+    n = argc > 1 ? atoi(argv[1]) : 200000;
+    batch = argc > 2 ? atoi(argv[2]) : 100;
+
+    for (k = 0; k < sizeof sizes / sizeof sizes[0]; k++) {
+        t0 = now();
+        for (i = 0; i < n; i += batch) {
+            left = batch;
+            for (j = 0; j < batch; j++)
+                taskcreate(churn, 0, sizes[k]);
+            tasksleep(&finished);
+        }
+        t = now() - t0;
+        printf("stack %6u  %6.1f ns/task\n", sizes[k], (double)t / i);
+    }
+
+    taskexitall(0);
+}
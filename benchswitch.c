@@ -0,0 +1,85 @@
+/*
+ * 协程切换的开销.
+ *
+ * 都按一次交接计时, 即控制权从一方交到另一方:
+ *  - direct: 两个协程互相 taskyield, 默认的直接切换, 一次交接一次上下文切换
+ *  - sched: 同上, 但 taskdirectswitch(0), 一次交接经过调度器, 两次上下文切换
+ *  - ucontext: 两个 glibc ucontext 直接互相 swapcontext, 作为对照. glibc 的 swapcontext
+ *    保存完整的寄存器和浮点环境, 每次还要 rt_sigprocmask 系统调用
+ *
+ * 用法: benchswitch [n], 默认 1000000 次.
+ * 用 make amd64 编译是 amd64-ucontext.h 里的精简切换, make 编译是 i386 上的 get/set 切换.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <task.h>
+#include <time.h>
+#include <ucontext.h>
+
+enum { STACK = 16384 };
+
+static int n;
+static int done;
+static Rendez finished;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void pingpong(void *v)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        taskyield();
+    if (++done == 2)
+        taskwakeup(&finished);
+}
+
+static ucontext_t umain, uping;
+
+static void uloop(void)
+{
+    for (;;)
+        swapcontext(&uping, &umain);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int i;
+    uint64_t t0, t;
+    static char ustack[STACK];
+
+    n = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    /* 两个协程轮流 yield, taskmain 睡在 finished 上等它们结束 */
+    for (i = 1; i >= 0; i--) {
+        taskdirectswitch(i);
+        done = 0;
+        taskcreate(pingpong, 0, STACK);
+        taskcreate(pingpong, 0, STACK);
+        t0 = now();
+        tasksleep(&finished);
+        t = now() - t0;
+        printf("%-9s %6.1f ns/handoff\n", i ? "direct" : "sched", (double)t / (2 * n));
+    }
+    taskdirectswitch(1);
+
+    getcontext(&uping);
+    uping.uc_stack.ss_sp = ustack;
+    uping.uc_stack.ss_size = sizeof ustack;
+    uping.uc_link = 0;
+    makecontext(&uping, uloop, 0);
+    t0 = now();
+    for (i = 0; i < n; i++)
+        swapcontext(&umain, &uping);
+    t = now() - t0;
+    printf("ucontext  %6.1f ns/handoff\n", (double)t / (2 * n));
+
+    taskexitall(0);
+}
@@ -0,0 +1,129 @@
+/*
+ * 时间轮和原来的有序链表(taskdelay 线性查找插入位置)的对比.
+ *
+ * 对每个规模 n, 插入 n 个 10s 内随机到期的定时器, 然后按 1ms 的步长推进时间直到全部到期,
+ * 分别统计插入和到期处理的平均开销.
+ *
+ * 用法: benchtimer [n ...], 默认 1000 10000 100000
+ */
+
+#include "taskimpl.h"
+#include <stdio.h>
+
+enum { SPAN = 10000 }; /* 定时器分布在 SPAN 毫秒内 */
+
+/* 原来 fdtask 的 sleeping 链表 */
+typedef struct Sleeper Sleeper;
+struct Sleeper {
+    uvlong alarmtime;
+    Sleeper *next;
+    Sleeper *prev;
+};
+
+static struct {
+    Sleeper *head;
+    Sleeper *tail;
+} sleeping;
+
+static void listadd(Sleeper *s, uvlong when)
+{
+    Sleeper *t;
+
+    for (t = sleeping.head; t != nil && t->alarmtime < when; t = t->next)
+        ;
+    if (t) {
+        s->prev = t->prev;
+        s->next = t;
+    } else {
+        s->prev = sleeping.tail;
+        s->next = nil;
+    }
+    s->alarmtime = when;
+    if (s->prev)
+        s->prev->next = s;
+    else
+        sleeping.head = s;
+    if (s->next)
+        s->next->prev = s;
+    else
+        sleeping.tail = s;
+}
+
+static int listexpire(uvlong now)
+{
+    Sleeper *s;
+    int n;
+
+    n = 0;
+    while ((s = sleeping.head) && now >= s->alarmtime) {
+        sleeping.head = s->next;
+        if (s->next)
+            s->next->prev = nil;
+        else
+            sleeping.tail = nil;
+        n++;
+    }
+    return n;
+}
+
+static void bench(int n)
+{
+    int i, m;
+    uvlong base, t0, now, *when;
+    uvlong listins, listexp, wheelins, wheelexp;
+    Sleeper *s;
+    Timer *tm;
+
+    when = malloc(n * sizeof when[0]);
+    s = malloc(n * sizeof s[0]);
+    tm = calloc(n, sizeof tm[0]);
+
+    base = nsec();
+    for (i = 0; i < n; i++)
+        when[i] = base + (uvlong)(random() % (SPAN * 1000)) * 1000;
+
+    t0 = nsec();
+    for (i = 0; i < n; i++)
+        listadd(&s[i], when[i]);
+    listins = nsec() - t0;
+
+    t0 = nsec();
+    m = 0;
+    for (now = base; now <= base + (SPAN + 1) * 1000000ULL; now += 1000000)
+        m += listexpire(now);
+    listexp = nsec() - t0;
+    if (m != n)
+        print("list: expired %d of %d\n", m, n);
+
+    t0 = nsec();
+    for (i = 0; i < n; i++)
+        timerset(&tm[i], when[i]);
+    wheelins = nsec() - t0;
+
+    t0 = nsec();
+    m = 0;
+    for (now = base; now <= base + (SPAN + 1) * 1000000ULL; now += 1000000)
+        while (timerexpired(now) != nil)
+            m++;
+    wheelexp = nsec() - t0;
+    if (m != n)
+        print("wheel: expired %d of %d\n", m, n);
+
+    printf("n=%-7d list: insert %8.1f ns  expire %6.1f ns   wheel: insert %6.1f ns  expire %6.1f ns\n",
+           n, (double)listins / n, (double)listexp / n, (double)wheelins / n,
+           (double)wheelexp / n);
+
+    free(when);
+    free(s);
+    free(tm);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int i;
+    static int def[] = {1000, 10000, 100000};
+
+    for (i = 0; i < (argc > 1 ? argc - 1 : 3); i++)
+        bench(argc > 1 ? atoi(argv[i + 1]) : def[i]);
+    taskexitall(0);
+}
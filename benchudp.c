@@ -0,0 +1,165 @@
+/*
+ * 小 UDP 数据报的收发: 每个数据报一次 fdread/fdwrite, 和 udprecv/udpsend 成批收发的对比.
+ *
+ * 同一个进程里一个发送协程通过回环地址往接收协程发 n 个 size 字节的数据报, 一批 BATCH
+ * 个. 在途的数据报超过 WINDOW 个的时候发送方等接收方追上来, 否则发送方一直可以运行,
+ * fdtask 轮询不到接收方, 接收缓冲满了就丢包. 每种写法报告每秒收到的数据报数, 每个数据报
+ * 平均的收发系统调用次数(不算 fdwait), 和丢了多少.
+ *
+ * 用法: benchudp [n] [size], 默认 500000 个 64 字节.
+ */
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { STACK = 32768, BATCH = 64, WINDOW = 1024, MAXSIZE = 1400 };
+
+static int batched;
+static int npkt;
+static int size;
+static int rfd;
+static int done;
+static int sent;
+static int got;
+static QLock lk;
+static Rendez credit = {&lk};
+static long nsys;
+static Channel *finished;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 数据的第一个字节: 'd' 是数据, 'e' 表示发完了 */
+void sender(void *v)
+{
+    int fd, i, j, n;
+    char buf[MAXSIZE];
+    Udpbatch *b;
+
+    fd = netdial(UDP, "127.0.0.1", (int)(long)v);
+    b = udpalloc(BATCH, size);
+    memset(buf, 'd', size);
+    for (i = 0; i < BATCH; i++) {
+        memset(b->msg[i].buf, 'd', size);
+        b->msg[i].len = size;
+    }
+
+    for (i = 0; i < npkt; i += n) {
+        n = npkt - i < BATCH ? npkt - i : BATCH;
+        if (batched) {
+            udpsend(fd, b, n);
+            nsys++;
+        } else {
+            for (j = 0; j < n; j++) {
+                fdwrite(fd, buf, size);
+                nsys++;
+            }
+        }
+        sent += n;
+        qlock(&lk);
+        while (sent - got > WINDOW)
+            tasksleep(&credit);
+        qunlock(&lk);
+    }
+
+    /* 结束标记可能因为接收缓冲满了被丢掉, 一直发到对方收到为止 */
+    buf[0] = 'e';
+    while (!done) {
+        fdwrite(fd, buf, size);
+        taskdelay(1);
+    }
+    udpfree(b);
+    close(fd);
+}
+
+void receiver(void *v)
+{
+    int i, n;
+    char buf[MAXSIZE];
+    Udpbatch *b;
+
+    b = udpalloc(BATCH, size);
+    got = 0;
+    while (!done) {
+        if (batched) {
+            n = udprecv(rfd, b);
+            nsys++;
+            for (i = 0; i < n; i++) {
+                if (b->msg[i].buf[0] == 'e')
+                    done = 1;
+                else
+                    got++;
+            }
+        } else {
+            n = fdread(rfd, buf, sizeof buf);
+            nsys++;
+            if (n > 0 && buf[0] == 'e')
+                done = 1;
+            else if (n > 0)
+                got++;
+        }
+        if (sent - got <= WINDOW / 2) {
+            qlock(&lk);
+            taskwakeup(&credit);
+            qunlock(&lk);
+        }
+    }
+    udpfree(b);
+    chansendul(finished, 0);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int port, n;
+    uint64_t t0, t1;
+    struct sockaddr_in sa;
+    socklen_t sn;
+
+    npkt = argc > 1 ? atoi(argv[1]) : 500000;
+    size = argc > 2 ? atoi(argv[2]) : 64;
+    if (size < 1 || size > MAXSIZE) {
+        fprintf(stderr, "size must be 1..%d\n", MAXSIZE);
+        taskexitall(1);
+    }
+    finished = chancreate(sizeof(unsigned long), 0);
+
+    printf("%d datagrams of %d bytes, batches of %d\n", npkt, size, BATCH);
+    printf("%-22s %12s %12s %8s\n", "", "pkts/s", "syscalls/pkt", "lost");
+    for (batched = 0; batched < 2; batched++) {
+        if ((rfd = netannounce(UDP, "127.0.0.1", 0)) < 0) {
+            fprintf(stderr, "cannot announce\n");
+            taskexitall(1);
+        }
+        n = 4 << 20;
+        setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &n, sizeof n);
+        sn = sizeof sa;
+        getsockname(rfd, (struct sockaddr *)&sa, &sn);
+        port = ntohs(sa.sin_port);
+
+        done = 0;
+        sent = got = 0;
+        nsys = 0;
+        t0 = now();
+        taskcreate(receiver, 0, STACK);
+        taskcreate(sender, (void *)(long)port, STACK);
+        chanrecvul(finished);
+        t1 = now();
+        printf("%-22s %12.0f %12.3f %8d\n", batched ? "udprecv/udpsend" : "fdread/fdwrite",
+               got * 1e9 / (t1 - t0), (double)nsys / npkt, npkt - got);
+        taskdelay(10);
+        close(rfd);
+    }
+    taskexitall(0);
+}
@@ -0,0 +1,172 @@
+/*
+ * 头部 + 正文的应答: 两次 fdwrite, 拷贝到一个缓冲区再 fdwrite, 和一次 fdwritev 的对比.
+ *
+ * 同一个进程里一个回环 TCP 连接做请求-应答: 客户端发 1 字节的请求, 服务端回 HDR 字节
+ * 的头部加 body 字节的正文. 每种写法报告:
+ *  - ns/req: 一次请求-应答的平均耗时
+ *  - writes/req: 服务端每个应答的写系统调用次数
+ *  - segs/req: 每个请求-应答 TCP 发出的段数(/proc/net/snmp 的 OutSegs, 包括请求和 ACK),
+ *    netaccept 打开了 TCP_NODELAY, 两次写就是两个包
+ *
+ * 用法: benchwritev [body] [n], 默认正文 1000 字节, 20000 次.
+ */
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { STACK = 32768, HDR = 200, MAXBODY = 60000 };
+
+enum { TWO, COPY, WRITEV, NMODE };
+static char *modename[] = {"2x fdwrite", "copy+fdwrite", "fdwritev"};
+
+static int mode;
+static int body;
+static int nreq;
+static char hdr[HDR], data[MAXBODY], buf[HDR + MAXBODY], rbuf[HDR + MAXBODY];
+static Channel *done;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* /proc/net/snmp 里 Tcp 的 OutSegs */
+static long outsegs(void)
+{
+    FILE *f;
+    char line[1024], *p;
+    long v;
+    int i, col;
+
+    if ((f = fopen("/proc/net/snmp", "r")) == 0)
+        return -1;
+    col = -1;
+    v = -1;
+    while (fgets(line, sizeof line, f)) {
+        if (strncmp(line, "Tcp:", 4) != 0)
+            continue;
+        p = strtok(line + 4, " \n");
+        for (i = 0; p; i++, p = strtok(0, " \n")) {
+            if (col < 0 && strcmp(p, "OutSegs") == 0) {
+                col = i;
+                break;
+            }
+            if (col >= 0 && i == col) {
+                v = atol(p);
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+void server(void *v)
+{
+    int lfd, fd, m;
+    char c;
+    struct iovec iov[2];
+
+    lfd = (int)(long)v;
+    while ((fd = netaccept(lfd, 0, 0)) >= 0) {
+        while (fdread(fd, &c, 1) == 1) {
+            switch (mode) {
+            case TWO:
+                fdwrite(fd, hdr, HDR);
+                fdwrite(fd, data, body);
+                break;
+            case COPY:
+                memmove(buf, hdr, HDR);
+                memmove(buf + HDR, data, body);
+                fdwrite(fd, buf, HDR + body);
+                break;
+            case WRITEV:
+                iov[0].iov_base = hdr;
+                iov[0].iov_len = HDR;
+                iov[1].iov_base = data;
+                iov[1].iov_len = body;
+                m = fdwritev(fd, iov, 2);
+                if (m != HDR + body) {
+                    fprintf(stderr, "short write %d\n", m);
+                    taskexitall(1);
+                }
+                break;
+            }
+        }
+        close(fd);
+    }
+}
+
+void client(void *v)
+{
+    int fd, i, n, m;
+
+    fd = netdial(TCP, "127.0.0.1", (int)(long)v);
+    if (fd < 0) {
+        fprintf(stderr, "dial failed\n");
+        taskexitall(1);
+    }
+    for (i = 0; i < nreq; i++) {
+        fdwrite(fd, "x", 1);
+        for (n = 0; n < HDR + body; n += m) {
+            if ((m = fdread(fd, rbuf + n, HDR + body - n)) <= 0) {
+                fprintf(stderr, "read failed\n");
+                taskexitall(1);
+            }
+        }
+    }
+    close(fd);
+    chansendul(done, 0);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int lfd, port;
+    uint64_t t0, t1;
+    long s0, s1;
+    struct sockaddr_in sa;
+    socklen_t sn;
+
+    body = argc > 1 ? atoi(argv[1]) : 1000;
+    nreq = argc > 2 ? atoi(argv[2]) : 20000;
+    if (body < 1 || body > MAXBODY) {
+        fprintf(stderr, "body must be 1..%d\n", MAXBODY);
+        taskexitall(1);
+    }
+    memset(hdr, 'h', sizeof hdr);
+    memset(data, 'd', sizeof data);
+    done = chancreate(sizeof(unsigned long), 0);
+
+    if ((lfd = netannounce(TCP, "127.0.0.1", 0)) < 0) {
+        fprintf(stderr, "cannot announce\n");
+        taskexitall(1);
+    }
+    sn = sizeof sa;
+    getsockname(lfd, (struct sockaddr *)&sa, &sn);
+    port = ntohs(sa.sin_port);
+    taskcreate(server, (void *)(long)lfd, STACK);
+
+    printf("header %d bytes, body %d bytes, %d requests\n", HDR, body, nreq);
+    printf("%-14s %10s %10s %10s\n", "", "ns/req", "writes/req", "segs/req");
+    for (mode = 0; mode < NMODE; mode++) {
+        s0 = outsegs();
+        t0 = now();
+        taskcreate(client, (void *)(long)port, STACK);
+        chanrecvul(done);
+        t1 = now();
+        s1 = outsegs();
+        printf("%-14s %10.0f %10d %10.2f\n", modename[mode], (double)(t1 - t0) / nreq, mode == TWO ? 2 : 1,
+               s0 < 0 ? 0.0 : (double)(s1 - s0) / nreq);
+    }
+    taskexitall(0);
+}
@@ -0,0 +1,351 @@
+#include "taskimpl.h"
+
+/*
+ * 带缓冲的读写, 接口模仿 Plan 9 的 bio 和 Go 的 bufio.
+ *
+ * 一个 Biobuf 包着一个 fd, 读写各有一块 BIOSIZE 大小的缓冲. 读的时候一次 fdread 尽量
+ * 读满缓冲, 按行或者按长度分帧的协议可以在一次系统调用读到的数据里解析出多条消息;
+ * 写的时候先攒在缓冲里, 满了或者调用 bioflush 才真正 fdwrite.
+ *
+ * 缓冲区从共享的池子里取: 读缓冲第一次读的时候取, bioterm 时归还; 写缓冲第一次写的
+ * 时候取, 每次 bioflush 写完就归还. 这样只写不读, 或者空闲的连接不会一直占着写缓冲.
+ *
+ * Biobuf 本身不加锁, 同一时间只能由一个协程使用.
+ */
+
+enum {
+    BIOPOOLMAX = 1024, /* 池子里最多缓存的空闲缓冲区数量 */
+};
+
+typedef struct Biofree Biofree;
+struct Biofree {
+    Biofree *next;
+};
+
+static Biofree *biopool;
+static int nbiopool;
+static Lock biolk;
+
+static uchar *bioalloc(void)
+{
+    Biofree *f;
+    uchar *p;
+
+    spinlock(&biolk);
+    if ((f = biopool) != nil) {
+        biopool = f->next;
+        nbiopool--;
+        spinunlock(&biolk);
+        return (uchar *)f;
+    }
+    spinunlock(&biolk);
+
+    p = malloc(BIOSIZE);
+    if (p == nil) {
+        fprint(2, "bioalloc malloc: %r\n");
+        abort();
+    }
+    return p;
+}
+
+static void biofree(uchar *p)
+{
+    Biofree *f;
+
+    spinlock(&biolk);
+    if (nbiopool < BIOPOOLMAX) {
+        f = (Biofree *)p;
+        f->next = biopool;
+        biopool = f;
+        nbiopool++;
+        spinunlock(&biolk);
+        return;
+    }
+    spinunlock(&biolk);
+    free(p);
+}
+
+/**
+ * @brief 读一次 fd, 追加到读缓冲的末尾
+ *
+ * 缓冲区末尾没有空间的时候, 先把未读数据挪到开头
+ *
+ * @param b
+ * @return int fdread 的返回值
+ */
+static int biofill(Biobuf *b)
+{
+    int n;
+
+    if (b->rbuf == nil) {
+        b->rbuf = bioalloc();
+        b->rp = b->re = 0;
+    }
+    if (b->rp == b->re) {
+        b->rp = b->re = 0;
+    } else if (b->re == BIOSIZE && b->rp > 0) {
+        memmove(b->rbuf, b->rbuf + b->rp, b->re - b->rp);
+        b->re -= b->rp;
+        b->rp = 0;
+    }
+
+    n = fdread(b->fd, b->rbuf + b->re, BIOSIZE - b->re);
+    if (n > 0) {
+        b->re += n;
+    }
+    return n;
+}
+
+/**
+ * @brief 初始化 Biobuf, 此时还不占用缓冲区
+ *
+ * @param b
+ * @param fd 要读写的文件描述符, 应该已经 fdnoblock
+ */
+void bioinit(Biobuf *b, int fd)
+{
+    memset(b, 0, sizeof *b);
+    b->fd = fd;
+}
+
+/**
+ * @brief 写出缓冲的数据, 归还缓冲区. 读缓冲里没读的数据丢弃, 不关闭 fd
+ *
+ * @param b
+ * @return int bioflush 的返回值
+ */
+int bioterm(Biobuf *b)
+{
+    int r;
+
+    r = bioflush(b);
+    if (b->rbuf) {
+        biofree(b->rbuf);
+        b->rbuf = nil;
+    }
+    b->rp = b->re = 0;
+    return r;
+}
+
+/**
+ * @brief 和 read 一样, 最多读 n 字节, 有数据就返回
+ *
+ * 缓冲里没有数据并且 n 不小于缓冲区的时候直接读到 v 里, 省一次拷贝
+ *
+ * @param b
+ * @param v
+ * @param n
+ * @return int 读到的字节数, 0 表示 EOF, -1 表示出错
+ */
+int bioread(Biobuf *b, void *v, int n)
+{
+    int m;
+
+    if (b->rp == b->re) {
+        if (n >= BIOSIZE) {
+            return fdread(b->fd, v, n);
+        }
+        if ((m = biofill(b)) <= 0) {
+            return m;
+        }
+    }
+
+    m = b->re - b->rp;
+    if (m > n) {
+        m = n;
+    }
+    memmove(v, b->rbuf + b->rp, m);
+    b->rp += m;
+    return m;
+}
+
+/**
+ * @brief 读满 n 字节, 除非遇到 EOF 或者出错
+ *
+ * @param b
+ * @param v
+ * @param n
+ * @return int 读到的字节数, 一个字节都没读到的时候返回 bioread 的返回值
+ */
+int bioreadn(Biobuf *b, void *v, int n)
+{
+    int m, tot;
+
+    for (tot = 0; tot < n; tot += m) {
+        if ((m = bioread(b, (char *)v + tot, n - tot)) <= 0) {
+            return tot > 0 ? tot : m;
+        }
+    }
+    return tot;
+}
+
+/**
+ * @brief 读一行, 以 delim 结尾
+ *
+ * 返回的指针指向缓冲区内部, 包括结尾的 delim, 不以 0 结尾, 下一次读之前有效.
+ * 行比 BIOSIZE 长的时候返回 nil, errno 设为 ENOBUFS, 数据仍在缓冲里, 可以用 bioread 读走.
+ * EOF 之前最后不完整的一行也用 bioread 读.
+ *
+ * @param b
+ * @param delim 行分隔符, 通常是 '\n'
+ * @param len 返回行的长度; 返回 nil 时是缓冲里剩下的字节数
+ * @return char*
+ */
+char *bioreadline(Biobuf *b, int delim, int *len)
+{
+    uchar *p, *e;
+    int off;
+
+    off = 0; /* 已经找过的部分不再重复找 */
+    for (;;) {
+        if (b->rbuf) {
+            p = b->rbuf + b->rp;
+            e = memchr(p + off, delim, b->re - b->rp - off);
+            if (e) {
+                *len = e - p + 1;
+                b->rp += *len;
+                return (char *)p;
+            }
+            off = b->re - b->rp;
+            if (off == BIOSIZE) {
+                *len = off;
+                errno = ENOBUFS;
+                return nil;
+            }
+        }
+        if (biofill(b) <= 0) {
+            *len = b->re - b->rp;
+            return nil;
+        }
+    }
+}
+
+/**
+ * @brief 不消耗数据, 返回接下来的 n 字节
+ *
+ * @param b
+ * @param n 不能超过 BIOSIZE
+ * @return void* 指向缓冲区内部, 下一次读之前有效; EOF 或者出错时返回 nil
+ */
+void *biopeek(Biobuf *b, int n)
+{
+    if (n > BIOSIZE) {
+        errno = ENOBUFS;
+        return nil;
+    }
+    while (b->re - b->rp < n) {
+        /* 缓冲区后面放不下了, 把未读数据挪到开头 */
+        if (b->rbuf && b->rp + n > BIOSIZE) {
+            memmove(b->rbuf, b->rbuf + b->rp, b->re - b->rp);
+            b->re -= b->rp;
+            b->rp = 0;
+        }
+        if (biofill(b) <= 0) {
+            return nil;
+        }
+    }
+    return b->rbuf + b->rp;
+}
+
+/**
+ * @brief 把数据放进写缓冲, 缓冲满了才真正写出去
+ *
+ * 缓冲为空并且 n 不小于缓冲区的时候直接写, 省一次拷贝
+ *
+ * @param b
+ * @param v
+ * @param n
+ * @return int 成功返回 n, 出错返回 -1
+ */
+int biowrite(Biobuf *b, void *v, int n)
+{
+    int m, tot;
+
+    if (b->wn == 0 && n >= BIOSIZE) {
+        return fdwrite(b->fd, v, n) == n ? n : -1;
+    }
+
+    for (tot = 0; tot < n; tot += m) {
+        if (b->wbuf == nil) {
+            b->wbuf = bioalloc();
+        }
+        m = BIOSIZE - b->wn;
+        if (m > n - tot) {
+            m = n - tot;
+        }
+        memmove(b->wbuf + b->wn, (char *)v + tot, m);
+        b->wn += m;
+        if (b->wn == BIOSIZE && bioflush(b) < 0) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief 格式化后放进写缓冲, 格式和 print 一样
+ *
+ * 直接格式化到写缓冲里. 剩下的地方放不下就先 bioflush 再格式化一次,
+ * 整个缓冲区也放不下(最多 BIOSIZE-2 字节)的时候什么也不写, 返回 -1, errno 为 ENOBUFS
+ *
+ * @param b
+ * @param fmt
+ * @param ...
+ * @return int 写入的字节数, 出错返回 -1
+ */
+int bioprint(Biobuf *b, char *fmt, ...)
+{
+    va_list arg;
+    char *p;
+    int n, m;
+
+    for (;;) {
+        if (b->wbuf == nil) {
+            b->wbuf = bioalloc();
+        }
+        p = (char *)b->wbuf + b->wn;
+        m = BIOSIZE - b->wn;
+        va_start(arg, fmt);
+        vsnprint(p, m, fmt, arg);
+        va_end(arg);
+
+        /* vsnprint 放不下的时候截断并且不报错, 最后一个字节要放 0,
+         * 填满了就当作被截断 */
+        n = strlen(p);
+        if (n < m - 1) {
+            b->wn += n;
+            return n;
+        }
+        if (b->wn == 0) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        if (bioflush(b) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief 写出写缓冲里的全部数据, 并把写缓冲还给池子
+ *
+ * @param b
+ * @return int 成功返回 0, 出错返回 -1, 出错时缓冲的数据被丢弃
+ */
+int bioflush(Biobuf *b)
+{
+    int n;
+
+    if (b->wbuf == nil) {
+        return 0;
+    }
+
+    n = b->wn;
+    if (n > 0) {
+        n = fdwrite(b->fd, b->wbuf, n) == n ? 0 : -1;
+    }
+    b->wn = 0;
+    biofree(b->wbuf);
+    b->wbuf = nil;
+    return n;
+}
@@ -0,0 +1,354 @@
+#include "taskimpl.h"
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+/*
+ * 阻塞调用交给线程池
+ *
+ * 普通文件的 read/write 从来不返回 EAGAIN, open, fsync, stat 之类也没有非阻塞的版本,
+ * 直接在协程里调用会把整个调度线程卡住, 一块慢盘就能让上千个网络协程一起停下来.
+ *
+ * taskblocking 把调用放到一个小的工作线程池里执行, 调用的协程挂起. 工作线程做完之后用
+ * taskwakeasync 唤醒它: 把它挂到唤醒队列上并写 eventfd; 一个系统协程在这个 eventfd 上
+ * fdwait(也就是挂在 fdtask 的 epoll/poll 上), 醒来之后把队列上的协程放回调度队列.
+ * 别的线程要唤醒协程(xchan.c)也走这条路.
+ *
+ * 工作线程按需创建, 最多 blockprocs 个, 创建之后不退出. 任务结构放在调用者的栈上,
+ * 调用者一直等到做完才返回, 所以不需要分配内存.
+ */
+
+enum {
+    BLOCKSTACK = 32768,
+    BLOCKPROCS = 4,
+};
+
+typedef struct Blockjob Blockjob;
+struct Blockjob {
+    Taskwake w; /* 做完之后唤醒调用者 */
+    long (*fn)(void *);
+    void *arg;
+    long ret;
+    int err; /* 工作线程里 fn 返回后的 errno */
+    Blockjob *next;
+};
+
+static pthread_mutex_t blocklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blockcond = PTHREAD_COND_INITIALIZER;
+static Blockjob *jobhead; /* 等待执行的 */
+static Blockjob *jobtail;
+static int njob; /* 队列里还没有被取走的 */
+static int blockprocs = BLOCKPROCS;
+static int nworker;
+static int nidleworker;
+
+static pthread_mutex_t wakelock = PTHREAD_MUTEX_INITIALIZER;
+static Taskwake *wakehead; /* 等着放回调度队列的 */
+static int wakefd = -1;
+
+/**
+ * @brief 工作线程, 从队列里取任务执行
+ */
+static void *blockworker(void *v)
+{
+    Blockjob *j;
+
+    pthread_mutex_lock(&blocklock);
+    for (;;) {
+        while ((j = jobhead) == nil) {
+            nidleworker++;
+            pthread_cond_wait(&blockcond, &blocklock);
+            nidleworker--;
+        }
+        if ((jobhead = j->next) == nil) {
+            jobtail = nil;
+        }
+        njob--;
+        pthread_mutex_unlock(&blocklock);
+
+        errno = 0;
+        j->ret = j->fn(j->arg);
+        j->err = errno;
+        taskwakeasync(&j->w);
+
+        pthread_mutex_lock(&blocklock);
+    }
+    return nil;
+}
+
+/**
+ * @brief 把别的线程唤醒的协程放回调度队列, 系统协程
+ *
+ * eventfd 非信号量模式, 一次读把计数清零; 读完之后才取唤醒队列,
+ * 取完之后才挂上来的会再写一次 eventfd, 不会漏掉
+ */
+static void waketask(void *v)
+{
+    Taskwake *w, *next;
+    uvlong n;
+
+    tasksystem();
+    taskname("wakeup");
+    for (;;) {
+        taskstate("wait");
+        if (fdread(wakefd, &n, sizeof n) != sizeof n) {
+            fprint(2, "wakeup: read eventfd: %r\n");
+            abort();
+        }
+
+        pthread_mutex_lock(&wakelock);
+        w = wakehead;
+        wakehead = nil;
+        pthread_mutex_unlock(&wakelock);
+
+        for (; w != nil; w = next) {
+            next = w->next;
+            taskready(w->task);
+        }
+    }
+}
+
+/**
+ * @brief 准备好 taskwakeasync 要用的 eventfd 和系统协程, 在协程里调用
+ *
+ * 别的线程只会唤醒已经挂起的协程, 协程挂起之前调用一次就够了
+ */
+void taskwakeinit(void)
+{
+    int start;
+
+    /* 只在开始的时候写一次, 已经准备好了就不用加锁 */
+    if (wakefd >= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&wakelock);
+    start = wakefd < 0;
+    if (start && (wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprint(2, "taskwakeinit eventfd: %r\n");
+        abort();
+    }
+    pthread_mutex_unlock(&wakelock);
+    if (start) {
+        fdreset(wakefd);
+        taskcreate(waketask, nil, BLOCKSTACK);
+    }
+}
+
+/**
+ * @brief 在任意线程里唤醒挂起的协程 w->task
+ *
+ * 调度器的数据结构只有调度线程能碰, 所以这里只是把 w 挂到唤醒队列上再写 eventfd,
+ * 由 waketask 去 taskready. w 在协程被放回调度队列之前必须一直有效
+ *
+ * @param w
+ */
+void taskwakeasync(Taskwake *w)
+{
+    uvlong one;
+    int first;
+
+    pthread_mutex_lock(&wakelock);
+    first = wakehead == nil;
+    w->next = wakehead;
+    wakehead = w;
+    pthread_mutex_unlock(&wakelock);
+
+    /* 队列原来不空的话 eventfd 已经写过, waketask 还没取走 */
+    if (first) {
+        one = 1;
+        write(wakefd, &one, sizeof one);
+    }
+}
+
+/**
+ * @brief 设置工作线程的最大数量, 默认 4
+ *
+ * 已经创建的线程不会减少
+ *
+ * @param n 小于等于 0 时不修改
+ * @return int 修改之前的值
+ */
+int taskblockingprocs(int n)
+{
+    int old;
+
+    pthread_mutex_lock(&blocklock);
+    old = blockprocs;
+    if (n > 0) {
+        blockprocs = n;
+    }
+    pthread_mutex_unlock(&blocklock);
+    return old;
+}
+
+/**
+ * @brief 在工作线程里执行 fn(arg), 当前协程挂起等它返回, 别的协程照常运行
+ *
+ * fn 运行在另一个线程上, 不能调用任何 libtask 的函数
+ *
+ * @param fn
+ * @param arg
+ * @return long fn 的返回值, errno 是 fn 返回时工作线程里的 errno
+ */
+long taskblocking(long (*fn)(void *), void *arg)
+{
+    Blockjob j;
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    taskwakeinit();
+    j.fn = fn;
+    j.arg = arg;
+    j.w.task = taskrunning;
+    j.next = nil;
+
+    /* waketask 可能在我们切走之前就唤醒我们, 见 task.c 的 oncpu */
+    pthread_mutex_lock(&blocklock);
+    if (jobtail) {
+        jobtail->next = &j;
+    } else {
+        jobhead = &j;
+    }
+    jobtail = &j;
+    njob++;
+
+    /* 被叫醒的空闲线程要过一会儿才会把自己从 nidleworker 里减掉,
+     * 所以按排队的任务数而不是有没有空闲线程来决定要不要加线程 */
+    if (nidleworker > 0) {
+        pthread_cond_signal(&blockcond);
+    }
+    if (njob > nidleworker && nworker < blockprocs) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, blockworker, nil) != 0) {
+            fprint(2, "taskblocking: pthread_create: %r\n");
+            abort();
+        }
+        pthread_attr_destroy(&attr);
+        nworker++;
+    }
+    pthread_mutex_unlock(&blocklock);
+
+    taskstate("blocking");
+    taskswitch();
+
+    errno = j.err;
+    return j.ret;
+}
+
+typedef struct Fileop Fileop;
+struct Fileop {
+    int fd;
+    void *buf;
+    int n;
+    char *path;
+    int mode;
+};
+
+static long fileread1(void *v)
+{
+    Fileop *op;
+
+    op = v;
+    return read(op->fd, op->buf, op->n);
+}
+
+/* 和 fdwrite 一样写完全部才返回 */
+static long filewrite1(void *v)
+{
+    Fileop *op;
+    int m, tot;
+
+    op = v;
+    for (tot = 0; tot < op->n; tot += m) {
+        if ((m = write(op->fd, (char *)op->buf + tot, op->n - tot)) < 0) {
+            return tot > 0 ? tot : -1;
+        }
+        if (m == 0) {
+            break;
+        }
+    }
+    return tot;
+}
+
+static long fileopen1(void *v)
+{
+    Fileop *op;
+
+    op = v;
+    return open(op->path, op->mode | O_CLOEXEC, 0666);
+}
+
+static long filesync1(void *v)
+{
+    Fileop *op;
+
+    op = v;
+    return fsync(op->fd);
+}
+
+/**
+ * @brief 在工作线程里 open, 文件不在页缓存里的时候 open 也会等磁盘
+ *
+ * @param path
+ * @param mode open 的 flags, 新建的文件权限是 0666 & ~umask
+ * @return int
+ */
+int fileopen(char *path, int mode)
+{
+    Fileop op;
+
+    op.path = path;
+    op.mode = mode;
+    return taskblocking(fileopen1, &op);
+}
+
+/**
+ * @brief 在工作线程里 read, 用于普通文件
+ *
+ * @param fd
+ * @param buf
+ * @param n
+ * @return int
+ */
+int fileread(int fd, void *buf, int n)
+{
+    Fileop op;
+
+    op.fd = fd;
+    op.buf = buf;
+    op.n = n;
+    return taskblocking(fileread1, &op);
+}
+
+/**
+ * @brief 在工作线程里 write, 写完全部才返回
+ *
+ * @param fd
+ * @param buf
+ * @param n
+ * @return int
+ */
+int filewrite(int fd, void *buf, int n)
+{
+    Fileop op;
+
+    op.fd = fd;
+    op.buf = buf;
+    op.n = n;
+    return taskblocking(filewrite1, &op);
+}
+
+/**
+ * @brief 在工作线程里 fsync
+ *
+ * @param fd
+ * @return int
+ */
+int filesync(int fd)
+{
+    Fileop op;
+
+    op.fd = fd;
+    return taskblocking(filesync1, &op);
+}
@@ -2,6 +2,8 @@
 
 #include "taskimpl.h"
 
+#define ALTGONE (~0U) /* Alt.ai: 已经从通道的等待队列上摘下来了 */
+
 /**
  * @brief 创建一个通道
  *
@@ -30,7 +32,8 @@ Channel *chancreate(int elemsize, int bufsize)
 /**
  * @brief 释放通道对象
  *
- * bug - work out races
+ * 先 chanclose, 还在等的协程醒来的时候返回失败, 不会再碰这个通道.
+ * 之后谁再用这个通道是调用者的 bug
  *
  * @param c
  */
@@ -39,43 +42,198 @@ void chanfree(Channel *c)
     if (c == nil)
         return;
 
+    chanclose(c);
     free(c->name);
     free(c->arecv.a);
     free(c->asend.a);
     free(c);
 }
 
+/**
+ * @brief [0, n) 之间的伪随机数
+ *
+ * 每个调度线程一个 xorshift64* 状态, 不像 rand() 那样要加锁.
+ * 用乘法而不是取模把 32 位的随机数缩到 [0, n)
+ *
+ * @param n
+ * @return uint
+ */
+static uint altrand(uint n)
+{
+    Proc *p;
+    uvlong x;
+
+    p = proc();
+    if ((x = p->rng) == 0) {
+        x = 0x9E3779B97F4A7C15ULL * (p->id + 1);
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    p->rng = x;
+    return (uint)(((x * 0x2545F4914F6CDD1DULL) >> 32) * n >> 32);
+}
+
+/**
+ * @brief 把 FIFO 队列里撤掉留下的空位挤掉, 保持先后顺序
+ *
+ * @param a
+ */
+static void compactarray(Altarray *a)
+{
+    uint i, j;
+
+    for (i = a->h, j = 0; i < a->e; i++) {
+        if (a->a[i]) {
+            a->a[j] = a->a[i];
+            a->a[j]->ai = j;
+            j++;
+        }
+    }
+    a->h = 0;
+    a->e = j;
+}
+
 /**
  * @brief 向 altarray 中追加元素
  *
- * 如果队列已满, 追加 16 个空闲空间然后再添加元素
+ * 元素记住自己的下标 ai, 撤掉的时候不用查找. 放满的时候空位多就挤一挤,
+ * 否则容量翻倍, 追加均摊 O(1)
  *
  * @param a
  * @param alt
  */
 static void addarray(Altarray *a, Alt *alt)
 {
-    if (a->n == a->m) {
-        a->m += 16;
-        a->a = realloc(a->a, a->m * sizeof(a->a[0]));
+    if (a->e == a->m) {
+        if (a->m > 0 && a->m - a->n >= a->m / 2) {
+            compactarray(a);
+        } else {
+            a->m = a->m ? 2 * a->m : 16;
+            a->a = realloc(a->a, a->m * sizeof(a->a[0]));
+            if (a->a == nil) {
+                fprint(2, "addarray realloc: %r\n");
+                abort();
+            }
+        }
     }
 
-    a->a[a->n++] = alt;
+    alt->ai = a->e;
+    a->a[a->e++] = alt;
+    a->n++;
 }
 
 /**
  * @brief 在队列里面删除第 i 个位置的元素
  *
- * 删除之后将队列末尾的元素填充到位置 i 上
- * 这里的操作也说明, 队列是没有顺序的概念的
+ * 随机策略下将队列末尾的元素填充到位置 i 上, 队列没有顺序的概念, a[0, n) 没有空位;
+ * FIFO 策略下位置 i 留空, 排队的先后不变. 空位在队头的话 h 往后挪到第一个还在等的,
+ * 中间的空位等 addarray 放满的时候再挤掉. 两种都是 O(1)
  *
  * @param a
  * @param i
+ * @param fifo
  */
-static void delarray(Altarray *a, int i)
+static void delarray(Altarray *a, uint i, int fifo)
 {
     --a->n;
-    a->a[i] = a->a[a->n];
+    if (!fifo) {
+        a->a[i] = a->a[--a->e];
+        a->a[i]->ai = i;
+        return;
+    }
+
+    a->a[i] = nil;
+    if (a->n == 0) {
+        a->h = a->e = 0;
+    } else if (i == a->h) {
+        while (a->a[a->h] == nil) {
+            a->h++;
+        }
+    }
+}
+
+/**
+ * @brief 设置通道配对等待者的策略
+ *
+ * 默认在等待的发送者(接收者)里随机挑一个配对. 打开 FIFO 之后总是挑等得最久的那个.
+ * 两种策略下登记和撤掉等待者都是 O(1)
+ *
+ * @param c
+ * @param on 非 0 表示 FIFO
+ */
+void chanfifo(Channel *c, int on)
+{
+    spinlock(&c->lk);
+    c->fifo = on != 0;
+    /* 随机策略要求队列里没有空位 */
+    if (!c->fifo) {
+        compactarray(&c->asend);
+        compactarray(&c->arecv);
+    }
+    spinunlock(&c->lk);
+}
+
+/**
+ * @brief 按地址从小到大给 a 里面的通道加锁, 同一个通道只加一次
+ *
+ * 几个协程 alt 同一组通道的时候加锁的顺序一致, 不会死锁.
+ * n 很小, 每一轮找比上一个大的最小地址就行
+ *
+ * @param a
+ * @param n
+ */
+static void altlock(Alt *a, int n)
+{
+    Channel *c, *last;
+    int i;
+
+    if (!taskmt) {
+        return;
+    }
+
+    for (last = nil;; last = c) {
+        c = nil;
+        for (i = 0; i < n; i++) {
+            if (a[i].op != CHANNOP && (uintptr_t)a[i].c > (uintptr_t)last &&
+                (c == nil || (uintptr_t)a[i].c < (uintptr_t)c)) {
+                c = a[i].c;
+            }
+        }
+        if (c == nil) {
+            return;
+        }
+        spinlock(&c->lk);
+    }
+}
+
+/**
+ * @brief 放开 altlock 加的锁
+ *
+ * @param a
+ * @param n
+ */
+static void altunlock(Alt *a, int n)
+{
+    int i, j;
+
+    if (!taskmt) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (a[i].op == CHANNOP) {
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (a[j].op != CHANNOP && a[j].c == a[i].c) {
+                break;
+            }
+        }
+        if (j == i) {
+            spinunlock(&a[i].c->lk);
+        }
+    }
 }
 
 /*
@@ -137,6 +295,12 @@ static int altcanexec(Alt *a)
     }
 
     c = a->c;
+
+    /* 关闭了的通道上收发都能马上结束: 取缓冲区里剩下的, 或者失败 */
+    if (c->closed) {
+        return 1;
+    }
+
     if (c->bufsize == 0) {
         /* buf == 0 表示没有缓冲区, 需要直接向 asend/arecv 写入/读取数据 */
         ar = chanarray(c, otherop(a->op));
@@ -169,13 +333,12 @@ static void altqueue(Alt *a)
 }
 
 /**
- * @brief 将 alt 从通道对应的缓冲队列中删去
+ * @brief 将 alt 从通道对应的缓冲队列中删去, 调用者持有 a->c->lk
  *
  * @param a 待删除的数据
  */
 static void altdequeue(Alt *a)
 {
-    int i;
     Altarray *ar;
 
     ar = chanarray(a->c, a->op);
@@ -184,20 +347,21 @@ static void altdequeue(Alt *a)
         abort();
     }
 
-    for (i = 0; i < ar->n; i++) {
-        if (ar->a[i] == a) {
-            delarray(ar, i);
-            return;
-        }
+    /* altqueue 记下了 a 在队列里的下标, 不用查找 */
+    if (a->ai >= ar->e || ar->a[a->ai] != a) {
+        fprint(2, "cannot find self in altdq\n");
+        abort();
     }
-
-    fprint(2, "cannot find self in altdq\n");
-    abort();
+    delarray(ar, a->ai, a->c->fifo);
+    a->ai = ALTGONE;
 }
 
 /**
  * @brief 找到 a 对应的数组中的元素, 并在它们所属的 channel 对应队列里面删除掉
  *
+ * 唤醒我们的一方已经摘掉了它那一个, 认领不到我们的也会顺手摘掉, 这些跳过.
+ * 一次只持有一个通道的锁
+ *
  * @param a
  */
 static void altalldequeue(Alt *a)
@@ -205,10 +369,14 @@ static void altalldequeue(Alt *a)
     int i;
 
     /* CHANEND/CHANNOBLK 都是一组 _chanop 函数参数的结束标志
-     * 理解这句话请结合 altexec 函数的清理部分一起看 */
+     * 理解这句话请结合 _chanalt 函数的清理部分一起看 */
     for (i = 0; a[i].op != CHANEND && a[i].op != CHANNOBLK; i++) {
         if (a[i].op != CHANNOP) {
-            altdequeue(&a[i]);
+            spinlock(&a[i].c->lk);
+            if (a[i].ai != ALTGONE) {
+                altdequeue(&a[i]);
+            }
+            spinunlock(&a[i].c->lk);
         }
     }
 }
@@ -317,66 +485,151 @@ static void altcopy(Alt *s, Alt *r)
 }
 
 /**
- * @brief 真正的执行 a[0]->op 操作
+ * @brief 从等待队列 ar 里挑一个对手: FIFO 取最早的, 否则随机取
+ *
+ * @param c
+ * @param ar 非空的等待队列
+ * @return Alt*
+ */
+static Alt *altpeer(Channel *c, Altarray *ar)
+{
+    return ar->a[c->fifo || ar->n == 1 ? ar->h : altrand(ar->n)];
+}
+
+/**
+ * @brief 从等待队列 ar 里挑一个对手, 摘下来并认领它的协程, 调用者持有 c->lk
+ *
+ * 认领不到的对手已经被别的通道或者超时唤醒了, 摘掉之后接着挑
+ *
+ * @param c
+ * @param ar
+ * @return Alt* 没有能认领的对手返回 nil
+ */
+static Alt *altclaim(Channel *c, Altarray *ar)
+{
+    Alt *other;
+
+    while (ar->n > 0) {
+        other = altpeer(c, ar);
+        altdequeue(other);
+        if (taskclaim(other->task)) {
+            return other;
+        }
+    }
+    return nil;
+}
+
+/**
+ * @brief 对手 other 的操作已经完成, 唤醒它
  *
- * 本函数调用之前已经做了 altcanexec 检查
+ * other 已经被 altclaim 摘下来了, 它在别的通道上的暂存由它醒来之后自己撤掉
+ *
+ * @param other
+ */
+static void altwake(Alt *other)
+{
+    /* 这个赋值操作主要是为了 chanalt 函数(它因为阻塞, 被 switch out 了)
+     * 能正确的返回大于 0 的值表示自己执行成功了 */
+    other->xalt[0].xalt = other;
+
+    /* 对手协程已经完成读取/发送数据, 将它标记为 READY, 后面可以继续被调度执行 */
+    taskready(other->task);
+}
+
+/**
+ * @brief 真正的执行 a[0]->op 操作, 调用者持有 a->c->lk
+ *
+ * 本函数调用之前已经做了 altcanexec 检查. 但是等着的对手可能都已经被别人唤醒了,
+ * 没有缓冲区的通道上这时候执行不了
  *
  * @param a
+ * @return int 执行了返回 1, 执行不了返回 0
  */
-static void altexec(Alt *a)
+static int altexec(Alt *a)
 {
-    int i;
     Altarray *ar;
     Alt *other;
     Channel *c;
 
     c = a->c;
 
+    /* 关闭之后没有人在等, 接收先把缓冲区里剩下的取完 */
+    if (c->closed) {
+        if (a->op == CHANRCV && c->nbuf > 0) {
+            altcopy(a, nil);
+        } else {
+            a->closed = 1;
+            if (a->op == CHANRCV) {
+                amove(a->v, nil, c->elemsize);
+            }
+        }
+        return 1;
+    }
+
     /* 找到对手端(比如如果 a->op 是读, 则对手端是写) */
     ar = chanarray(c, otherop(a->op));
 
-    if (ar && ar->n) {
-        /* 走到这里意味着有某个 coroutine 正在阻塞等待 op 相反操作的数据, 这样 op 和它就可以
-         * 相互成全了(一个接一个发)
-         * 另外, 如果有多个 coroutine 都在阻塞等待, 他们拿到的数据是不保证顺序的 */
-
-        /* 随机从可以相互成全的队列里面取一个, 开始 a->op/other(a->op) 操作
-         * other 就是 a->op 的对手, 比如:
-         *  - op = CHANSND, 对应对手就是 arecv 暂存区的请求
-         *  - op = CHANRCV, 对应对手就是 asend 暂存区的请求 */
-        i = rand() % ar->n;
-        other = ar->a[i];
-
+    /* 走到这里意味着有某个 coroutine 正在阻塞等待 op 相反操作的数据, 这样 op 和它就可以
+     * 相互成全了(一个接一个发)
+     * 另外, 如果有多个 coroutine 都在阻塞等待, 他们拿到的数据是不保证顺序的
+     *
+     * 从可以相互成全的队列里面取一个(FIFO 取最早的, 否则随机取), 开始 a->op/other(a->op) 操作
+     * other 就是 a->op 的对手, 比如:
+     *  - op = CHANSND, 对应对手就是 arecv 暂存区的请求
+     *  - op = CHANRCV, 对应对手就是 asend 暂存区的请求 */
+    if (ar && (other = altclaim(c, ar)) != nil) {
         /* 根据 a->op, 将 other 拷贝到 a, 或者将 a 拷贝到 other. 完成这个互相成全的过程 */
         altcopy(a, other);
+        altwake(other);
+        return 1;
+    }
 
-        /* 此时 other 对应的动作已经执行完成, 将它从请求队列里面剔除 */
-        altalldequeue(other->xalt);
+    /* 没有对手, 对手都被别人抢走了 */
+    if (c->bufsize == 0) {
+        return 0;
+    }
 
-        /* 这个赋值操作主要是为了 chanalt 函数(它因为阻塞, 被 switch out 了)
-         * 能正确的返回大于 0 的值表示自己执行成功了 */
-        other->xalt[0].xalt = other;
+    /* 这里是没有暂存队列的情况, 没有暂存队列就意味着自己没有对手操作, 这样就要依赖缓冲区
+     * altcanexec 会保证缓冲区一定可用 */
+    altcopy(a, nil);
+    return 1;
+}
 
-        /* 对手协程已经完成读取/发送数据, 将它标记为 READY, 后面可以继续被调度执行 */
-        taskready(other->task);
-    } else {
-        /* 这里是没有暂存队列的情况, 没有暂存队列就意味着自己没有对手操作, 这样就要依赖缓冲区
-         * altcanexec 会保证缓冲区一定可用 */
-        altcopy(a, nil);
+/**
+ * @brief 关闭通道
+ *
+ * 所有等着收和等着发的协程都被唤醒, 操作失败. 之后发送马上失败;
+ * 接收先把缓冲区里剩下的取完, 取空之后马上失败. 失败返回 -1, errno 是 EPIPE,
+ * chanrecvul/chanrecvp 这种没法报错的返回 0. 关闭已经关闭的通道什么也不做
+ *
+ * @param c
+ */
+void chanclose(Channel *c)
+{
+    Alt *w;
+
+    spinlock(&c->lk);
+    c->closed = 1;
+    while ((w = altclaim(c, &c->arecv)) != nil || (w = altclaim(c, &c->asend)) != nil) {
+        w->closed = 1;
+        if (w->op == CHANRCV) {
+            amove(w->v, nil, c->elemsize);
+        }
+        altwake(w);
     }
+    spinunlock(&c->lk);
 }
 
 /**
- * @brief 发送或者接受数据
- *
- * 本项目通篇只有一个调用者, 且 a 只能是 a[2] 数组
+ * @brief 带截止时间的 chanalt
  *
  * @param a
- * @return int 负数表示出错, 0 表示成功
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 执行了的 alt 的下标, 不能执行(非阻塞, errno 为 EAGAIN)或者超时(errno 为 ETIMEDOUT)返回 -1
  */
-int chanalt(Alt *a)
+static int _chanalt(Alt *a, uvlong deadline)
 {
-    int i, j, ncan, n, canblock;
+    int i, j, ncan, first, n, canblock, timedout;
     Task *t;
 
     needstack(512);
@@ -393,55 +646,112 @@ int chanalt(Alt *a)
     for (i = 0; i < n; i++) {
         a[i].task = t;
         a[i].xalt = a; /* xalt 将来用于完成 op 之后, 清理暂存使用 */
+        a[i].closed = 0;
     }
 
-    /* 算一下允许执行的 op 的数量 */
-    ncan = 0;
-    for (i = 0; i < n; i++) {
-        if (altcanexec(&a[i])) {
-            ncan++;
-        }
-    }
-
-    /* 接下来正式执行(非阻塞模式)
-     * 随机在 a 里面选取一个 alt, 然后执行它
-     * TODO-DONE: 只执行一个够吗?
-     * 答: 先按照 a 只有最多 2 个元素理解 */
-    if (ncan) {
-        j = rand() % ncan;
+    altlock(a, n);
+    for (;;) {
+        /* 算一下允许执行的 op 的数量 */
+        ncan = 0;
+        first = -1;
         for (i = 0; i < n; i++) {
             if (altcanexec(&a[i])) {
-                if (j-- == 0) {
-                    altexec(&a[i]);
-                    return i;
+                if (ncan++ == 0) {
+                    first = i;
+                }
+            }
+        }
+
+        if (ncan == 0) {
+            break;
+        }
+
+        /* 只有一个能执行(_chanop 的单个操作总是这样), 不需要随机.
+         * 否则随机在能执行的里面选取一个, 然后执行它
+         * TODO-DONE: 只执行一个够吗?
+         * 答: 先按照 a 只有最多 2 个元素理解 */
+        i = first;
+        if (ncan > 1) {
+            for (j = altrand(ncan), i = 0; i < n; i++) {
+                if (altcanexec(&a[i]) && j-- == 0) {
+                    break;
                 }
             }
         }
+
+        /* 对手都被别人抢先唤醒了的话重新算一遍 */
+        if (altexec(&a[i])) {
+            altunlock(a, n);
+            return i;
+        }
     }
 
     /* 不允许阻塞又无法操作的 case, 数据就丢失了
      * 1. 无缓存区, 使用 non-block API 操作通道
      * 2. 有缓存区, 但是缓存区满了  */
     if (!canblock) {
+        altunlock(a, n);
+        errno = EAGAIN;
         return -1;
     }
 
     /* 允许阻塞的情况, 将数据放到暂存区, 切出任务的执行(阻塞效果)
      * 阻塞发送/阻塞获取都可以追加到相应的暂存区里面 */
+    taskwaitbegin();
     for (i = 0; i < n; i++) {
         if (a[i].op != CHANNOP) {
             altqueue(&a[i]); /* 看这里将全部的 a 操作元素都压进队列里面去了 */
         }
     }
+    altunlock(a, n);
 
     /* 当前协程阻塞了, 调度到其他携程上执行 */
-    taskswitch();
-
-    /* the guy who ran the op took care of dequeueing us
-     * and then set a[0].alt to the one that was executed. */
+    timedout = taskwait(deadline, nil, nil) < 0;
+
+    /* the guy who ran the op took care of dequeueing that one
+     * and then set a[0].alt to the one that was executed.
+     * 其他通道上的暂存(超时的话是全部)由我们自己撤掉 */
+    altalldequeue(a);
+    if (timedout) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
     return a[0].xalt - a;
 }
 
+/**
+ * @brief 发送或者接受数据
+ *
+ * 关闭了的通道上的操作总是可以执行的, 选中它的时候它的 closed 被置位
+ *
+ * @param a
+ * @return int 执行了的 alt 的下标, 不能执行(非阻塞)返回 -1
+ */
+int chanalt(Alt *a)
+{
+    return _chanalt(a, 0);
+}
+
+/**
+ * @brief 多路选择, 带超时和默认分支
+ *
+ * a 是一组 CHANSND/CHANRCV, 以 CHANEND 或者 CHANNOBLK 结尾:
+ *  - 有能执行的就随机执行其中一个, 返回它的下标
+ *  - 以 CHANNOBLK 结尾(默认分支)的时候一个都不能执行马上返回 -1, errno 为 EAGAIN
+ *  - 以 CHANEND 结尾的时候挂在所有通道上等, 到了 deadline 还没有执行的返回 -1,
+ *    errno 为 ETIMEDOUT. deadline 为 0 表示一直等, 和 chanalt 一样
+ * 不想参加这一轮的分支把 op 设成 CHANNOP. 在每个通道上登记和撤掉都是 O(1),
+ * 和通道上已经有多少等待者没有关系
+ *
+ * @param a
+ * @param deadline 截止时间(tasknow 的 ns)
+ * @return int 执行了的 alt 的下标, 失败返回 -1
+ */
+int chanaltt(Alt *a, uint64_t deadline)
+{
+    return _chanalt(a, deadline);
+}
+
 /**
  * @brief channel 操作
  *
@@ -449,9 +759,10 @@ int chanalt(Alt *a)
  * @param op 具体操作值
  * @param p 操作的数据
  * @param canblock 是否阻塞
- * @return int (1)-成功, (-1)-失败
+ * @param deadline 阻塞的截止时间, 0 表示一直等
+ * @return int (1)-成功, (-1)-失败(通道关闭的时候 errno 是 EPIPE)
  */
-static int _chanop(Channel *c, int op, void *p, int canblock)
+static int _chanop(Channel *c, int op, void *p, int canblock, uvlong deadline)
 {
     Alt a[2];
 
@@ -461,13 +772,174 @@ static int _chanop(Channel *c, int op, void *p, int canblock)
     a[1].op = canblock ? CHANEND : CHANNOBLK;
 
     /* 执行具体的动作 */
-    if (chanalt(a) < 0) {
+    if (_chanalt(a, deadline) < 0) {
+        return -1;
+    }
+
+    if (a[0].closed) {
+        errno = EPIPE;
         return -1;
     }
 
     return 1;
 }
 
+/**
+ * @brief 把 v 开始的 n 个元素放进环形缓冲区, 调用者保证放得下, 最多拷贝两段
+ */
+static void ringput(Channel *c, uchar *v, uint n)
+{
+    uint i, m;
+
+    i = (c->off + c->nbuf) % c->bufsize;
+    m = c->bufsize - i < n ? c->bufsize - i : n;
+    memmove(c->buf + i * c->elemsize, v, m * c->elemsize);
+    memmove(c->buf, v + m * c->elemsize, (n - m) * c->elemsize);
+    c->nbuf += n;
+}
+
+/**
+ * @brief 从环形缓冲区取 n 个元素到 v, 调用者保证有这么多, 最多拷贝两段
+ */
+static void ringget(Channel *c, uchar *v, uint n)
+{
+    uint m;
+
+    m = c->bufsize - c->off < n ? c->bufsize - c->off : n;
+    memmove(v, c->buf + c->off * c->elemsize, m * c->elemsize);
+    memmove(v + m * c->elemsize, c->buf, (n - m) * c->elemsize);
+    c->off = (c->off + n) % c->bufsize;
+    c->nbuf -= n;
+}
+
+/**
+ * @brief 不阻塞地发送 v 开始的最多 n 个元素, 调用者持有 c->lk
+ *
+ * 先直接交给等着的接收者(只有缓冲区空的时候才会有), 再整块拷进缓冲区
+ *
+ * @return int 发出去的个数
+ */
+static int chansendn1(Channel *c, uchar *v, int n)
+{
+    Alt *r;
+    int i, m;
+
+    if (c->closed) {
+        return 0;
+    }
+
+    for (i = 0; i < n && c->nbuf == 0 && (r = altclaim(c, &c->arecv)) != nil; i++) {
+        amove(r->v, v + i * c->elemsize, c->elemsize);
+        altwake(r);
+    }
+
+    m = c->bufsize - c->nbuf < n - i ? c->bufsize - c->nbuf : n - i;
+    if (m > 0) {
+        ringput(c, v + i * c->elemsize, m);
+        i += m;
+    }
+    return i;
+}
+
+/**
+ * @brief 不阻塞地接收最多 n 个元素到 v, 调用者持有 c->lk
+ *
+ * 先整块取出缓冲区里的, 缓冲区取空了再直接从等着的发送者那里拿.
+ * 取完之后缓冲区腾出了地方, 把等着的发送者的元素放进去, 让它们也能继续运行
+ *
+ * @return int 收到的个数
+ */
+static int chanrecvn1(Channel *c, uchar *v, int n)
+{
+    Alt *s;
+    int i;
+
+    i = c->nbuf < n ? c->nbuf : n;
+    if (i > 0) {
+        ringget(c, v, i);
+    }
+
+    for (; i < n && c->nbuf == 0 && (s = altclaim(c, &c->asend)) != nil; i++) {
+        amove(v + i * c->elemsize, s->v, c->elemsize);
+        altwake(s);
+    }
+
+    while (c->nbuf < c->bufsize && (s = altclaim(c, &c->asend)) != nil) {
+        ringput(c, s->v, 1);
+        altwake(s);
+    }
+    return i;
+}
+
+/**
+ * @brief 一次发送最多 n 个元素
+ *
+ * 一个都发不出去的时候阻塞, 直到发出去第一个, 然后不阻塞地尽量多发.
+ * 等着的接收者都在这一次里处理掉, 不用每个元素走一遍 chanalt
+ *
+ * @param c 通道
+ * @param v n 个元素的数组
+ * @param n
+ * @return int 发出去的个数, 至少是 1 (n 大于 0 时); 通道关闭了返回 -1
+ */
+int chansendn(Channel *c, void *v, int n)
+{
+    int m;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    spinlock(&c->lk);
+    m = chansendn1(c, v, n);
+    spinunlock(&c->lk);
+    if (m > 0) {
+        return m;
+    }
+
+    if (_chanop(c, CHANSND, v, 1, 0) < 0) {
+        return -1;
+    }
+    spinlock(&c->lk);
+    m = 1 + chansendn1(c, (uchar *)v + c->elemsize, n - 1);
+    spinunlock(&c->lk);
+    return m;
+}
+
+/**
+ * @brief 一次接收最多 n 个元素
+ *
+ * 一个都没有的时候阻塞, 直到收到第一个, 然后不阻塞地尽量多收
+ *
+ * @param c 通道
+ * @param v 放得下 n 个元素的数组
+ * @param n
+ * @return int 收到的个数, 至少是 1 (n 大于 0 时); 通道关闭并且取空了返回 -1
+ */
+int chanrecvn(Channel *c, void *v, int n)
+{
+    int m;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    spinlock(&c->lk);
+    m = chanrecvn1(c, v, n);
+    spinunlock(&c->lk);
+    if (m > 0) {
+        return m;
+    }
+
+    if (_chanop(c, CHANRCV, v, 1, 0) < 0) {
+        return -1;
+    }
+    spinlock(&c->lk);
+    m = 1 + chanrecvn1(c, (uchar *)v + c->elemsize, n - 1);
+    spinunlock(&c->lk);
+    return m;
+}
+
 /**
  * @brief 向通道发送数据(阻塞版本)
  *
@@ -477,7 +949,20 @@ static int _chanop(Channel *c, int op, void *p, int canblock)
  */
 int chansend(Channel *c, void *v)
 {
-    return _chanop(c, CHANSND, v, 1);
+    return _chanop(c, CHANSND, v, 1, 0);
+}
+
+/**
+ * @brief 向通道发送数据, 最多等到 deadline
+ *
+ * @param c 通道
+ * @param v 数据
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 成功返回 1, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int chansendt(Channel *c, void *v, uint64_t deadline)
+{
+    return _chanop(c, CHANSND, v, 1, deadline);
 }
 
 /**
@@ -489,7 +974,7 @@ int chansend(Channel *c, void *v)
  */
 int channbsend(Channel *c, void *v)
 {
-    return _chanop(c, CHANSND, v, 0);
+    return _chanop(c, CHANSND, v, 0, 0);
 }
 
 /**
@@ -501,7 +986,20 @@ int channbsend(Channel *c, void *v)
  */
 int chanrecv(Channel *c, void *v)
 {
-    return _chanop(c, CHANRCV, v, 1);
+    return _chanop(c, CHANRCV, v, 1, 0);
+}
+
+/**
+ * @brief 从通道获取数据, 最多等到 deadline
+ *
+ * @param c 通道
+ * @param v 数据
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 成功返回 1, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int chanrecvt(Channel *c, void *v, uint64_t deadline)
+{
+    return _chanop(c, CHANRCV, v, 1, deadline);
 }
 
 /**
@@ -513,57 +1011,57 @@ int chanrecv(Channel *c, void *v)
  */
 int channbrecv(Channel *c, void *v)
 {
-    return _chanop(c, CHANRCV, v, 0);
+    return _chanop(c, CHANRCV, v, 0, 0);
 }
 
 int chansendp(Channel *c, void *v)
 {
-    return _chanop(c, CHANSND, (void *)&v, 1);
+    return _chanop(c, CHANSND, (void *)&v, 1, 0);
 }
 
 void *chanrecvp(Channel *c)
 {
     void *v;
 
-    _chanop(c, CHANRCV, (void *)&v, 1);
+    _chanop(c, CHANRCV, (void *)&v, 1, 0);
     return v;
 }
 
 int channbsendp(Channel *c, void *v)
 {
-    return _chanop(c, CHANSND, (void *)&v, 0);
+    return _chanop(c, CHANSND, (void *)&v, 0, 0);
 }
 
 void *channbrecvp(Channel *c)
 {
     void *v;
 
-    _chanop(c, CHANRCV, (void *)&v, 0);
+    _chanop(c, CHANRCV, (void *)&v, 0, 0);
     return v;
 }
 
 int chansendul(Channel *c, ulong val)
 {
-    return _chanop(c, CHANSND, &val, 1);
+    return _chanop(c, CHANSND, &val, 1, 0);
 }
 
 ulong chanrecvul(Channel *c)
 {
     ulong val;
 
-    _chanop(c, CHANRCV, &val, 1);
+    _chanop(c, CHANRCV, &val, 1, 0);
     return val;
 }
 
 int channbsendul(Channel *c, ulong val)
 {
-    return _chanop(c, CHANSND, &val, 0);
+    return _chanop(c, CHANSND, &val, 0, 0);
 }
 
 ulong channbrecvul(Channel *c)
 {
     ulong val;
 
-    _chanop(c, CHANRCV, &val, 0);
+    _chanop(c, CHANRCV, &val, 0, 0);
     return val;
 }
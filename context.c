@@ -2,7 +2,49 @@
 
 #include "taskimpl.h"
 
-/* 文件做了精简, 只研究 i386 平台上的实现 */
+/* 文件做了精简, 只保留 i386 和 x86-64 平台上的实现 */
+
+#if defined(__x86_64__)
+
+extern void xmcontextstart(void);
+
+/**
+ * @brief 新建上下文对象
+ *
+ * 新栈的栈顶放 xmcontextstart 的地址, 第一次 swapxmcontext 切进来的时候 ret 到它,
+ * 再由它以 (r12, r13) 为参数调用 %rbx 里面的入口函数. 最多支持两个 int 参数
+ *
+ * @param ucp 保存上下文对象的指针
+ * @param func 初始入口函数指针
+ * @param argc 入口函数参数数量
+ * @param ... 入口函数参数列表
+ */
+void makecontext(xucontext_t *ucp, void (*func)(void), int argc, ...)
+{
+    long *sp;
+    va_list arg;
+
+    assert(argc <= 2);
+
+    sp = (long *)((uchar *)ucp->uc_stack.ss_sp + ucp->uc_stack.ss_size);
+
+    /* 栈顶放 xmcontextstart, ret 到它之后 %rsp 是 16 字节对齐的, 它再 call 入口函数,
+     * 入口函数看到的就是 ABI 要求的 %rsp % 16 == 8 */
+    sp = (long *)((uintptr_t)sp & ~(uintptr_t)15);
+    *--sp = (long)xmcontextstart;
+
+    va_start(arg, argc);
+    ucp->uc_xmcontext.mc_r12 = argc > 0 ? va_arg(arg, int) : 0;
+    ucp->uc_xmcontext.mc_r13 = argc > 1 ? va_arg(arg, int) : 0;
+    va_end(arg);
+
+    ucp->uc_xmcontext.mc_rbx = (long)func;
+    ucp->uc_xmcontext.mc_rsp = (long)sp;
+    ucp->uc_xmcontext.mc_mxcsr = 0x1F80; /* 默认值: 屏蔽所有浮点异常, 就近舍入 */
+    ucp->uc_xmcontext.mc_fpucw = 0x037F;
+}
+
+#else
 
 /**
  * @brief 新建上下文对象
@@ -56,3 +98,5 @@ int swapcontext(xucontext_t *oucp, const xucontext_t *ucp)
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,567 @@
+#include "taskimpl.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+/*
+ * 不阻塞的 DNS 解析
+ *
+ * netlookup 原来用 gethostbyname, 解析期间整个程序都停着. 这里自己发 UDP 查询:
+ *  - 先查 /etc/hosts(第一次用的时候读入)
+ *  - 再查缓存, 缓存按应答里的 TTL 过期, 查不到的名字(NXDOMAIN)也缓存一小会
+ *  - 都没有就向 /etc/resolv.conf 里的 nameserver 依次发查询, 等应答用的是 fdreadt,
+ *    等待期间别的协程照常运行
+ * 同一个名字正在查询的时候, 后来的协程不再发查询, 睡在缓存项上等第一个查询的结果.
+ *
+ * A 和 AAAA 记录分开查询, 分开缓存. 不支持 resolv.conf 里的 search/domain, 也不看
+ * nsswitch.conf. 缓存和配置由 dnslk 保护, 查询过程中不持有它.
+ */
+
+enum {
+    DNSPORT = 53,
+    DNSMAXNS = 3,       /* 最多使用的 nameserver 数量, 和 glibc 的 MAXNS 一样 */
+    DNSHASH = 256,      /* 缓存的哈希桶数 */
+    DNSCACHEMAX = 4096, /* 最多缓存的名字数量 */
+    DNSNEGTTL = 5,      /* 查不到的名字缓存几秒 */
+    DNSFAILTTL = 1,     /* 服务器都没有应答的时候缓存几秒 */
+    DNSMAXNAME = 255,
+    DNSBUF = 512, /* 不带 EDNS0 的 UDP 应答最大 512 字节 */
+
+    DNSTYPEA = 1,
+    DNSTYPECNAME = 5,
+    DNSTYPEAAAA = 28,
+    DNSCLASSIN = 1,
+
+    DNSPENDING = 0, /* 正在查询 */
+    DNSOK,          /* 有地址 */
+    DNSNONAME,      /* 名字不存在或者没有要的记录 */
+};
+
+typedef struct Dnsent Dnsent;
+struct Dnsent {
+    char *name;
+    int family; /* AF_INET 或 AF_INET6 */
+    int state;
+    uchar addr[16]; /* 网络字节序, IPv4 只用前 4 字节 */
+    uvlong expire;  /* 过期时间(tasknow 的 ns) */
+    Rendez wait;  /* 等待查询结果的协程, wait.l 是 dnslk */
+    int ref;      /* 睡在 wait 上的协程数, 不为 0 的时候不能释放 */
+    int dead;     /* 已经从缓存里摘掉了, 最后一个等待者负责释放 */
+    Dnsent *next;
+};
+
+static QLock dnslk;
+static int dnsinited;
+static Dnsent *dnstab[DNSHASH];
+static int ndnsent;
+static Dnsent *dnshosts;
+
+static struct sockaddr_in dnsns[DNSMAXNS];
+static int ndnsns;
+static int dnstimeout = 5; /* 每次查询等待的秒数, resolv.conf 的 options timeout:n */
+static int dnsattempts = 2; /* 每个 nameserver 尝试的轮数, options attempts:n */
+static uint dnsid;
+
+static uint dnshash(char *s)
+{
+    uint h;
+
+    for (h = 0; *s; s++) {
+        h = h * 31 + (*s | 0x20); /* 域名不区分大小写 */
+    }
+    return h % DNSHASH;
+}
+
+static Dnsent *dnsnewent(char *name, int family)
+{
+    Dnsent *e;
+
+    e = malloc(sizeof *e);
+    if (e == nil || (e->name = strdup(name)) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    e->family = family;
+    e->state = DNSPENDING;
+    memset(e->addr, 0, sizeof e->addr);
+    e->expire = 0;
+    memset(&e->wait, 0, sizeof e->wait);
+    e->wait.l = &dnslk;
+    e->ref = 0;
+    e->dead = 0;
+    e->next = nil;
+    return e;
+}
+
+static void dnsfreeent(Dnsent *e)
+{
+    free(e->name);
+    free(e);
+}
+
+/**
+ * @brief 把 *l 指向的缓存项从表里摘掉, 还有等待者的话留给它们释放, 调用者持有 dnslk
+ */
+static void dnsunlink(Dnsent **l)
+{
+    Dnsent *e;
+
+    e = *l;
+    *l = e->next;
+    ndnsent--;
+    if (e->ref == 0) {
+        dnsfreeent(e);
+    } else {
+        e->dead = 1;
+    }
+}
+
+/**
+ * @brief 添加一个 nameserver, 调用者持有 dnslk
+ */
+static void dnsaddns(uint32_t ip, int port)
+{
+    struct sockaddr_in *sa;
+
+    if (ndnsns == DNSMAXNS) {
+        return;
+    }
+    sa = &dnsns[ndnsns++];
+    memset(sa, 0, sizeof *sa);
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons(port);
+    sa->sin_addr.s_addr = ip;
+}
+
+/**
+ * @brief 读入 /etc/hosts 和 /etc/resolv.conf, 调用者持有 dnslk
+ *
+ * 两个文件都很小, 读普通文件也不会真的阻塞, 直接用 stdio
+ */
+static void dnsinit(void)
+{
+    FILE *f;
+    char line[1024], *p, *tok, *save;
+    uchar addr[16];
+    uint32_t ip;
+    Dnsent *e;
+    int n, family;
+
+    if (dnsinited) {
+        return;
+    }
+    dnsinited = 1;
+
+    if ((f = fopen("/etc/hosts", "r")) != nil) {
+        while (fgets(line, sizeof line, f) != nil) {
+            if ((p = strchr(line, '#')) != nil) {
+                *p = 0;
+            }
+            if ((tok = strtok_r(line, " \t\r\n", &save)) == nil) {
+                continue;
+            }
+            if (inet_pton(AF_INET, tok, addr) == 1) {
+                family = AF_INET;
+            } else if (inet_pton(AF_INET6, tok, addr) == 1) {
+                family = AF_INET6;
+            } else {
+                continue;
+            }
+            while ((tok = strtok_r(nil, " \t\r\n", &save)) != nil) {
+                e = dnsnewent(tok, family);
+                e->state = DNSOK;
+                memmove(e->addr, addr, sizeof addr);
+                e->next = dnshosts;
+                dnshosts = e;
+            }
+        }
+        fclose(f);
+    }
+
+    /* netnameserver 已经指定了就不再读 resolv.conf */
+    if (ndnsns == 0 && (f = fopen("/etc/resolv.conf", "r")) != nil) {
+        while (fgets(line, sizeof line, f) != nil) {
+            if ((tok = strtok_r(line, " \t\r\n", &save)) == nil) {
+                continue;
+            }
+            if (strcmp(tok, "nameserver") == 0) {
+                if ((tok = strtok_r(nil, " \t\r\n", &save)) != nil && inet_pton(AF_INET, tok, &ip) == 1) {
+                    dnsaddns(ip, DNSPORT);
+                }
+            } else if (strcmp(tok, "options") == 0) {
+                while ((tok = strtok_r(nil, " \t\r\n", &save)) != nil) {
+                    if (sscanf(tok, "timeout:%d", &n) == 1 && n > 0) {
+                        dnstimeout = n;
+                    } else if (sscanf(tok, "attempts:%d", &n) == 1 && n > 0) {
+                        dnsattempts = n;
+                    }
+                }
+            }
+        }
+        fclose(f);
+    }
+
+    /* resolv.conf 没有 nameserver 的时候和 glibc 一样用本机 */
+    if (ndnsns == 0) {
+        dnsaddns(htonl(INADDR_LOOPBACK), DNSPORT);
+    }
+}
+
+/**
+ * @brief 指定 DNS 服务器, 代替 /etc/resolv.conf 里的 nameserver
+ *
+ * 第一次调用清掉原来的列表, 之后的调用依次追加, 最多 3 个
+ *
+ * @param server 服务器 ip 地址
+ * @param port 端口, 通常是 53
+ * @return int 成功返回 0, 地址不合法返回 -1
+ */
+int netnameserver(char *server, int port)
+{
+    static int set;
+    uint32_t ip;
+
+    if (inet_pton(AF_INET, server, &ip) != 1) {
+        return -1;
+    }
+
+    qlock(&dnslk);
+    if (!set) {
+        set = 1;
+        ndnsns = 0;
+    }
+    dnsaddns(ip, port);
+    qunlock(&dnslk);
+    return 0;
+}
+
+/**
+ * @brief 删除一个桶里过期的缓存项, all 为真时删除全部已经查好的项, 调用者持有 dnslk
+ */
+static void dnspurge1(int h, uvlong now, int all)
+{
+    Dnsent **l, *e;
+
+    for (l = &dnstab[h]; (e = *l) != nil;) {
+        if (e->state != DNSPENDING && (all || e->expire <= now)) {
+            dnsunlink(l);
+        } else {
+            l = &e->next;
+        }
+    }
+}
+
+/**
+ * @brief 缓存满了的时候腾地方: 先删过期的, 还是满的话清掉要插入的那个桶
+ */
+static void dnspurge(int h, uvlong now)
+{
+    int i;
+
+    for (i = 0; i < DNSHASH; i++) {
+        dnspurge1(i, now, 0);
+    }
+    if (ndnsent >= DNSCACHEMAX) {
+        dnspurge1(h, now, 1);
+    }
+}
+
+/**
+ * @brief 构造一个查询
+ *
+ * @param type DNSTYPEA 或 DNSTYPEAAAA
+ * @return int 报文长度, 名字不合法返回 -1
+ */
+static int dnsmkquery(uchar *buf, uint id, char *name, int type)
+{
+    uchar *p, *lp;
+    char *s;
+
+    memset(buf, 0, 12);
+    buf[0] = id >> 8;
+    buf[1] = id;
+    buf[2] = 0x01; /* RD: 要求递归查询 */
+    buf[5] = 1;    /* QDCOUNT */
+
+    p = buf + 12;
+    for (s = name; *s;) {
+        lp = p++;
+        while (*s && *s != '.') {
+            if (p - buf >= 12 + DNSMAXNAME) {
+                return -1;
+            }
+            *p++ = *s++;
+        }
+        if (p - lp - 1 == 0 || p - lp - 1 > 63) {
+            return -1;
+        }
+        *lp = p - lp - 1;
+        if (*s == '.') {
+            s++;
+        }
+    }
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = type;
+    *p++ = 0;
+    *p++ = DNSCLASSIN;
+    return p - buf;
+}
+
+/**
+ * @brief 跳过报文里的一个域名, 支持压缩指针
+ *
+ * @return uchar* 域名之后的位置, 报文不完整返回 nil
+ */
+static uchar *dnsskipname(uchar *p, uchar *e)
+{
+    while (p < e) {
+        if (*p == 0) {
+            return p + 1;
+        }
+        if ((*p & 0xC0) == 0xC0) {
+            return p + 2 <= e ? p + 2 : nil;
+        }
+        p += *p + 1;
+    }
+    return nil;
+}
+
+/**
+ * @brief 解析应答
+ *
+ * CNAME 链的终点在同一个应答里, 直接取第一条 want 类型的记录, TTL 取用到的记录里最小的
+ *
+ * @return int DNSOK/DNSNONAME, 应答不对(id 不符, 服务器出错等)返回 -1
+ */
+static int dnsparse(uchar *buf, int n, uint id, int want, uchar *addr, uint *ttl)
+{
+    uchar *p, *e;
+    int i, qd, an, type, class, rdlen, alen;
+    uint t;
+
+    if (n < 12 || ((buf[0] << 8) | buf[1]) != id || !(buf[2] & 0x80)) {
+        return -1;
+    }
+
+    switch (buf[3] & 0x0F) {
+    case 0:
+        break;
+    case 3: /* NXDOMAIN */
+        return DNSNONAME;
+    default:
+        return -1;
+    }
+
+    qd = (buf[4] << 8) | buf[5];
+    an = (buf[6] << 8) | buf[7];
+    e = buf + n;
+    p = buf + 12;
+    for (i = 0; i < qd; i++) {
+        if ((p = dnsskipname(p, e)) == nil || p + 4 > e) {
+            return -1;
+        }
+        p += 4;
+    }
+
+    alen = want == DNSTYPEAAAA ? 16 : 4;
+    *ttl = ~0U;
+    for (i = 0; i < an; i++) {
+        if ((p = dnsskipname(p, e)) == nil || p + 10 > e) {
+            return -1;
+        }
+        type = (p[0] << 8) | p[1];
+        class = (p[2] << 8) | p[3];
+        t = ((uint)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+        rdlen = (p[8] << 8) | p[9];
+        p += 10;
+        if (p + rdlen > e) {
+            return -1;
+        }
+        if (class == DNSCLASSIN && (type == want || type == DNSTYPECNAME)) {
+            if (t < *ttl) {
+                *ttl = t;
+            }
+            if (type == want && rdlen == alen) {
+                memmove(addr, p, alen);
+                return DNSOK;
+            }
+        }
+        p += rdlen;
+    }
+    return DNSNONAME;
+}
+
+/**
+ * @brief 向 nameserver 依次查询, 不持有 dnslk
+ *
+ * 每个服务器一个新的 UDP 套接字, connect 之后内核会丢掉别的地址发来的包.
+ * id 或者问题不符的包(迟到的旧应答)丢掉继续等.
+ *
+ * @return int DNSOK/DNSNONAME, 全部失败返回 -1
+ */
+static int dnsquery(char *name, int type, uchar *addr, uint *ttl)
+{
+    uchar q[DNSBUF], r[DNSBUF];
+    struct sockaddr_in ns[DNSMAXNS];
+    int i, j, n, nq, fd, nns, ret, timeout, attempts;
+    uvlong deadline;
+    uint id;
+
+    qlock(&dnslk);
+    nns = ndnsns;
+    memmove(ns, dnsns, sizeof ns);
+    timeout = dnstimeout;
+    attempts = dnsattempts;
+    id = (nsec() ^ (++dnsid * 0x9E3779B1U)) & 0xFFFF;
+    qunlock(&dnslk);
+
+    if ((nq = dnsmkquery(q, id, name, type)) < 0) {
+        return DNSNONAME;
+    }
+
+    ret = -1;
+    for (j = 0; j < attempts; j++) {
+        for (i = 0; i < nns; i++) {
+            if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+                return -1;
+            }
+            fdnoblock(fd);
+            if (connect(fd, (struct sockaddr *)&ns[i], sizeof ns[i]) < 0 || write(fd, q, nq) != nq) {
+                fdclose(fd);
+                continue;
+            }
+
+            deadline = tasknow() + (uvlong)timeout * 1000000000;
+            while ((n = fdreadt(fd, r, sizeof r, deadline)) > 0) {
+                /* 应答里的问题要和我们问的一样 */
+                if (n < nq || memcmp(r + 12, q + 12, nq - 12) != 0) {
+                    continue;
+                }
+                if ((ret = dnsparse(r, n, id, type, addr, ttl)) >= 0) {
+                    break;
+                }
+            }
+            fdclose(fd);
+            if (ret >= 0) {
+                return ret;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 解析域名的地址, 只让当前协程等待
+ *
+ * @param name 域名
+ * @param family AF_INET 查 A 记录, AF_INET6 查 AAAA 记录
+ * @param addr 结果(网络字节序), IPv4 4 字节, IPv6 16 字节
+ * @return int 成功返回 0, 失败返回 -1
+ */
+int dnslookup(char *name, int family, void *addr)
+{
+    Dnsent *e, **l;
+    uint h, ttl;
+    uvlong now;
+    int r, alen;
+
+    if (strlen(name) > DNSMAXNAME) {
+        return -1;
+    }
+
+    alen = family == AF_INET6 ? 16 : 4;
+    qlock(&dnslk);
+    dnsinit();
+
+    /* 和 glibc 一样, 名字在 /etc/hosts 里就不再问 DNS, 哪怕只有另一个地址族的地址 */
+    r = -1;
+    for (e = dnshosts; e != nil; e = e->next) {
+        if (strcasecmp(e->name, name) == 0) {
+            r = 0;
+            if (e->family == family) {
+                memmove(addr, e->addr, alen);
+                qunlock(&dnslk);
+                return 0;
+            }
+        }
+    }
+    if (r == 0) {
+        qunlock(&dnslk);
+        return -1;
+    }
+
+    h = dnshash(name);
+    now = tasknow();
+    for (l = &dnstab[h]; (e = *l) != nil; l = &e->next) {
+        if (e->family == family && strcasecmp(e->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (e != nil && e->state == DNSPENDING) {
+        /* 别的协程正在查这个名字, 等它的结果. 结果的 TTL 可能是 0,
+         * 所以醒来之后直接用, 不再看是否过期 */
+        e->ref++;
+        while (e->state == DNSPENDING) {
+            tasksleep(&e->wait);
+        }
+        e->ref--;
+        r = e->state == DNSOK ? 0 : -1;
+        memmove(addr, e->addr, alen);
+        if (e->dead && e->ref == 0) {
+            dnsfreeent(e);
+        }
+        qunlock(&dnslk);
+        return r;
+    }
+
+    if (e != nil) {
+        if (e->expire > now) {
+            r = e->state == DNSOK ? 0 : -1;
+            memmove(addr, e->addr, alen);
+            qunlock(&dnslk);
+            return r;
+        }
+
+        /* 过期了, 删掉重新查 */
+        dnsunlink(l);
+    }
+
+    if (ndnsent >= DNSCACHEMAX) {
+        dnspurge(h, now);
+    }
+
+    /* 先放一个 DNSPENDING 的缓存项占位, 同名的查询都等在它上面 */
+    e = dnsnewent(name, family);
+    e->next = dnstab[h];
+    dnstab[h] = e;
+    ndnsent++;
+    qunlock(&dnslk);
+
+    r = dnsquery(name, family == AF_INET6 ? DNSTYPEAAAA : DNSTYPEA, e->addr, &ttl);
+
+    qlock(&dnslk);
+    switch (r) {
+    case DNSOK:
+        e->state = DNSOK;
+        e->expire = tasknow() + (uvlong)ttl * 1000000000;
+        break;
+    case DNSNONAME:
+        e->state = DNSNONAME;
+        e->expire = tasknow() + (uvlong)DNSNEGTTL * 1000000000;
+        break;
+    default:
+        /* 服务器都没有应答, 等着的协程也拿这个结果, 过一会再重新查 */
+        e->state = DNSNONAME;
+        e->expire = tasknow() + (uvlong)DNSFAILTTL * 1000000000;
+        break;
+    }
+    memmove(addr, e->addr, alen);
+    taskwakeupall(&e->wait);
+    qunlock(&dnslk);
+
+    return r == DNSOK ? 0 : -1;
+}
@@ -1,16 +1,84 @@
+#define _GNU_SOURCE /* splice, pipe2 */
 #include "taskimpl.h"
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 
-enum { MAXFD = 1024 };
+/* Linux 上默认使用 epoll 作为 I/O 后端, 编译时定义 USE_POLL 可强制使用 poll.
+ * 即使编译了 epoll 支持, epoll_create1 失败的时候也会在运行时退回到 poll */
+#if defined(__linux__) && !defined(USE_POLL)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define USE_EPOLL 0
+#endif
 
-static struct pollfd pollfd[MAXFD];
-static Task *polltask[MAXFD];
+/* poll 后端的等待数组, 每个 fdwait 占一项, 不够用的时候按倍数扩容 */
+static struct pollfd *pollfd;
+static Task **polltask;
 static int npollfd;
+static int mpollfd;
 static int startedfdtask;
-static Tasklist sleeping;
 static int sleepingcounted;
-static uvlong nsec(void);
+
+/* M:N 模式下 fdlk 保护 fd 等待表, poll 数组和 fdtask 的启动;
+ * timerlk 保护时间轮, sleepingcounted 和 polldeadline */
+static Lock fdlk;
+static Lock timerlk;
+
+/* M:N 模式下 fdtask 等待 I/O 的时候占着一个线程, 别的线程添加了更早的定时器需要通过 wakefd 叫醒它 */
+int fdpolling;              /* fdtask 正在 poll/epoll_wait 里面阻塞 */
+static uvlong polldeadline; /* 阻塞最晚到什么时候(ns) */
+static int wakefd = -1;
+
+static int fdwait1(int, int, uvlong, int);
+
+#ifdef USE_IOURING
+static int uringfd = -1; /* io_uring 的完成通知 eventfd, 挂在 epoll 上 */
+#endif
+
+#if USE_EPOLL
+/**
+ * @brief 以 fd 为下标的等待表项(epoll 后端)
+ *
+ * fd 第一次 fdwait 的时候以边沿触发方式注册到 epoll, 之后注册一直保留.
+ * 事件到达时如果没有对应方向的等待者, 就把事件记在 ready 里面, 下一次 fdwait 直接消费掉它.
+ *
+ * 边沿触发只在 fd 状态变化的时候报告, 数据没有读完的时候不会再来事件. 库里面的读写
+ * 都是先读写, 得到 EAGAIN 才 _fdwait, 这时候后面的数据一定会带来新的边沿, 不需要系统调用.
+ * fdwaitt 的调用者可能还没有读写过(比如 fdread1), 要阻塞的时候用 EPOLL_CTL_MOD
+ * 重新设置一次, 内核会按 fd 当前的状态再报告一次, 所以 fdwaitt 的语义和 poll 一样
+ */
+typedef struct Fdstate Fdstate;
+struct Fdstate {
+    Tasklist rwait; /* 等待可读的协程 */
+    Tasklist wwait; /* 等待可写的协程 */
+    Tasklist ewait; /* 只等待异常(挂断/出错)的协程 */
+    int armed;      /* 是否已经注册到 epoll */
+    int ready;      /* 无人等待时到达的事件 */
+};
+
+/* 带超时的等待者在等哪个 fd 的哪个方向, 放在等待者的栈上 */
+typedef struct Fdwaiter Fdwaiter;
+struct Fdwaiter {
+    int fd;
+    int rw;
+};
+
+/* FDTABMAX: 按 RLIMIT_NOFILE 预分配等待表的上限, 超过的 fd 在用到的时候再扩容 */
+enum { EPOLLBATCH = 128, FDTABMAX = 1 << 20 };
+
+static int epfd = -1;
+static Fdstate *fdtab;
+static int nfdtab;
+
+static void fdtabinit(void);
+static Fdstate *fdstate(int);
+static int fdwakeall(Tasklist *);
+static int epollwait(int, int, uvlong, int);
+static void epollwake(int, uint);
+#endif
 
 /**
  * @brief 执行文件描述符相关的事件协程
@@ -22,16 +90,29 @@ static uvlong nsec(void);
  */
 void fdtask(void *v)
 {
-    int i, ms;
+    int i, n, ms, claimed;
     Task *t;
-    uvlong now;
+    Timer *tm;
+    void (*cancel)(Task *);
+    uint seq;
+    uvlong now, next;
+#if USE_EPOLL
+    static struct epoll_event events[EPOLLBATCH];
+#endif
 
     tasksystem();
     taskname("fdtask");
     for (;;) {
-        /* let everyone else run */
-        while (taskyield() > 0)
-            ;
+        /* let everyone else run
+         *
+         * M:N 模式下别的线程一直有协程在跑, 不能等到所有协程都跑完再 poll,
+         * 每轮只让一次, 自己线程的队列里还有协程的时候只做非阻塞的 poll */
+        if (taskmt) {
+            taskyield();
+        } else {
+            while (taskyield() > 0)
+                ;
+        }
 
         /* 到此, 已经没有其他协程在等待调度了 */
 
@@ -39,24 +120,56 @@ void fdtask(void *v)
         errno = 0;
         taskstate("poll");
 
-        /* 如果没有睡眠等待队列, 直接 poll 阻塞等待文件描述符事件
-         * 否则 poll 按照用户设计的 alarmtime 最多等 5s, 然后超时 */
-        if ((t = sleeping.head) == nil) {
+        /* 如果时间轮上没有定时器, 直接 poll 阻塞等待文件描述符事件
+         * 否则 poll 最多等到时间轮下一次需要处理的时间(最多 5s), 然后超时.
+         * 算超时和登记 fdpolling 在同一次持有 timerlk 里面, 之后添加的更早的定时器会叫醒我们 */
+        spinlock(&timerlk);
+        now = taskclock();
+        if ((next = timernext()) == ~0ULL) {
             ms = -1;
         } else {
-            /* sleep at most 5s */
-            now = nsec();
-            if (now >= t->alarmtime) {
+            /* sleep at most 5s, 向上取整到毫秒, 避免提前醒来空转 */
+            if (now >= next) {
                 ms = 0;
-            } else if (now + 5 * 1000 * 1000 * 1000LL >= t->alarmtime) {
-                ms = (t->alarmtime - now) / 1000000;
+            } else if (now + 5 * 1000 * 1000 * 1000LL >= next) {
+                ms = (next - now + 999999) / 1000000;
             } else {
                 ms = 5000;
             }
         }
 
-        /* poll 系统调用, 如果出错返回负数, 超时返回 0, 有事件发生返回事件数量 */
-        if (poll(pollfd, npollfd, ms) < 0) {
+#ifdef USE_IOURING
+        /* 这一轮所有协程积攒的 io_uring 操作在这里一次提交; 已经有完成的就不要阻塞 */
+        uringflush();
+        if (uringreap() > 0) {
+            ms = 0;
+        }
+#endif
+
+        if (taskmt && __atomic_load_n(&proc()->nrunqueue, __ATOMIC_RELAXED) > 0) {
+            ms = 0;
+        }
+
+        /* 阻塞等待期间别的线程可以继续注册 fd(epoll_ctl 本身是线程安全的) */
+        __atomic_store_n(&fdpolling, ms != 0, __ATOMIC_SEQ_CST);
+        polldeadline = ms < 0 ? ~0ULL : now + (uvlong)ms * 1000000;
+        spinunlock(&timerlk);
+
+        /* poll/epoll_wait 系统调用, 如果出错返回负数, 超时返回 0, 有事件发生返回事件数量 */
+#if USE_EPOLL
+        if (epfd >= 0)
+            n = epoll_wait(epfd, events, EPOLLBATCH, ms);
+        else
+#endif
+            n = poll(pollfd, npollfd, ms);
+
+        __atomic_store_n(&fdpolling, 0, __ATOMIC_SEQ_CST);
+
+        /* 醒来之后马上刷新一次时钟, 这一轮被唤醒的协程都看到这个时间,
+         * taskready 也拿它当就绪时间 */
+        now = taskclock();
+
+        if (n < 0) {
             if (errno == EINTR) {
                 /* 系统调用如果是被中断打断了
                  * TODO: 检查 Linux 的 signal 处理时刻, 重新执行系统调用的逻辑 */
@@ -67,37 +180,170 @@ void fdtask(void *v)
             taskexitall(0);
         }
 
-        /* wake up the guys who deserve it */
+        spinlock(&fdlk);
+#if USE_EPOLL
+        /* epoll 只返回就绪的 fd, 只需要处理这 n 个事件 */
+        if (epfd >= 0) {
+            for (i = 0; i < n; i++) {
+                if (events[i].data.fd == wakefd) {
+                    read(wakefd, &next, sizeof next);
+                    continue;
+                }
+#ifdef USE_IOURING
+                /* 只有 epoll 报告了才去清 eventfd, 完成事件由下面的 uringreap 收割 */
+                if (events[i].data.fd == uringfd) {
+                    uringclear();
+                    continue;
+                }
+#endif
+                epollwake(events[i].data.fd, events[i].events);
+            }
+        }
+#endif
+
+
+        /* wake up the guys who deserve it
+         * 认领不到的是同时超时了, 下面处理定时器的时候 pollcancel 会找不到它, 没有关系 */
         for (i = 0; i < npollfd; i++) {
 
             /* 因为 while block 会把最后一个 pollfd, 移动到 i 位置,
              * 因此这里需要使用 while 确保新移动过来的 pollfd 也能得到处理 */
             while (i < npollfd && pollfd[i].revents) {
-                taskready(polltask[i]);
+                if (taskclaim(polltask[i])) {
+                    taskready(polltask[i]);
+                }
                 --npollfd;
                 pollfd[i] = pollfd[npollfd];
                 polltask[i] = polltask[npollfd];
             }
         }
+        spinunlock(&fdlk);
 
-        now = nsec();
+#ifdef USE_IOURING
+        uringreap();
+#endif
 
-        /* sleeping 里面是等待睡眠超时的任务
-         * 如果当前时间已经达到超时时间, 就将任务移动到就绪队列 */
-        while ((t = sleeping.head) && now >= t->alarmtime) {
-            deltask(&sleeping, t);
+        /* 时间轮上到期的是等待睡眠超时的任务, 将任务移动到就绪队列.
+         * 一次取一个, 唤醒的时候不持有 timerlk */
+        for (;;) {
+            spinlock(&timerlk);
+            if ((tm = timerexpired(now)) == nil) {
+                spinunlock(&timerlk);
+                break;
+            }
+            t = tm->task;
 
             /* 参考 taskdelay 实现, 有睡眠任务的时候 taskcount 会冗余加 1,
              * 这里因为睡眠完成需要把那个冗余的计数减去 */
-            if (!t->system && --sleepingcounted == 0) {
-                taskcount--;
+            if (tm->seq == 0) {
+                if (!t->system && --sleepingcounted == 0) {
+                    taskxadd(&taskcount, -1);
+                }
+                spinunlock(&timerlk);
+                taskready(t);
+                continue;
             }
 
-            taskready(t);
+            /* 带超时的等待超时了: 认领到的话从等待的地方摘下来再唤醒, 让它知道是超时.
+             * 认领不到说明事件先到了, 协程醒来之后会自己删除定时器, 这里只是替它摘掉了 */
+            seq = tm->seq;
+            claimed = __atomic_compare_exchange_n(&t->wake, &seq, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            cancel = t->waitcancel;
+            spinunlock(&timerlk);
+            if (claimed) {
+                if (cancel) {
+                    cancel(t);
+                }
+                t->timedout = 1;
+                taskready(t);
+            }
         }
     }
 }
 
+/**
+ * @brief 按需启动 fdtask
+ *
+ * epoll 实例(以及 io_uring)也在这里创建, 因为 fdwait 在 fdtask 真正运行之前就要注册 fd
+ */
+void startfdtask(void)
+{
+#if USE_EPOLL && defined(USE_IOURING)
+    struct epoll_event ev;
+    int efd;
+#endif
+
+    if (__atomic_load_n(&startedfdtask, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    spinlock(&fdlk);
+    if (startedfdtask) {
+        spinunlock(&fdlk);
+        return;
+    }
+#if USE_EPOLL
+    /* 创建失败就保持 epfd < 0, 后面全部走 poll */
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0) {
+        fdtabinit();
+    }
+#ifdef USE_IOURING
+    /* io_uring 的完成通知 eventfd 以水平触发方式挂在 epoll 上, 报告了之后由 uringclear 清零 */
+    if (epfd >= 0 && (efd = uringsetup()) >= 0) {
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN;
+        ev.data.fd = efd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+        uringfd = efd;
+    }
+#endif
+#endif
+    __atomic_store_n(&startedfdtask, 1, __ATOMIC_RELEASE);
+    spinunlock(&fdlk);
+    taskcreate(fdtask, 0, 32768);
+}
+
+/**
+ * @brief 为 M:N 模式准备 fdtask
+ *
+ * 多个线程共用一个 fdtask, 它在 epoll_wait 里面阻塞的时候, 别的线程添加定时器要能叫醒它.
+ * poll 后端的等待数组在阻塞期间不能修改, io_uring 的提交队列也只有 fdtask 一个提交者,
+ * 所以只支持 epoll, 并且关闭 io_uring 引擎(已经提交的操作照常收割)
+ *
+ * @return int 成功返回 0, 没有 epoll 返回 -1
+ */
+int fdmtinit(void)
+{
+#if USE_EPOLL
+    struct epoll_event ev;
+
+    startfdtask();
+    if (epfd < 0) {
+        return -1;
+    }
+
+    if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        close(wakefd);
+        wakefd = -1;
+        return -1;
+    }
+
+#ifdef USE_IOURING
+    uringon = 0;
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 /**
  * @brief 任务延时指定的毫秒数
  *
@@ -110,47 +356,21 @@ uint taskdelay(uint ms)
     Task *t;
 
     /* fdtask 是具体的睡眠逻辑, 可以把它当成定时器的角色 */
-    if (!startedfdtask) {
-        startedfdtask = 1;
-        taskcreate(fdtask, 0, 32768);
-    }
+    startfdtask();
 
-    now = nsec();
+    /* 以缓存的时钟为起点, 和 fdtask 判断到期用的是同一个时钟 */
+    now = tasknow();
     when = now + (uvlong)ms * 1000000;
 
-    /* sleeping 里面的进程, 是按照睡眠时间从小到大排列的
-     * 这里找到第一个睡眠时间比参数指定的 ms 大的任务节点 */
-    for (t = sleeping.head; t != nil && t->alarmtime < when; t = t->next)
-        ;
-
-    /* 如果有时间比参数指定的时间大的节点存在, 将当前任务插到这个节点之前
-     * 否则的话, 参数指定的时间是现在所有睡眠任务中时间最大的那个, 因此放到链表最后
-     * 这一步先维护当前任务的节点指针, 插入动作在后面的 if/else 里面
+    /* 挂到时间轮上, 插入是 O(1) 的, 由 fdtask 在到期的时候唤醒
      *
      * 注意住调度器运行 taskrunning 的时候, 已经将它从 taskrunqueue 链表中摘除,
      * 因此这里不需要摘除操作 */
-    if (t) {
-        taskrunning->prev = t->prev;
-        taskrunning->next = t;
-    } else {
-        taskrunning->prev = sleeping.tail;
-        taskrunning->next = nil;
-    }
-
     t = taskrunning;
-    t->alarmtime = when;
-
-    if (t->prev) {
-        t->prev->next = t;
-    } else {
-        sleeping.head = t;
-    }
-
-    if (t->next) {
-        t->next->prev = t;
-    } else {
-        sleeping.tail = t;
-    }
+    spinlock(&timerlk);
+    t->timer.task = t;
+    t->timer.seq = 0;
+    timerset(&t->timer, when);
 
     /* 如果 t 不是系统任务, sleepingcounted 计数加 1, 任务统计数量加 1
      * 这里维护 taskcount, 是因为 fdtask 被标记为 system 任务, 为了避免调度器在睡眠
@@ -158,12 +378,81 @@ uint taskdelay(uint ms)
      *
      * TODO: 这个计数是冗余的, 正常情况下睡眠的任务计数已经在 taskcount 里面了, 这里属于额外再加一次 */
     if (!t->system && sleepingcounted++ == 0) {
-        taskcount++;
+        taskxadd(&taskcount, 1);
+    }
+
+    /* fdtask 正在别的线程上阻塞等待, 并且会睡过头, 叫醒它重新计算超时 */
+    if (fdpolling && when < polldeadline) {
+        write(wakefd, &when, sizeof when);
+    }
+    spinunlock(&timerlk);
+
+    taskswitch();
+
+    /* fdtask 唤醒我们之前刚刚刷新过时钟 */
+    ms = (tasknow() - now) / 1000000;
+    return ms;
+}
+
+/**
+ * @brief 切走等待, 直到被唤醒或者到了截止时间
+ *
+ * 调用之前先 taskwaitbegin, 挂到等待的地方, 再放开那里的锁. 截止时间到了还没有被认领,
+ * fdtask 认领之后调用 cancel 把协程从等待的地方摘下来, 设置 timedout 之后唤醒它.
+ * 截止时间已经过了的话自己认领自己, 不切走. 定时器在醒来之后由协程自己删除
+ *
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示没有截止时间
+ * @param cancel 超时的时候调用, 参数是协程自己, 要自己加等待的地方的锁. nil 表示醒来之后自己收拾
+ * @param arg 保存在 waitarg 里面给 cancel 用
+ * @return int 被唤醒返回 0, 超时返回 -1
+ */
+int taskwait(uvlong deadline, void (*cancel)(Task *), void *arg)
+{
+    Task *t;
+    uint seq;
+
+    if (deadline == 0) {
+        taskswitch();
+        return 0;
+    }
+
+    t = taskrunning;
+    seq = t->waitseq;
+    if (deadline <= tasknow()) {
+        if (taskclaim(t)) {
+            if (cancel) {
+                cancel(t);
+            }
+            t->timedout = 1;
+            return -1;
+        }
+
+        /* 已经被认领了, 唤醒者会把我们放回待运行队列 */
+        taskswitch();
+        return 0;
     }
 
+    startfdtask();
+    spinlock(&timerlk);
+    if (__atomic_load_n(&t->wake, __ATOMIC_RELAXED) == seq) {
+        t->waitcancel = cancel;
+        t->waitarg = arg;
+        t->timer.task = t;
+        t->timer.seq = seq;
+        timerset(&t->timer, deadline);
+
+        if (fdpolling && deadline < polldeadline) {
+            write(wakefd, &deadline, sizeof deadline);
+        }
+    }
+    spinunlock(&timerlk);
+
     taskswitch();
 
-    return (nsec() - now) / 1000000;
+    spinlock(&timerlk);
+    timerdel(&t->timer);
+    spinunlock(&timerlk);
+    return t->timedout ? -1 : 0;
 }
 
 /**
@@ -173,21 +462,82 @@ uint taskdelay(uint ms)
  * @param rw
  */
 void fdwait(int fd, int rw)
+{
+    fdwaitt(fd, rw, 0);
+}
+
+/**
+ * @brief poll 后端超时的时候把协程移出 pollfd 数组
+ *
+ * @param t
+ */
+static void pollcancel(Task *t)
+{
+    int i;
+
+    spinlock(&fdlk);
+    for (i = 0; i < npollfd; i++) {
+        if (polltask[i] == t) {
+            --npollfd;
+            pollfd[i] = pollfd[npollfd];
+            polltask[i] = polltask[npollfd];
+            break;
+        }
+    }
+    spinunlock(&fdlk);
+}
+
+/**
+ * @brief 带截止时间的 fdwait
+ *
+ * 等到 fd 可读/可写为止, fd 现在就可读/可写的话马上返回, 所以可以在读写之前调用
+ *
+ * @param fd
+ * @param rw
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 事件到达返回 0, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int fdwaitt(int fd, int rw, uint64_t deadline)
+{
+    return fdwait1(fd, rw, deadline, 0);
+}
+
+/**
+ * @brief 读写刚刚返回 EAGAIN 之后的 fdwait, 库内部使用
+ *
+ * EAGAIN 说明 fd 现在不可读/可写, 之后的数据一定会带来新的边沿, epoll 后端可以
+ * 省掉 fdwaitt 里重新检查 fd 状态的那次 epoll_ctl
+ *
+ * @param fd
+ * @param rw
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 事件到达返回 0, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int _fdwait(int fd, int rw, uvlong deadline)
+{
+    return fdwait1(fd, rw, deadline, 1);
+}
+
+/**
+ * @brief fdwaitt 和 _fdwait 的实现
+ *
+ * @param again 调用者刚刚在 fd 上得到了 EAGAIN
+ */
+static int fdwait1(int fd, int rw, uvlong deadline, int again)
 {
     int bits;
 
     /* fdtask 是具体的等待逻辑 */
-    if (!startedfdtask) {
-        startedfdtask = 1;
-        taskcreate(fdtask, 0, 32768);
-    }
+    startfdtask();
 
-    if (npollfd >= MAXFD) {
-        fprint(2, "too many poll file descriptors\n");
-        abort();
+    taskstate("fdwait for %s", rw == 'r' ? "read" : rw == 'w' ? "write" : "error");
+
+#if USE_EPOLL
+    if (epfd >= 0) {
+        return epollwait(fd, rw, deadline, again);
     }
+#endif
 
-    taskstate("fdwait for %s", rw == 'r' ? "read" : rw == 'w' ? "write" : "error");
     bits = 0;
     switch (rw) {
     case 'r':
@@ -198,12 +548,340 @@ void fdwait(int fd, int rw)
         break;
     }
 
+    spinlock(&fdlk);
+    if (npollfd == mpollfd) {
+        mpollfd = mpollfd ? mpollfd * 2 : 64;
+        pollfd = realloc(pollfd, mpollfd * sizeof pollfd[0]);
+        polltask = realloc(polltask, mpollfd * sizeof polltask[0]);
+        if (pollfd == nil || polltask == nil) {
+            fprint(2, "out of memory\n");
+            abort();
+        }
+    }
+
+    taskwaitbegin();
     polltask[npollfd] = taskrunning;
     pollfd[npollfd].fd = fd;
     pollfd[npollfd].events = bits;
     pollfd[npollfd].revents = 0;
     npollfd++;
-    taskswitch();
+    spinunlock(&fdlk);
+
+    if (taskwait(deadline, pollcancel, nil) < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+#if USE_EPOLL
+/**
+ * @brief 按 RLIMIT_NOFILE 预先分配等待表
+ *
+ * 进程能打开的 fd 都有位置, 运行中就不需要扩容. calloc 这么大的内存会直接 mmap,
+ * 没有用到的页不占物理内存. 限制放开或者特别大的时候最多先分配 FDTABMAX 项
+ */
+static void fdtabinit(void)
+{
+    struct rlimit rl;
+    rlim_t n;
+
+    n = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        n = rl.rlim_cur;
+        if (n == RLIM_INFINITY || n > FDTABMAX) {
+            n = FDTABMAX;
+        }
+    }
+
+    if ((fdtab = calloc(n, sizeof fdtab[0])) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    nfdtab = n;
+}
+
+/**
+ * @brief 取得 fd 对应的等待表项, 表不够大的时候自动扩容
+ *
+ * @param fd
+ * @return Fdstate*
+ */
+static Fdstate *fdstate(int fd)
+{
+    int n;
+
+    if (fd >= nfdtab) {
+        n = nfdtab ? nfdtab : 64;
+        while (n <= fd) {
+            n *= 2;
+        }
+
+        /* Tasklist 里面只有 Task 指针, 协程之间互相链接, 不会指回表项, 因此可以直接 realloc */
+        fdtab = realloc(fdtab, n * sizeof fdtab[0]);
+        if (fdtab == nil) {
+            fprint(2, "out of memory\n");
+            abort();
+        }
+
+        memset(fdtab + nfdtab, 0, (n - nfdtab) * sizeof fdtab[0]);
+        nfdtab = n;
+    }
+
+    return &fdtab[fd];
+}
+
+/**
+ * @brief 唤醒链表上全部的等待协程, 调用者持有 fdlk
+ *
+ * 认领不到的是同时超时了, 留在链表上等 epollcancel 摘
+ *
+ * @param l
+ * @return int 唤醒了几个
+ */
+static int fdwakeall(Tasklist *l)
+{
+    Task *t, *next;
+    int n;
+
+    n = 0;
+    for (t = l->head; t != nil; t = next) {
+        next = t->next;
+        if (taskclaim(t)) {
+            deltask(l, t);
+            taskready(t);
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief 取得 fd 上 rw 方向的等待链表
+ */
+static Tasklist *fdwaitlist(Fdstate *fs, int rw)
+{
+    switch (rw) {
+    case 'r':
+        return &fs->rwait;
+    case 'w':
+        return &fs->wwait;
+    default:
+        return &fs->ewait;
+    }
+}
+
+/**
+ * @brief epoll 后端超时的时候把协程从 fd 的等待链表上摘下来
+ *
+ * fdtab 可能扩容搬家, 所以不能记链表的地址, waitarg 指向等待者栈上的 Fdwaiter
+ *
+ * @param t
+ */
+static void epollcancel(Task *t)
+{
+    Fdwaiter *w;
+
+    w = t->waitarg;
+    spinlock(&fdlk);
+    deltask(fdwaitlist(&fdtab[w->fd], w->rw), t);
+    spinunlock(&fdlk);
+}
+
+/**
+ * @brief epoll 后端的 fdwait 实现
+ *
+ * @param fd
+ * @param rw
+ * @param deadline
+ * @param again 调用者刚刚在 fd 上得到了 EAGAIN, 不需要重新检查 fd 的状态
+ * @return int 事件到达返回 0, 超时返回 -1
+ */
+static int epollwait(int fd, int rw, uvlong deadline, int again)
+{
+    struct epoll_event ev;
+    Fdstate *fs;
+    Fdwaiter w;
+    int bits;
+
+    switch (rw) {
+    case 'r':
+        bits = EPOLLIN;
+        break;
+    case 'w':
+        bits = EPOLLOUT;
+        break;
+    default:
+        bits = 0;
+        break;
+    }
+
+    /* 之前没人等待的时候事件已经到了, 直接消费掉. 挂断/出错是持续状态, 不清除 */
+    spinlock(&fdlk);
+    fs = fdstate(fd);
+    if (fs->ready & (bits | EPOLLERR | EPOLLHUP)) {
+        fs->ready &= ~bits;
+        spinunlock(&fdlk);
+        return 0;
+    }
+
+    /* 注册是持久的: 第一次等待的时候以边沿触发方式同时关注读写.
+     * ADD 的时候内核会立刻报告一次 fd 当前的状态, 所以不会漏掉注册之前到达的事件;
+     * 没有 EAGAIN 在先的等待用 MOD 让内核按当前状态再报告一次, 已经就绪的话事件马上就来.
+     * MOD 返回 ENOENT 说明 fd 编号上是直接 close 之后复用的新 fd, armed 是旧 fd 留下的, 重新注册 */
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (fs->armed && !again && epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+        fs->armed = 0;
+        fs->ready = 0;
+    }
+    if (!fs->armed) {
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+            /* 普通文件之类不支持 epoll 的 fd(EPERM) 总是就绪的, poll 也是这么报告的 */
+            spinunlock(&fdlk);
+            return 0;
+        }
+        fs->armed = 1;
+    }
+
+    taskwaitbegin();
+    addtask(fdwaitlist(fs, rw), taskrunning);
+    spinunlock(&fdlk);
+
+    w.fd = fd;
+    w.rw = rw;
+    if (taskwait(deadline, epollcancel, &w) < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 处理 epoll 返回的一个事件, 只唤醒这个 fd 上相应方向的等待者, 调用者持有 fdlk
+ *
+ * 和 poll 一样, 挂断和出错会唤醒所有方向的等待者. 没有唤醒到谁的事件记在 ready 里
+ *
+ * @param fd
+ * @param events
+ */
+static void epollwake(int fd, uint events)
+{
+    Fdstate *fs;
+
+    if (fd >= nfdtab) {
+        return;
+    }
+
+    fs = &fdtab[fd];
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        fs->ready |= events & (EPOLLERR | EPOLLHUP);
+        fdwakeall(&fs->ewait);
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+        if (fdwakeall(&fs->rwait) == 0) {
+            fs->ready |= EPOLLIN;
+        }
+    }
+
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        if (fdwakeall(&fs->wwait) == 0) {
+            fs->ready |= EPOLLOUT;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief 唤醒所有等待 fd 的协程, 调用者持有 fdlk
+ */
+static void fdwakeup1(int fd)
+{
+    int i;
+
+#if USE_EPOLL
+    Fdstate *fs;
+
+    if (epfd >= 0 && fd >= 0 && fd < nfdtab) {
+        fs = &fdtab[fd];
+        fdwakeall(&fs->rwait);
+        fdwakeall(&fs->wwait);
+        fdwakeall(&fs->ewait);
+    }
+#endif
+
+    /* poll 后端: 把等待这个 fd 的协程唤醒并移出 pollfd 数组 */
+    for (i = 0; i < npollfd; i++) {
+        while (i < npollfd && pollfd[i].fd == fd) {
+            if (taskclaim(polltask[i])) {
+                taskready(polltask[i]);
+            }
+            --npollfd;
+            pollfd[i] = pollfd[npollfd];
+            polltask[i] = polltask[npollfd];
+        }
+    }
+}
+
+/**
+ * @brief 唤醒所有等待 fd 的协程, 不关闭 fd
+ *
+ * 等待者的 fdwait 像 fd 就绪了一样返回, 再操作 fd 通常得到 EAGAIN. 用来让别的协程
+ * 放弃一个还没完成的操作, 比如 netdial 叫停输掉的那个 connect
+ *
+ * @param fd
+ */
+void fdwakeup(int fd)
+{
+    spinlock(&fdlk);
+    fdwakeup1(fd);
+    spinunlock(&fdlk);
+
+#ifdef USE_IOURING
+    if (uringon) {
+        uringcancel(fd);
+    }
+#endif
+}
+
+/**
+ * @brief 关闭 fd, 并唤醒所有还在等待它的协程
+ *
+ * 使用 epoll 后端的时候, fd 被直接 close 之后内核会悄悄删除注册, 还在等待的协程就永远醒不过来了.
+ * 被 fdwait 过的 fd 应该用本函数关闭, 等待者醒来之后再操作 fd 会得到 EBADF
+ *
+ * @param fd
+ * @return int close 的返回值
+ */
+int fdclose(int fd)
+{
+#if USE_EPOLL
+    Fdstate *fs;
+#endif
+
+    spinlock(&fdlk);
+#if USE_EPOLL
+    if (epfd >= 0 && fd >= 0 && fd < nfdtab) {
+        fs = &fdtab[fd];
+        if (fs->armed) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nil);
+        }
+        fs->armed = 0;
+        fs->ready = 0;
+    }
+#endif
+    fdwakeup1(fd);
+    spinunlock(&fdlk);
+
+#ifdef USE_IOURING
+    if (uringon) {
+        uringcancel(fd);
+    }
+#endif
+
+    return close(fd);
 }
 
 /**
@@ -239,11 +917,36 @@ int fdread1(int fd, void *buf, int n)
  * @return int 实际读取的字节数量
  */
 int fdread(int fd, void *buf, int n)
+{
+    return fdreadt(fd, buf, n, 0);
+}
+
+/**
+ * @brief 带截止时间的 fdread
+ *
+ * io_uring 引擎提交出去的操作没法按时间撤回, 有截止时间的时候走非阻塞读加 fdwaitt
+ *
+ * @param fd 文件描述符
+ * @param buf 读取数据缓冲区
+ * @param n 要读取的字节数量
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 实际读取的字节数量, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int fdreadt(int fd, void *buf, int n, uint64_t deadline)
 {
     int m;
 
+#ifdef USE_IOURING
+    startfdtask();
+    if (uringon && deadline == 0) {
+        return uringread(fd, buf, n);
+    }
+#endif
+
     while ((m = read(fd, buf, n)) < 0 && errno == EAGAIN) {
-        fdwait(fd, 'r');
+        if (_fdwait(fd, 'r', deadline) < 0) {
+            return -1;
+        }
     }
 
     return m;
@@ -260,13 +963,38 @@ int fdread(int fd, void *buf, int n)
  * @return int 实际写入的字节数量
  */
 int fdwrite(int fd, void *buf, int n)
+{
+    return fdwritet(fd, buf, n, 0);
+}
+
+/**
+ * @brief 带截止时间的 fdwrite
+ *
+ * @param fd 文件描述符
+ * @param buf 数据缓冲区
+ * @param n 要写入的字节数量
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 实际写入的字节数量. 超时的时候 errno 为 ETIMEDOUT, 已经写了一部分就返回写了的数量, 否则返回 -1
+ */
+int fdwritet(int fd, void *buf, int n, uint64_t deadline)
 {
     int m, tot;
 
+#ifdef USE_IOURING
+    startfdtask();
+#endif
+
     for (tot = 0; tot < n; tot += m) {
-        while ((m = write(fd, (char *)buf + tot, n - tot)) < 0 && errno == EAGAIN) {
-            fdwait(fd, 'w');
-        }
+#ifdef USE_IOURING
+        if (uringon && deadline == 0) {
+            m = uringwrite(fd, (char *)buf + tot, n - tot);
+        } else
+#endif
+            while ((m = write(fd, (char *)buf + tot, n - tot)) < 0 && errno == EAGAIN) {
+                if (_fdwait(fd, 'w', deadline) < 0) {
+                    return tot > 0 ? tot : -1;
+                }
+            }
 
         if (m < 0) {
             return m;
@@ -280,6 +1008,212 @@ int fdwrite(int fd, void *buf, int n)
     return tot;
 }
 
+/**
+ * @brief 分散读, 和 fdread 一样有数据就返回
+ *
+ * @param fd 文件描述符
+ * @param iov 缓冲区数组
+ * @param niov 数组长度, 不能超过 IOV_MAX
+ * @return int 实际读取的字节数量
+ */
+int fdreadv(int fd, struct iovec *iov, int niov)
+{
+    int m;
+
+#ifdef USE_IOURING
+    startfdtask();
+    if (uringon) {
+        return uringreadv(fd, iov, niov);
+    }
+#endif
+
+    while ((m = readv(fd, iov, niov)) < 0 && errno == EAGAIN) {
+        _fdwait(fd, 'r', 0);
+    }
+
+    return m;
+}
+
+/**
+ * @brief 聚集写, 把 iov 里的数据全部写完
+ *
+ * 头部和正文一次系统调用写出去, 开了 TCP_NODELAY 的连接上也只发一个包(数据够小的话),
+ * 不用先拷贝到一个缓冲区里. 只写了一部分的时候跳过已经写完的缓冲区接着写, 调整过的
+ * 那一项写完之后会还原, 调用者的数组不会被改动
+ *
+ * @param fd 文件描述符
+ * @param iov 缓冲区数组
+ * @param niov 数组长度, 不能超过 IOV_MAX
+ * @return int 实际写入的字节数量, 写了一部分之后出错返回写了的数量
+ */
+int fdwritev(int fd, struct iovec *iov, int niov)
+{
+    struct iovec save;
+    int m, tot, off;
+
+#ifdef USE_IOURING
+    startfdtask();
+#endif
+
+    tot = 0;
+    off = 0; /* iov[0] 已经写了的字节数 */
+    for (;;) {
+        /* 跳过写完的和空的缓冲区 */
+        while (niov > 0 && off >= iov->iov_len) {
+            off -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov == 0) {
+            break;
+        }
+
+        save = iov[0];
+        iov[0].iov_base = (char *)iov[0].iov_base + off;
+        iov[0].iov_len -= off;
+#ifdef USE_IOURING
+        if (uringon) {
+            m = uringwritev(fd, iov, niov);
+        } else
+#endif
+            while ((m = writev(fd, iov, niov)) < 0 && errno == EAGAIN) {
+                _fdwait(fd, 'w', 0);
+            }
+        iov[0] = save;
+
+        if (m < 0) {
+            return tot > 0 ? tot : m;
+        }
+        if (m == 0) {
+            break;
+        }
+        tot += m;
+        off += m;
+    }
+
+    return tot;
+}
+
+/**
+ * @brief 用 fdread/fdwrite 经过用户态缓冲区搬运, 是 fdsplice 的后备
+ */
+static int fdcopy(int rfd, int wfd, int max)
+{
+    char buf[8192];
+    int n;
+
+    if (max > sizeof buf) {
+        max = sizeof buf;
+    }
+    if ((n = fdread(rfd, buf, max)) <= 0) {
+        return n;
+    }
+    return fdwrite(wfd, buf, n) == n ? n : -1;
+}
+
+#ifdef __linux__
+/**
+ * @brief wfd 不支持 splice 的时候, 把已经进了管道的 n 字节读出来写过去
+ */
+static int fdpipecopy(int pfd, int wfd, int n)
+{
+    char buf[8192];
+    int m, tot;
+
+    for (tot = 0; tot < n; tot += m) {
+        m = n - tot;
+        if (m > sizeof buf) {
+            m = sizeof buf;
+        }
+        if ((m = read(pfd, buf, m)) <= 0 || fdwrite(wfd, buf, m) != m) {
+            return -1;
+        }
+    }
+    return n;
+}
+#endif
+
+/**
+ * @brief 从 rfd 搬运最多 max 字节到 wfd, 数据不经过用户态
+ *
+ * 用 splice 先从 rfd 搬进当前协程的管道, 再从管道搬到 wfd, 两边暂时不能读写的时候
+ * 用 fdwait 等待. 返回前管道总是被排空, 所以同一个协程可以轮流给不同的 fd 对用.
+ * 某一端不支持 splice 或者创建管道失败时, 退回到经过用户态拷贝.
+ * 两个 fd 都应该已经 fdnoblock.
+ *
+ * @param rfd 读端
+ * @param wfd 写端
+ * @param max 最多搬运的字节数, 一次最多一个管道容量(通常 64K)
+ * @return int 搬运的字节数, 0 表示 rfd 读到了 EOF, -1 表示出错
+ */
+int fdsplice(int rfd, int wfd, int max)
+{
+#ifdef __linux__
+    Task *t;
+    int n, m, tot;
+
+    t = taskrunning;
+    if (t->splicefd[0] < 0 && pipe2(t->splicefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        t->splicefd[0] = t->splicefd[1] = -1;
+        return fdcopy(rfd, wfd, max);
+    }
+
+    /* 管道是空的, SPLICE_F_NONBLOCK 下的 EAGAIN 只可能是 rfd 暂时没有数据 */
+    while ((n = splice(rfd, nil, t->splicefd[1], nil, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+        if (errno == EINVAL) {
+            return fdcopy(rfd, wfd, max);
+        }
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        _fdwait(rfd, 'r', 0);
+    }
+
+    for (tot = 0; tot < n; tot += m) {
+        while ((m = splice(t->splicefd[0], nil, wfd, nil, n - tot, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0 && errno == EAGAIN) {
+            _fdwait(wfd, 'w', 0);
+        }
+        if (m < 0 && errno == EINVAL && fdpipecopy(t->splicefd[0], wfd, n - tot) >= 0) {
+            break;
+        }
+        if (m <= 0) {
+            /* 管道里还剩着数据, 扔掉这个管道, 下次重新创建 */
+            close(t->splicefd[0]);
+            close(t->splicefd[1]);
+            t->splicefd[0] = t->splicefd[1] = -1;
+            return -1;
+        }
+    }
+    return n;
+#else
+    return fdcopy(rfd, wfd, max);
+#endif
+}
+
+/**
+ * @brief 清掉 fd 编号上残留的等待状态
+ *
+ * fd 编号可能被复用: 旧 fd 被直接 close 之后内核已经删除了注册, 这里把残留的状态清掉,
+ * 下一次 fdwait 会重新注册. 新创建的 fd 都要经过这里, 一般是通过 fdnoblock;
+ * accept4(SOCK_NONBLOCK) 得到的 fd 已经不阻塞了, 直接调用本函数
+ *
+ * @param fd
+ */
+void fdreset(int fd)
+{
+#if USE_EPOLL
+    Fdstate *fs;
+
+    spinlock(&fdlk);
+    if (fd >= 0 && fd < nfdtab) {
+        fs = &fdtab[fd];
+        fs->armed = 0;
+        fs->ready = 0;
+    }
+    spinunlock(&fdlk);
+#endif
+}
+
 /**
  * @brief 设置文件描述符 fd 为不阻塞模式
  *
@@ -288,21 +1222,67 @@ int fdwrite(int fd, void *buf, int n)
  */
 int fdnoblock(int fd)
 {
+    fdreset(fd);
     return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
 
+/* 调度器时钟. 默认 CLOCK_MONOTONIC, 不受 NTP 和手工改时间的影响, glibc 通过 vDSO 读取,
+ * 不陷入内核. 定义 USE_COARSECLOCK 改用 CLOCK_MONOTONIC_COARSE, 更便宜但精度只有一个 jiffy */
+#ifdef USE_COARSECLOCK
+#define TASKCLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define TASKCLOCK CLOCK_MONOTONIC
+#endif
+
+static uvlong clocknow; /* 缓存的当前时间, 由 fdtask 每轮刷新 */
+
 /**
- * @brief 获取当前时间的纳秒表示
+ * @brief 读取调度器时钟的纳秒表示
+ *
+ * 每次调用都会读一次时钟, 调度器内部一般用缓存的 tasknow
  *
  * @return uvlong
  */
-static uvlong nsec(void)
+uvlong nsec(void)
 {
-    struct timeval tv;
+    struct timespec ts;
 
-    if (gettimeofday(&tv, 0) < 0) {
+    if (clock_gettime(TASKCLOCK, &ts) < 0) {
         return -1;
     }
 
-    return (uvlong)tv.tv_sec * 1000 * 1000 * 1000 + tv.tv_usec * 1000;
+    return (uvlong)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 刷新缓存的时钟
+ *
+ * @return uvlong 刷新后的时间(ns)
+ */
+uvlong taskclock(void)
+{
+    uvlong now;
+
+    now = nsec();
+    __atomic_store_n(&clocknow, now, __ATOMIC_RELAXED);
+    return now;
+}
+
+/**
+ * @brief 缓存的调度器时钟
+ *
+ * fdtask 每次进入和离开 poll 的时候刷新, 一轮调度之内所有协程看到的是同一个时间,
+ * 读它不需要系统调用. 需要更精确的时间可以自己调用 clock_gettime(CLOCK_MONOTONIC)
+ *
+ * @return uint64_t 单调时间(ns), 起点不确定, 只能用来计算时间差
+ */
+uint64_t tasknow(void)
+{
+    uvlong now;
+
+    if ((now = __atomic_load_n(&clocknow, __ATOMIC_RELAXED)) == 0) {
+        now = taskclock();
+    }
+
+    return now;
 }
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <task.h>
 #include <unistd.h>
 
@@ -9,6 +10,7 @@ enum { STACK = 32768 };
 
 char *server;
 char *url;
+Netpool *pool;
 
 void fetchtask(void *);
 
@@ -24,6 +26,9 @@ void taskmain(int argc, char **argv)
     server = argv[2];
     url = argv[3];
 
+    /* 连接用 keep-alive 重用, 每个请求不用重新握手 */
+    pool = netpoolcreate(server, 80, n, 30000);
+
     for (i = 0; i < n; i++) {
         taskcreate(fetchtask, 0, STACK);
         while (taskyield() > 1)
@@ -34,20 +39,59 @@ void taskmain(int argc, char **argv)
 
 void fetchtask(void *v)
 {
-    int fd, n;
-    char buf[512];
+    int fd, n, m, status, length, keep;
+    char *line, buf[BIOSIZE];
+    Biobuf b;
 
     fprintf(stderr, "starting...\n");
     for (;;) {
-        if ((fd = netdial(TCP, server, 80)) < 0) {
+        if ((fd = netpoolget(pool)) < 0) {
             fprintf(stderr, "dial %s: %s (%s)\n", server, strerror(errno), taskgetstate());
             continue;
         }
-        snprintf(buf, sizeof buf, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", url, server);
-        fdwrite(fd, buf, strlen(buf));
-        while ((n = fdread(fd, buf, sizeof buf)) > 0)
-            ;
-        close(fd);
+        bioinit(&b, fd);
+        bioprint(&b, "GET %s HTTP/1.1\r\n", url);
+        bioprint(&b, "Host: %s\r\n\r\n", server);
+        bioflush(&b);
+
+        /* 状态行和头部一行一行解析, 通常一次 read 就全部读进来了 */
+        status = 0;
+        length = -1;
+        keep = 0;
+        if ((line = bioreadline(&b, '\n', &n)) != 0 && n > 12) {
+            status = atoi(line + 9);
+            keep = strncmp(line, "HTTP/1.1", 8) == 0;
+        }
+        while (line != 0 && n > 2) {
+            line = bioreadline(&b, '\n', &n);
+            if (line != 0 && n > 15 && strncasecmp(line, "Content-Length:", 15) == 0)
+                length = atoi(line + 15);
+            if (line != 0 && n > 17 && strncasecmp(line, "Connection: close", 17) == 0)
+                keep = 0;
+        }
+        if (status != 200)
+            fprintf(stderr, "%s: status %d\n", url, status);
+
+        /* 有 Content-Length 的时候只读这么多, 连接还能接着用; 否则读到 EOF */
+        if (line != 0 && length >= 0) {
+            for (; length > 0; length -= m) {
+                if ((m = bioread(&b, buf, length < sizeof buf ? length : sizeof buf)) <= 0)
+                    break;
+            }
+        } else {
+            keep = 0;
+            while (bioread(&b, buf, sizeof buf) > 0)
+                ;
+        }
+
+        /* 缓冲里还有多读的数据就不能放回去 */
+        if (keep && line != 0 && length == 0 && b.rp == b.re) {
+            bioterm(&b);
+            netpoolput(pool, fd);
+        } else {
+            bioterm(&b);
+            fdclose(fd);
+        }
         write(1, ".", 1);
     }
 }
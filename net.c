@@ -1,58 +1,120 @@
+#define _GNU_SOURCE /* accept4 */
 #include "taskimpl.h"
-#include <netdb.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+static int parseip(char *, uint32_t *);
+
+enum {
+    NETRACEDELAY = 250, /* 毫秒, IPv6 先走一步的时间, RFC 8305 的 Connection Attempt Delay */
+    NETRACESTACK = 32768,
+};
+
 /**
  * @brief 启动监听网络
  *
+ * server 里有 ':' 的时候当作 IPv6 地址, 其中 "::" 创建双栈的套接字, IPv4 和 IPv6
+ * 的连接都接受; 其余的情况(包括空和 "*")和原来一样只监听 IPv4
+ *
  * @param istcp
  * @param server
  * @param port
  * @return int
  */
 int netannounce(int istcp, char *server, int port)
+{
+    return netannouncex(istcp, server, port, 0, 0);
+}
+
+/**
+ * @brief 可以指定 listen 队列长度和选项的 netannounce
+ *
+ * NETREUSEPORT 打开 SO_REUSEPORT: 同一个端口可以 announce 多次, 内核把新连接分给各个
+ * 监听套接字, 多个调度线程或者进程各自 accept, 不用抢同一个队列.
+ *
+ * TCP 的监听套接字上设置 TCP_NODELAY, Linux 上 accept 出来的连接会继承它, netaccept
+ * 就不用每个连接再设置一次
+ *
+ * @param istcp
+ * @param server
+ * @param port
+ * @param backlog listen 队列长度, 不大于 0 的时候用 SOMAXCONN, 内核还会用 net.core.somaxconn 截断
+ * @param flags 0 或者 NETREUSEPORT
+ * @return int
+ */
+int netannouncex(int istcp, char *server, int port, int backlog, int flags)
 {
     int fd, n, proto;
-    struct sockaddr_in sa;
-    socklen_t sn;
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sa;
+    struct sockaddr_in6 *sa6;
+    socklen_t len;
     uint32_t ip;
 
     taskstate("netannounce");
     proto = istcp ? SOCK_STREAM : SOCK_DGRAM;
-    memset(&sa, 0, sizeof sa);
-    sa.sin_family = AF_INET;
-    if (server != nil && strcmp(server, "*") != 0) {
-        if (netlookup(server, &ip) < 0) {
-            taskstate("netlookup failed");
+    memset(&ss, 0, sizeof ss);
+    sa = (struct sockaddr_in *)&ss;
+    sa6 = (struct sockaddr_in6 *)&ss;
+    if (server != nil && strchr(server, ':') != nil) {
+        if (inet_pton(AF_INET6, server, &sa6->sin6_addr) != 1) {
+            taskstate("bad address");
+            errno = EINVAL;
             return -1;
         }
-        memmove(&sa.sin_addr, &ip, 4);
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons(port);
+        len = sizeof *sa6;
+    } else {
+        sa->sin_family = AF_INET;
+        if (server != nil && strcmp(server, "*") != 0) {
+            if (netlookup(server, &ip) < 0) {
+                taskstate("netlookup failed");
+                return -1;
+            }
+            memmove(&sa->sin_addr, &ip, 4);
+        }
+        sa->sin_port = htons(port);
+        len = sizeof *sa;
     }
 
-    sa.sin_port = htons(port);
-    if ((fd = socket(AF_INET, proto, 0)) < 0) {
+    if ((fd = socket(ss.ss_family, proto, 0)) < 0) {
         taskstate("socket failed");
         return -1;
     }
 
     /* set reuse flag for tcp */
-    if (istcp && getsockopt(fd, SOL_SOCKET, SO_TYPE, (void *)&n, &sn) >= 0) {
+    if (istcp) {
         n = 1;
         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&n, sizeof n);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&n, sizeof n);
     }
 
-    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0) {
+    n = 1;
+    if ((flags & NETREUSEPORT) && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&n, sizeof n) < 0) {
+        taskstate("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+
+    /* "::" 不管 net.ipv6.bindv6only 怎么设置都做成双栈的 */
+    if (ss.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&sa6->sin6_addr)) {
+        n = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&n, sizeof n);
+    }
+
+    if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
         taskstate("bind failed");
         close(fd);
         return -1;
     }
 
     if (proto == SOCK_STREAM) {
-        listen(fd, 16);
+        listen(fd, backlog > 0 ? backlog : SOMAXCONN);
     }
 
     fdnoblock(fd);
@@ -60,45 +122,154 @@ int netannounce(int istcp, char *server, int port)
     return fd;
 }
 
+/**
+ * @brief 把对端地址打印到 server, 端口记到 port
+ *
+ * 双栈套接字上 IPv4 的对端是 ::ffff:a.b.c.d 这样的映射地址, 还原成 IPv4 的写法,
+ * 这样只监听 IPv4 或者只接受 IPv4 连接的程序用 16 字节的缓冲区就够了
+ */
+static void netaddrfmt(struct sockaddr_storage *ss, char *server, int *port)
+{
+    struct sockaddr_in6 *sa6;
+    struct sockaddr_in *sa;
+    uchar *ip;
+
+    if (ss->ss_family == AF_INET6) {
+        sa6 = (struct sockaddr_in6 *)ss;
+        ip = sa6->sin6_addr.s6_addr;
+        if (server && IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
+            snprint(server, 16, "%d.%d.%d.%d", ip[12], ip[13], ip[14], ip[15]);
+        } else if (server) {
+            inet_ntop(AF_INET6, ip, server, NETADDRLEN);
+        }
+        if (port) {
+            *port = ntohs(sa6->sin6_port);
+        }
+        return;
+    }
+
+    sa = (struct sockaddr_in *)ss;
+    if (server) {
+        ip = (uchar *)&sa->sin_addr;
+        snprint(server, 16, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+    }
+    if (port) {
+        *port = ntohs(sa->sin_port);
+    }
+}
+
 /**
  * @brief 等待网络 accept
  *
  * @param fd 套接字对应的文件描述符
- * @param server 如不为空, 则打印对端 ip 地址到此参数
+ * @param server 如不为空, 则打印对端 ip 地址到此参数, IPv6 的监听套接字需要 NETADDRLEN 字节
  * @param port 如不为空, 对端的端口记录在这里
  * @return int 返回新连接套接字文件描述符
  */
 int netaccept(int fd, char *server, int *port)
 {
-    int cfd, one;
-    struct sockaddr_in sa;
-    uchar *ip;
+    return netacceptt(fd, server, port, 0);
+}
+
+/**
+ * @brief 接一个连接
+ *
+ * accept4 直接得到不阻塞的 fd, 每个连接只要一次系统调用. TCP_NODELAY 从监听套接字继承,
+ * 自己创建的监听套接字要自己设置
+ *
+ * 和 fdread 一样先试一次 accept, EAGAIN 了才等, 队列里有连接的时候不用等待
+ *
+ * @return int 新连接的 fd, 出错或者超时返回 -1
+ */
+static int netaccept1(int fd, struct sockaddr_storage *sa, uvlong deadline)
+{
     socklen_t len;
+    int cfd;
+
+    len = sizeof *sa;
+#ifdef USE_IOURING
+    startfdtask();
+    if (uringon && deadline == 0) {
+        cfd = uringaccept(fd, (void *)sa, &len);
+    } else
+#endif
+    {
+        while ((cfd = accept4(fd, (void *)sa, &len, SOCK_NONBLOCK)) < 0 && errno == EAGAIN) {
+            if (_fdwait(fd, 'r', deadline) < 0) {
+                break;
+            }
+            len = sizeof *sa;
+        }
+    }
 
-    fdwait(fd, 'r');
+    if (cfd >= 0) {
+        fdreset(cfd);
+    }
+    return cfd;
+}
+
+/**
+ * @brief 带截止时间的 netaccept
+ *
+ * @param fd 套接字对应的文件描述符
+ * @param server 如不为空, 则打印对端 ip 地址到此参数, IPv6 的监听套接字需要 NETADDRLEN 字节
+ * @param port 如不为空, 对端的端口记录在这里
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 返回新连接套接字文件描述符, 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int netacceptt(int fd, char *server, int *port, uint64_t deadline)
+{
+    struct sockaddr_storage sa;
+    int cfd;
 
     taskstate("netaccept");
-    len = sizeof sa;
-    if ((cfd = accept(fd, (void *)&sa, &len)) < 0) {
+    if ((cfd = netaccept1(fd, &sa, deadline)) < 0) {
         taskstate("accept failed");
         return -1;
     }
 
-    if (server) {
-        ip = (uchar *)&sa.sin_addr;
-        snprint(server, 16, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-    }
+    netaddrfmt(&sa, server, port);
+    taskstate("netaccept succeeded");
+    return cfd;
+}
 
-    if (port) {
-        *port = ntohs(sa.sin_port);
+/**
+ * @brief 一次接走队列里全部的连接, 最多 n 个
+ *
+ * 队列为空的时候等到至少有一个连接(或者截止时间到), 然后不再等待, 一直 accept 到
+ * EAGAIN 或者接满 n 个. 连接风暴里一次唤醒就能把积压的连接都拿走. 对端地址需要的话用 getpeername
+ *
+ * @param fd 监听套接字
+ * @param cfd 新连接的 fd 放在这里
+ * @param n cfd 的大小
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 接到的连接数, 一个也没有接到返回 -1
+ */
+int netacceptn(int fd, int *cfd, int n, uint64_t deadline)
+{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int i;
+
+    taskstate("netaccept");
+    if (n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((cfd[0] = netaccept1(fd, &sa, deadline)) < 0) {
+        taskstate("accept failed");
+        return -1;
     }
 
-    /* cfd 设置为不阻塞, 并禁用 TCP 的 Nagle 算法 */
-    fdnoblock(cfd);
-    one = 1;
-    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof one);
+    for (i = 1; i < n; i++) {
+        len = sizeof sa;
+        if ((cfd[i] = accept4(fd, (void *)&sa, &len, SOCK_NONBLOCK)) < 0) {
+            break;
+        }
+        fdreset(cfd[i]);
+    }
     taskstate("netaccept succeeded");
-    return cfd;
+    return i;
 }
 
 /* IP 地址的分类:
@@ -190,7 +361,8 @@ static int parseip(char *name, uint32_t *ip)
 /**
  * @brief 查询 ip 或者域名的整型地址
  *
- * 如果是 ip 地址, 直接解析乘整型即可, 如果是域名, 走 DNS 查询
+ * 如果是 ip 地址, 直接解析乘整型即可, 如果是域名, 走 DNS 查询(dns.c),
+ * 查询期间只有当前协程等待
  *
  * @param name
  * @param ip
@@ -198,15 +370,11 @@ static int parseip(char *name, uint32_t *ip)
  */
 int netlookup(char *name, uint32_t *ip)
 {
-    struct hostent *he;
-
     if (parseip(name, ip) >= 0)
         return 0;
 
-    /* BUG - Name resolution blocks.  Need a non-blocking DNS. */
     taskstate("netlookup");
-    if ((he = gethostbyname(name)) != 0) {
-        *ip = *(uint32_t *)he->h_addr;
+    if (dnslookup(name, AF_INET, ip) >= 0) {
         taskstate("netlookup succeeded");
         return 0;
     }
@@ -216,29 +384,53 @@ int netlookup(char *name, uint32_t *ip)
 }
 
 /**
- * @brief 创建到 server:port 的网络连接
+ * @brief 把 name:port 解析成 family 地址族的 sockaddr
  *
- * @param istcp 传 1 创建 TCP 连接, 0 创建 UDP 连接
- * @param server 服务器地址
- * @param port 服务器端口
- * @return int
+ * IPv4 走 netlookup; IPv6 先当作字面地址, 不是的话查 AAAA 记录
+ *
+ * @return int 成功返回 0, 失败返回 -1
  */
-int netdial(int istcp, char *server, int port)
+static int netaddr(char *name, int port, int family, struct sockaddr_storage *ss, socklen_t *len)
 {
-    int proto, fd, n;
+    struct sockaddr_in6 *sa6;
+    struct sockaddr_in *sa;
     uint32_t ip;
-    struct sockaddr_in sa;
-    socklen_t sn;
 
-    /* 解析 server 地址 */
-    if (netlookup(server, &ip) < 0)
+    memset(ss, 0, sizeof *ss);
+    if (family == AF_INET6) {
+        sa6 = (struct sockaddr_in6 *)ss;
+        if (inet_pton(AF_INET6, name, &sa6->sin6_addr) != 1) {
+            taskstate("netlookup");
+            if (dnslookup(name, AF_INET6, &sa6->sin6_addr) < 0) {
+                taskstate("netlookup failed");
+                return -1;
+            }
+        }
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons(port);
+        *len = sizeof *sa6;
+        return 0;
+    }
+
+    if (netlookup(name, &ip) < 0) {
         return -1;
+    }
+    sa = (struct sockaddr_in *)ss;
+    sa->sin_family = AF_INET;
+    memmove(&sa->sin_addr, &ip, 4);
+    sa->sin_port = htons(port);
+    *len = sizeof *sa;
+    return 0;
+}
 
-    taskstate("netdial");
+/**
+ * @brief 创建不阻塞的套接字
+ */
+static int netsocket(int istcp, int family)
+{
+    int fd, n;
 
-    /* 创建套接字对象 */
-    proto = istcp ? SOCK_STREAM : SOCK_DGRAM;
-    if ((fd = socket(AF_INET, proto, 0)) < 0) {
+    if ((fd = socket(family, istcp ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0) {
         taskstate("socket failed");
         return -1;
     }
@@ -252,24 +444,43 @@ int netdial(int istcp, char *server, int port)
          * 默认情况下, UDP 不允许向广播地址发送数据包 */
         setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &n, sizeof n);
     }
+    return fd;
+}
 
-    /* start connecting */
-    memset(&sa, 0, sizeof sa);
-    memmove(&sa.sin_addr, &ip, 4);
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    if (connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0 && errno != EINPROGRESS) {
+/**
+ * @brief 在 fd 上连接 sa, 等到连上, 出错或者超时. 失败的时候不关闭 fd
+ *
+ * @return int 成功返回 0, 失败返回 -1 并设置 errno
+ */
+static int netconnect(int fd, struct sockaddr_storage *sa, socklen_t len, uvlong deadline)
+{
+    struct sockaddr_storage peer;
+    socklen_t sn;
+    int n;
+
+#ifdef USE_IOURING
+    startfdtask();
+    if (uringon && deadline == 0) {
+        n = uringconnect(fd, (struct sockaddr *)sa, len);
+    } else
+#endif
+        n = connect(fd, (struct sockaddr *)sa, len);
+
+    if (n < 0 && errno != EINPROGRESS) {
         taskstate("connect failed");
-        close(fd);
         return -1;
     }
 
-    /* wait for finish */
-    fdwait(fd, 'w');
-    sn = sizeof sa;
-    if (getpeername(fd, (struct sockaddr *)&sa, &sn) >= 0) {
+    /* wait for finish, 已经连上(io_uring 通常如此)就不用等了 */
+    if (n < 0 && _fdwait(fd, 'w', deadline) < 0) {
+        taskstate("connect timed out");
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    sn = sizeof peer;
+    if (getpeername(fd, (struct sockaddr *)&peer, &sn) >= 0) {
         taskstate("connect succeeded");
-        return fd;
+        return 0;
     }
 
     /* report error */
@@ -278,8 +489,237 @@ int netdial(int istcp, char *server, int port)
     if (n == 0)
         n = ECONNREFUSED;
 
-    close(fd);
     taskstate("connect failed");
     errno = n;
     return -1;
 }
+
+/**
+ * @brief 连接一个已经解析好的地址
+ */
+static int netdialaddr(int istcp, struct sockaddr_storage *sa, socklen_t len, uvlong deadline)
+{
+    int fd, err;
+
+    if ((fd = netsocket(istcp, sa->ss_family)) < 0) {
+        return -1;
+    }
+    if (netconnect(fd, sa, len, deadline) < 0) {
+        err = errno;
+        fdclose(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Happy Eyeballs(RFC 8305): 域名的 TCP 连接由两个协程分别走 IPv6 和 IPv4, 谁先连上用谁.
+ * IPv6 先开始, IPv4 等 NETRACEDELAY 毫秒或者 IPv6 失败了再开始, 所以 IPv6 不通(路由
+ * 黑洞, 丢 SYN)的时候最多多花 NETRACEDELAY, 而不是等 IPv6 的连接超时. 域名解析也在
+ * 各自的协程里做, AAAA 查不到不会拖慢 IPv4.
+ *
+ * 赢家用 fdwakeup 叫醒还在连的输家, 输家醒来看到已经有结果了就关掉自己的 fd 退出.
+ * 调用者放弃(超时)之后两个协程可能还在跑, 所以 Netrace 由三方引用计数, 最后一个释放.
+ */
+typedef struct Netrace Netrace;
+struct Netrace {
+    char *name;
+    int port;
+    uvlong deadline;
+    QLock lk;
+    Rendez r;   /* 调用者等结果, IPv4 等 IPv6 先走一步也睡在这里, r.l 是 lk */
+    int fd;     /* 先连上的 fd */
+    int cfd[2]; /* 两个协程正在连的 fd, 0 是 IPv6, 1 是 IPv4 */
+    int nfail;
+    int err;  /* 最后一个失败的 errno */
+    int done; /* 调用者已经拿走结果或者放弃了 */
+    int ref;
+};
+
+static void netracedone(Netrace *r)
+{
+    int last;
+
+    last = --r->ref == 0;
+    qunlock(&r->lk);
+    if (last) {
+        free(r->name);
+        free(r);
+    }
+}
+
+static void netracetry(Netrace *r, int family)
+{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    uvlong t;
+    int i, fd, n;
+
+    i = family == AF_INET6 ? 0 : 1;
+    if (netaddr(r->name, r->port, family, &sa, &len) < 0) {
+        qlock(&r->lk);
+        r->nfail++;
+        r->err = EHOSTUNREACH;
+        taskwakeupall(&r->r);
+        netracedone(r);
+        return;
+    }
+
+    qlock(&r->lk);
+    if (family == AF_INET && r->fd < 0 && !r->done && r->nfail == 0) {
+        t = tasknow() + (uvlong)NETRACEDELAY * 1000000;
+        if (r->deadline != 0 && r->deadline < t) {
+            t = r->deadline;
+        }
+        tasksleept(&r->r, t);
+    }
+    if (r->fd >= 0 || r->done || (fd = netsocket(TCP, family)) < 0) {
+        r->nfail++;
+        r->err = errno;
+        taskwakeupall(&r->r);
+        netracedone(r);
+        return;
+    }
+    r->cfd[i] = fd;
+    qunlock(&r->lk);
+
+    n = netconnect(fd, &sa, len, r->deadline);
+
+    qlock(&r->lk);
+    r->cfd[i] = -1;
+    if (n >= 0 && r->fd < 0 && !r->done) {
+        r->fd = fd;
+        fd = -1;
+        if (r->cfd[1 - i] >= 0) {
+            fdwakeup(r->cfd[1 - i]);
+        }
+    } else if (n < 0) {
+        r->nfail++;
+        r->err = errno;
+    }
+    taskwakeupall(&r->r);
+    netracedone(r);
+    if (fd >= 0) {
+        fdclose(fd);
+    }
+}
+
+static void netrace6(void *v)
+{
+    taskname("netdial6");
+    netracetry(v, AF_INET6);
+}
+
+static void netrace4(void *v)
+{
+    taskname("netdial4");
+    netracetry(v, AF_INET);
+}
+
+/**
+ * @brief 同时用 IPv6 和 IPv4 连接域名 name, 返回先连上的
+ */
+static int netrace(char *name, int port, uvlong deadline)
+{
+    Netrace *r;
+    int fd, err, i;
+
+    r = malloc(sizeof *r);
+    if (r == nil || (r->name = strdup(name)) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    memset(&r->lk, 0, sizeof r->lk);
+    memset(&r->r, 0, sizeof r->r);
+    r->r.l = &r->lk;
+    r->port = port;
+    r->deadline = deadline;
+    r->fd = -1;
+    r->cfd[0] = r->cfd[1] = -1;
+    r->nfail = 0;
+    r->err = 0;
+    r->done = 0;
+    r->ref = 3;
+
+    taskcreate(netrace6, r, NETRACESTACK);
+    taskcreate(netrace4, r, NETRACESTACK);
+
+    taskstate("netdial");
+    qlock(&r->lk);
+    while (r->fd < 0 && r->nfail < 2) {
+        if (!tasksleept(&r->r, deadline)) {
+            break;
+        }
+    }
+    fd = r->fd;
+    err = r->nfail < 2 ? ETIMEDOUT : r->err;
+
+    /* 放弃的时候叫停还在连的协程, 也叫醒还在等 IPv6 先走的 IPv4 */
+    r->done = 1;
+    for (i = 0; i < 2; i++) {
+        if (r->cfd[i] >= 0) {
+            fdwakeup(r->cfd[i]);
+        }
+    }
+    taskwakeupall(&r->r);
+    netracedone(r);
+
+    if (fd < 0) {
+        taskstate("connect failed");
+        errno = err;
+        return -1;
+    }
+    taskstate("connect succeeded");
+    return fd;
+}
+
+/**
+ * @brief 创建到 server:port 的网络连接
+ *
+ * server 可以是 IPv4 或 IPv6 地址, 也可以是域名. 域名的 TCP 连接同时尝试 IPv6 和
+ * IPv4(见 netrace), UDP 优先用 IPv4 地址, 没有 A 记录才用 IPv6
+ *
+ * @param istcp 传 1 创建 TCP 连接, 0 创建 UDP 连接
+ * @param server 服务器地址
+ * @param port 服务器端口
+ * @return int
+ */
+int netdial(int istcp, char *server, int port)
+{
+    return netdialt(istcp, server, port, 0);
+}
+
+/**
+ * @brief 带截止时间的 netdial
+ *
+ * 域名的 TCP 连接里截止时间也限制域名解析, 其余情况只限制连接的时间
+ *
+ * @param istcp 传 1 创建 TCP 连接, 0 创建 UDP 连接
+ * @param server 服务器地址
+ * @param port 服务器端口
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 超时返回 -1 并设置 errno 为 ETIMEDOUT
+ */
+int netdialt(int istcp, char *server, int port, uint64_t deadline)
+{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    uint32_t ip;
+
+    /* 字面地址只有一个地址族, 不用赛跑 */
+    if (strchr(server, ':') != nil) {
+        if (netaddr(server, port, AF_INET6, &sa, &len) < 0) {
+            return -1;
+        }
+    } else if (parseip(server, &ip) >= 0 || !istcp) {
+        if (netaddr(server, port, AF_INET, &sa, &len) < 0 && netaddr(server, port, AF_INET6, &sa, &len) < 0) {
+            return -1;
+        }
+    } else {
+        return netrace(server, port, deadline);
+    }
+
+    taskstate("netdial");
+    return netdialaddr(istcp, &sa, len, deadline);
+}
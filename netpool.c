@@ -0,0 +1,283 @@
+#include "taskimpl.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/*
+ * 出站连接池
+ *
+ * 每个目的地址一个 Netpool. netpoolget 取一个空闲连接, 没有就 netdial 一个新的;
+ * 用完还能接着用的连接 netpoolput 放回来, 下次不用再握手, 也不会留下一堆 TIME_WAIT.
+ *
+ * 空闲连接按放回的先后串成双向链表, 取的时候取最近放回的(头), 超时从最老的(尾)开始
+ * 淘汰, 取和放都是 O(1). 空闲连接都注册在池子自己的 epoll fd 上, 一个 reaper 协程
+ * 用 fdwait 等这个 epoll fd: 对端关闭或者发来了不该有的数据, 连接马上被淘汰; 空闲超过
+ * idlems 的也被关掉, 免得用上服务器那边已经超时关掉的连接. 取出的时候再用
+ * MSG_PEEK 看一眼, 补上 reaper 还没来得及处理的情况.
+ */
+
+enum {
+    NETPOOLSTACK = 32768,
+};
+
+typedef struct Netconn Netconn;
+struct Netconn {
+    int fd;
+    uvlong since; /* 放回池子的时间(tasknow 的 ns) */
+    Netconn *prev;
+    Netconn *next;
+};
+
+struct Netpool {
+    char *server;
+    int port;
+    int maxidle;
+    uvlong idlens;
+    QLock lk;
+    int epfd;      /* 只注册空闲的连接 */
+    Netconn *head; /* 最近放回的 */
+    Netconn *tail; /* 最早放回的 */
+    int nidle;
+    Netconn *free; /* 空闲的 Netconn 结构 */
+    int reaper;    /* reaper 协程已经启动 */
+    int closing;   /* netpoolfree 之后 reaper 负责释放 */
+};
+
+/**
+ * @brief 创建一个连接池
+ *
+ * @param server 目的地址, 和 netdial 一样
+ * @param port 目的端口
+ * @param maxidle 最多保留的空闲连接数, 多出来的放回时直接关掉
+ * @param idlems 空闲超过这么多毫秒的连接被关掉, 0 表示不限
+ * @return Netpool*
+ */
+Netpool *netpoolcreate(char *server, int port, int maxidle, int idlems)
+{
+    Netpool *p;
+
+    p = malloc(sizeof *p);
+    if (p == nil || (p->server = strdup(server)) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    if ((p->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprint(2, "netpoolcreate epoll_create1: %r\n");
+        abort();
+    }
+    fdreset(p->epfd);
+    p->port = port;
+    p->maxidle = maxidle;
+    p->idlens = (uvlong)idlems * 1000000;
+    memset(&p->lk, 0, sizeof p->lk);
+    p->head = p->tail = nil;
+    p->nidle = 0;
+    p->free = nil;
+    p->reaper = 0;
+    p->closing = 0;
+    return p;
+}
+
+/**
+ * @brief 把空闲连接 c 从链表上摘下来, 调用者持有 p->lk
+ */
+static void netpoolunlink(Netpool *p, Netconn *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        p->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        p->tail = c->prev;
+    }
+    p->nidle--;
+    c->next = p->free;
+    p->free = c;
+}
+
+/**
+ * @brief 淘汰一个空闲连接, 调用者持有 p->lk
+ *
+ * 关闭的时候内核顺带把 fd 从池子的 epoll 上删掉
+ */
+static void netpoolevict(Netpool *p, Netconn *c)
+{
+    fdclose(c->fd);
+    netpoolunlink(p, c);
+}
+
+static void netpoolreaper(void *v)
+{
+    struct epoll_event ev[64];
+    Netpool *p;
+    Netconn *c;
+    uvlong deadline, now;
+    int i, n;
+
+    p = v;
+    taskname("netpool %s:%d", p->server, p->port);
+    tasksystem();
+
+    qlock(&p->lk);
+    while (!p->closing) {
+        /* 池子空的时候每 idlems 醒一次, 所以空闲超时最多晚 idlems */
+        deadline = 0;
+        if (p->idlens != 0) {
+            deadline = p->tail ? p->tail->since + p->idlens : tasknow() + p->idlens;
+        }
+        qunlock(&p->lk);
+        fdwaitt(p->epfd, 'r', deadline);
+        qlock(&p->lk);
+        if (p->closing) {
+            break;
+        }
+
+        /* 空闲连接上有事件就是坏了: 对端关闭, 出错, 或者发来了没人要的数据 */
+        do {
+            n = epoll_wait(p->epfd, ev, nelem(ev), 0);
+            for (i = 0; i < n; i++) {
+                netpoolevict(p, ev[i].data.ptr);
+            }
+        } while (n == nelem(ev));
+
+        now = tasknow();
+        while ((c = p->tail) != nil && p->idlens != 0 && c->since + p->idlens <= now) {
+            netpoolevict(p, c);
+        }
+    }
+
+    while (p->head) {
+        netpoolevict(p, p->head);
+    }
+    while ((c = p->free) != nil) {
+        p->free = c->next;
+        free(c);
+    }
+    qunlock(&p->lk);
+    fdclose(p->epfd);
+    free(p->server);
+    free(p);
+}
+
+/**
+ * @brief 取一个连接, 没有空闲的就新建一个
+ *
+ * @param p
+ * @return int 连接的 fd, 失败返回 -1
+ */
+int netpoolget(Netpool *p)
+{
+    return netpoolgett(p, 0);
+}
+
+/**
+ * @brief 带截止时间的 netpoolget, 只有新建连接的时候会等
+ *
+ * @param p
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 连接的 fd, 失败或超时返回 -1
+ */
+int netpoolgett(Netpool *p, uint64_t deadline)
+{
+    Netconn *c;
+    char buf;
+    int fd;
+
+    qlock(&p->lk);
+    while ((c = p->head) != nil) {
+        fd = c->fd;
+        netpoolunlink(p, c);
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, nil);
+
+        /* 没有数据可读(EAGAIN)才是好的: 0 是对端关了, 有数据是上一次没读完 */
+        if (recv(fd, &buf, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+            qunlock(&p->lk);
+            return fd;
+        }
+        fdclose(fd);
+    }
+    qunlock(&p->lk);
+
+    return netdialt(TCP, p->server, p->port, deadline);
+}
+
+/**
+ * @brief 放回一个还能接着用的连接
+ *
+ * 连接上不能有没读完的数据. 出过错或者对端要关闭的连接应该直接 fdclose, 不要放回来
+ *
+ * @param p
+ * @param fd netpoolget 得到的 fd
+ */
+void netpoolput(Netpool *p, int fd)
+{
+    struct epoll_event ev;
+    Netconn *c;
+
+    qlock(&p->lk);
+    if (p->nidle >= p->maxidle) {
+        qunlock(&p->lk);
+        fdclose(fd);
+        return;
+    }
+
+    if ((c = p->free) != nil) {
+        p->free = c->next;
+    } else if ((c = malloc(sizeof *c)) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    c->fd = fd;
+    c->since = tasknow();
+
+    /* 水平触发: 事件一直在, reaper 迟一点处理也不会丢 */
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        c->next = p->free;
+        p->free = c;
+        qunlock(&p->lk);
+        fdclose(fd);
+        return;
+    }
+
+    c->prev = nil;
+    c->next = p->head;
+    if (p->head) {
+        p->head->prev = c;
+    } else {
+        p->tail = c;
+    }
+    p->head = c;
+    p->nidle++;
+
+    if (!p->reaper) {
+        p->reaper = 1;
+        taskcreate(netpoolreaper, p, NETPOOLSTACK);
+    }
+    qunlock(&p->lk);
+}
+
+/**
+ * @brief 关掉全部空闲连接并释放连接池, 借出去的连接不受影响, 由调用者自己关闭
+ *
+ * @param p
+ */
+void netpoolfree(Netpool *p)
+{
+    qlock(&p->lk);
+    if (p->reaper) {
+        /* reaper 醒来之后负责清理 */
+        p->closing = 1;
+        qunlock(&p->lk);
+        fdwakeup(p->epfd);
+        return;
+    }
+    qunlock(&p->lk);
+    fdclose(p->epfd);
+    free(p->server);
+    free(p);
+}
@@ -167,6 +167,7 @@ char *vseprint(char *dst, char *edst, char *fmt, va_list arg)
 
                     /* 先把指针指向结束位置, 这样就可以直接从个位倒着开始输出了 */
                     p = buf + sizeof buf; /* 这个 p 是局部变量, 和外面那个没有关系*/
+                    neg = 0;
                     zero = 0;
 
                     /* TODO-DONE: 负号在哪里填充的?
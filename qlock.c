@@ -1,5 +1,20 @@
 #include "taskimpl.h"
 
+/**
+ * @brief 超时的时候把协程从 QLock 的等待队列上摘下来
+ *
+ * @param t
+ */
+static void qlockcancel(Task *t)
+{
+    QLock *l;
+
+    l = t->waitarg;
+    spinlock(&l->lk);
+    deltask(&l->waiting, t);
+    spinunlock(&l->lk);
+}
+
 /**
  * @brief 获取锁
  *
@@ -7,27 +22,40 @@
  *
  * @param l 锁对象
  * @param block 是否阻塞等待取到锁
+ * @param deadline 阻塞等待的截止时间, 0 表示一直等
  * @return int 获取结果, 1 表示取得锁, 0 表示取不到锁
  */
-static int _qlock(QLock *l, int block)
+static int _qlock(QLock *l, int block, uvlong deadline)
 {
+    spinlock(&l->lk);
     if (l->owner == nil) {
         l->owner = taskrunning;
+        spinunlock(&l->lk);
         return 1;
     }
 
-    if (!block)
+    if (!block) {
+        spinunlock(&l->lk);
         return 0;
+    }
+
+    taskwaitbegin();
     addtask(&l->waiting, taskrunning);
+    spinunlock(&l->lk);
     taskstate("qlock");
 
     /* 注意 taskrunning 不在可调度任务列表里面, 下面的 if 条件要成立, 只能是在锁持有者
-     * 调用 qunlock 才能重新把 taskrunning 设置 taskready, 进而解除协程的阻塞 */
-    taskswitch();
+     * 调用 qunlock 才能重新把 taskrunning 设置 taskready, 进而解除协程的阻塞.
+     * 超时的协程已经从 waiting 上摘掉了, 不会被分配到锁 */
+    if (taskwait(deadline, qlockcancel, l) < 0) {
+        errno = ETIMEDOUT;
+        return 0;
+    }
     if (l->owner != taskrunning) {
         fprint(2, "qlock: owner=%p self=%p oops\n", l->owner, taskrunning);
         abort();
     }
+
     return 1;
 }
 
@@ -39,7 +67,19 @@ static int _qlock(QLock *l, int block)
  */
 void qlock(QLock *l)
 {
-    _qlock(l, 1);
+    _qlock(l, 1, 0);
+}
+
+/**
+ * @brief 获取锁, 最多等到 deadline
+ *
+ * @param l 锁对象
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 获取结果, 1 表示取得锁, 0 表示超时(errno 为 ETIMEDOUT)
+ */
+int qlockt(QLock *l, uint64_t deadline)
+{
+    return _qlock(l, 1, deadline);
 }
 
 /**
@@ -50,7 +90,7 @@ void qlock(QLock *l)
  */
 int canqlock(QLock *l)
 {
-    return _qlock(l, 0);
+    return _qlock(l, 0, 0);
 }
 
 /**
@@ -60,18 +100,26 @@ int canqlock(QLock *l)
  */
 void qunlock(QLock *l)
 {
-    Task *ready;
+    Task *ready, *next;
 
+    spinlock(&l->lk);
     if (l->owner == 0) {
         fprint(2, "qunlock: owner=0\n");
         abort();
     }
 
-    /* 分配锁给新的持有者, 并解除阻塞状态 */
-    if ((l->owner = ready = l->waiting.head) != nil) {
-        deltask(&l->waiting, ready);
-        taskready(ready);
+    /* 分配锁给新的持有者, 并解除阻塞状态. 认领不到的是正在超时的, 跳过 */
+    l->owner = nil;
+    for (ready = l->waiting.head; ready != nil; ready = next) {
+        next = ready->next;
+        if (taskclaim(ready)) {
+            deltask(&l->waiting, ready);
+            l->owner = ready;
+            taskready(ready);
+            break;
+        }
     }
+    spinunlock(&l->lk);
 }
 
 /**
@@ -85,16 +133,20 @@ static int _rlock(RWLock *l, int block)
 {
     /* 没有写等待, 直接给读者分配锁
      * 有写等待的时候, 把读操作加在等待队列, 等写操作完成读操作才能继续 */
+    spinlock(&l->lk);
     if (l->writer == nil && l->wwaiting.head == nil) {
         l->readers++;
+        spinunlock(&l->lk);
         return 1;
     }
 
     if (!block) {
+        spinunlock(&l->lk);
         return 0;
     }
 
     addtask(&l->rwaiting, taskrunning);
+    spinunlock(&l->lk);
     taskstate("rlock");
     taskswitch();
     return 1;
@@ -131,15 +183,20 @@ int canrlock(RWLock *l)
 static int _wlock(RWLock *l, int block)
 {
     /* 没有写协程, 且没有读者持有锁 */
+    spinlock(&l->lk);
     if (l->writer == nil && l->readers == 0) {
         l->writer = taskrunning;
+        spinunlock(&l->lk);
         return 1;
     }
 
-    if (!block)
+    if (!block) {
+        spinunlock(&l->lk);
         return 0;
+    }
 
     addtask(&l->wwaiting, taskrunning);
+    spinunlock(&l->lk);
     taskstate("wlock");
     taskswitch();
     return 1;
@@ -175,11 +232,13 @@ void runlock(RWLock *l)
 {
     Task *t;
 
+    spinlock(&l->lk);
     if (--l->readers == 0 && (t = l->wwaiting.head) != nil) {
         deltask(&l->wwaiting, t);
         l->writer = t;
         taskready(t);
     }
+    spinunlock(&l->lk);
 }
 
 /**
@@ -191,6 +250,7 @@ void wunlock(RWLock *l)
 {
     Task *t;
 
+    spinlock(&l->lk);
     if (l->writer == nil) {
         fprint(2, "wunlock: not locked\n");
         abort();
@@ -216,4 +276,5 @@ void wunlock(RWLock *l)
         l->writer = t;
         taskready(t);
     }
+    spinunlock(&l->lk);
 }
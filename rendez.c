@@ -4,6 +4,21 @@
  * sleep and wakeup
  */
 
+/**
+ * @brief 超时的时候把协程从 Rendez 的等待队列上摘下来
+ *
+ * @param t
+ */
+static void rendezcancel(Task *t)
+{
+    Rendez *r;
+
+    r = t->waitarg;
+    spinlock(&r->lk);
+    deltask(&r->waiting, t);
+    spinunlock(&r->lk);
+}
+
 /**
  * @brief 协程睡眠等待
  *
@@ -11,14 +26,38 @@
  */
 void tasksleep(Rendez *r)
 {
+    tasksleept(r, 0);
+}
+
+/**
+ * @brief 协程睡眠等待, 最多等到 deadline
+ *
+ * 不管是被唤醒还是超时, 返回之前都会重新获取 r->l
+ *
+ * @param r
+ * @param deadline 截止时间(tasknow 的 ns), 0 表示一直等
+ * @return int 被唤醒返回 1, 超时返回 0(errno 为 ETIMEDOUT)
+ */
+int tasksleept(Rendez *r, uint64_t deadline)
+{
+    int woken;
+
+    /* 先挂到等待队列再释放 r->l, 拿到 r->l 之后再 taskwakeup 的一定能看到我们.
+     * 在切走之前就被唤醒也没关系, 见 task.c 的 oncpu */
+    spinlock(&r->lk);
+    taskwaitbegin();
     addtask(&r->waiting, taskrunning);
+    spinunlock(&r->lk);
     if (r->l)
         qunlock(r->l);
 
     taskstate("sleep");
-    taskswitch();
+    woken = taskwait(deadline, rendezcancel, r) == 0;
     if (r->l)
         qlock(r->l);
+    if (!woken)
+        errno = ETIMEDOUT;
+    return woken;
 }
 
 /**
@@ -33,20 +72,26 @@ void tasksleep(Rendez *r)
 static int _taskwakeup(Rendez *r, int all)
 {
     int i;
-    Task *t;
+    Task *t, *next;
 
-    for (i = 0;; i++) {
+    spinlock(&r->lk);
+    i = 0;
+    for (t = r->waiting.head; t != nil; t = next) {
         /* 仅唤醒 i=0 的协程 */
         if (i == 1 && !all)
             break;
 
-        if ((t = r->waiting.head) == nil)
-            break;
+        /* 认领不到的是正在超时的, 跳过 */
+        next = t->next;
+        if (!taskclaim(t))
+            continue;
 
         deltask(&r->waiting, t); /* deltask 会更新 head 节点*/
         taskready(t);
+        i++;
     }
 
+    spinunlock(&r->lk);
     return i;
 }
 
@@ -0,0 +1,128 @@
+#include "taskimpl.h"
+#include <sys/mman.h>
+
+/*
+ * 协程栈分配
+ *
+ * 每个栈单独 mmap, 最低的一页设成 PROT_NONE 作为保护页, 栈溢出直接 SIGSEGV,
+ * 不会悄悄写坏相邻的内存. 协程退出后栈不还给系统, 按大小挂到空闲链表上,
+ * 下次创建同样大小的协程直接取用, 省掉 mmap/mprotect/munmap 三次系统调用.
+ *
+ * 空闲链表按映射大小(页对齐)分组, 最多 NSTACKPOOL 种大小, 每种最多缓存
+ * STACKPOOLMAX 个, 超出的直接 munmap. 链表指针就存在空闲栈的开头.
+ *
+ * 空闲链表由 stacklk 保护.
+ */
+
+enum {
+    NSTACKPOOL = 8,
+    STACKPOOLMAX = 1024,
+};
+
+typedef struct Stack Stack;
+struct Stack {
+    Stack *next;
+};
+
+typedef struct Stackpool Stackpool;
+struct Stackpool {
+    uint size; /* 可用部分的大小, 不含保护页 */
+    int n;
+    Stack *free;
+};
+
+static Stackpool stackpool[NSTACKPOOL];
+static Lock stacklk;
+static uint pagesize;
+
+/**
+ * @brief 找 size 对应的空闲链表, 没有就占一个空位
+ *
+ * @param size 页对齐的大小
+ * @return Stackpool* 种类已满时返回 nil
+ */
+static Stackpool *poolfor(uint size)
+{
+    int i;
+
+    for (i = 0; i < NSTACKPOOL; i++) {
+        if (stackpool[i].size == size) {
+            return &stackpool[i];
+        }
+        if (stackpool[i].size == 0) {
+            stackpool[i].size = size;
+            return &stackpool[i];
+        }
+    }
+    return nil;
+}
+
+static uint stackround(uint n)
+{
+    if (pagesize == 0) {
+        pagesize = sysconf(_SC_PAGESIZE);
+    }
+    return (n + pagesize - 1) & ~(pagesize - 1);
+}
+
+/**
+ * @brief 分配一个至少 n 字节的栈, 下面紧挨着一个保护页
+ *
+ * @param n 所需大小
+ * @return void* 可用部分的起始(低)地址
+ */
+void *stackalloc(uint n)
+{
+    Stackpool *p;
+    Stack *s;
+    uchar *v;
+
+    n = stackround(n);
+    spinlock(&stacklk);
+    p = poolfor(n);
+    if (p && p->free) {
+        s = p->free;
+        p->free = s->next;
+        p->n--;
+        spinunlock(&stacklk);
+        return s;
+    }
+    spinunlock(&stacklk);
+
+    v = mmap(nil, n + pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (v == MAP_FAILED) {
+        fprint(2, "stackalloc mmap: %r\n");
+        abort();
+    }
+    if (mprotect(v, pagesize, PROT_NONE) < 0) {
+        fprint(2, "stackalloc mprotect: %r\n");
+        abort();
+    }
+    return v + pagesize;
+}
+
+/**
+ * @brief 归还 stackalloc 分配的栈
+ *
+ * @param v stackalloc 的返回值
+ * @param n 分配时传的大小
+ */
+void stackfree(void *v, uint n)
+{
+    Stackpool *p;
+    Stack *s;
+
+    n = stackround(n);
+    spinlock(&stacklk);
+    p = poolfor(n);
+    if (p && p->n < STACKPOOLMAX) {
+        s = v;
+        s->next = p->free;
+        p->free = s;
+        p->n++;
+        spinunlock(&stacklk);
+        return;
+    }
+    spinunlock(&stacklk);
+    munmap((uchar *)v - pagesize, n + pagesize);
+}
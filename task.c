@@ -18,18 +18,209 @@ static int taskidgen;
 
 int taskdebuglevel;
 int taskcount; /* 记录目前有多少个 "非系统任务" 协程, 这个数目也不包含调度器协程 */
-int tasknswitch;   /* 记录当前已经做了多少次协程切换操作 */
-int taskexitval;   /* 当前正在运行中协程退出码 */
-Task *taskrunning; /* 指向当前正在运行的协程对象 */
+int taskexitval; /* 当前正在运行中协程退出码 */
+int tasknready;  /* 所有线程的待运行队列里面一共有多少协程 */
 
-Context taskschedcontext; /* 调度器上下文 */
-Tasklist taskrunqueue;    /* 待运行协程队列 */
+static int taskdirect = 1; /* 协程之间直接切换, 不经过调度器 */
+static int taskacct;       /* 记录运行和等待时间, 每次切换读一次时钟 */
+
+/* M:N 模式
+ *
+ * taskprocs 之后有多个调度线程(Proc), 每个线程有自己的待运行队列、调度器上下文和正在运行的协程,
+ * 自己的队列空了就去别的线程的队列里偷一半过来. 共享状态各有各的锁(Lock, 先自旋, 久了让出 CPU):
+ *  - 待运行队列是 Proc.lk, 通道和 QLock/RWLock/Rendez 是对象里面的 lk, 时间轮是 fd.c 的 timerlk,
+ *    fd 等待表是 fd.c 的 fdlk, 任务表是 alllk. 要同时持有的时候按 对象 -> timerlk -> 待运行队列,
+ *    fdlk -> alllk -> 待运行队列 的顺序, 几个通道按地址从小到大. 计数用 taskxadd
+ *  - 协程切换的时候不持有任何锁. 协程挂到等待的地方, 放开锁, 再切走, 这中间可能已经被唤醒并且被
+ *    别的线程取走了. oncpu 表示它的上下文还没有保存好, 取走它的调度器要等 oncpu 清掉才能切进去,
+ *    由切走它的线程在切到下一个上下文之后清. 直接切换取到这样的协程不等, 交给自己的调度器去等,
+ *    这样等待的一方总是调度器, 不会两个协程互相等
+ *  - 可能被几方同时唤醒的等待(通道的几个分支, 截止时间...)用 taskclaim 认领, 见 taskwaitbegin
+ * 单线程的时候 taskmt 为 0, 加锁解锁都是空操作 */
+int taskmt;
+static Lock alllk; /* 保护 alltask, nalltask 和 taskidgen */
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taskidle = PTHREAD_COND_INITIALIZER; /* 空闲的调度线程在这里等待 */
+static int nidle;
+
+static Proc proc0; /* 主线程 */
+static Proc *proc0list[] = {&proc0};
+static Proc **procs = proc0list;
+static int nproc = 1;
+static __thread Proc *procself; /* 用户自己创建的线程里是 nil */
 
 Task **alltask;
 int nalltask;
 
 static char *argv0;
 static void contextswitch(Context *from, Context *to);
+static void taskscheduler(void);
+
+/**
+ * @brief 当前线程的 Proc
+ *
+ * 协程可能在一次切换之后就换到了另一个线程上运行, 不能让编译器把线程局部变量的地址
+ * 缓存下来跨过协程切换使用, 所以不内联, 每次都重新读
+ *
+ * @return Proc* 不是调度线程(比如用户自己创建的线程)返回 nil
+ */
+__attribute__((noinline)) Proc *proc(void)
+{
+    return procself;
+}
+
+/**
+ * @brief 取得 l, 单线程时 spinlock 宏不会调用到这里
+ *
+ * 锁都只持有很短的时间, 先自旋; 持有者所在的线程可能被换下了 CPU, 转一阵还拿不到就让出 CPU
+ */
+void _spinlock(Lock *l)
+{
+    int n;
+
+    n = 0;
+    while (__atomic_exchange_n(&l->held, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&l->held, __ATOMIC_RELAXED)) {
+            if (++n < 64) {
+                __builtin_ia32_pause();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+/**
+ * @brief 释放 l
+ */
+void _spinunlock(Lock *l)
+{
+    __atomic_store_n(&l->held, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief M:N 模式下原子的 *p += v
+ *
+ * @return int 加过之后的值
+ */
+int _taskxadd(int *p, int v)
+{
+    return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 把协程追加到 p 的待运行队列, 有空闲的线程就叫醒一个来偷
+ *
+ * 空闲的线程先登记 nidle 再看 tasknready, 这里反过来先加 tasknready 再看 nidle,
+ * 两边至少有一边能看到对方, 不会一边睡下去一边又没叫
+ */
+static void runqpush(Proc *p, Task *t)
+{
+    spinlock(&p->lk);
+    addtask(&p->runqueue, t);
+    p->nrunqueue++;
+    spinunlock(&p->lk);
+    taskxadd(&tasknready, 1);
+
+    if (taskmt && __atomic_load_n(&nidle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idlelock);
+        pthread_cond_signal(&taskidle);
+        pthread_mutex_unlock(&idlelock);
+    }
+}
+
+/**
+ * @brief 从 p 的待运行队列头部取出一个协程
+ */
+static Task *runqpop(Proc *p)
+{
+    Task *t;
+
+    spinlock(&p->lk);
+    if ((t = p->runqueue.head) != nil) {
+        deltask(&p->runqueue, t);
+        p->nrunqueue--;
+    }
+    spinunlock(&p->lk);
+
+    if (t != nil) {
+        taskxadd(&tasknready, -1);
+    }
+    return t;
+}
+
+/**
+ * @brief 从其他线程的队列里面偷一半(至少一个)协程过来
+ *
+ * 先在 q 的锁下面摘到临时链表上, 放开之后再挂到自己的队列上, 不会同时持有两个队列的锁
+ *
+ * @param p 当前线程
+ * @return Task* 偷到的第一个协程, 已经从队列上摘下, 没偷到返回 nil
+ */
+static Task *runqsteal(Proc *p)
+{
+    int i, n, k;
+    Proc *q;
+    Task *t, *u;
+    Tasklist l;
+
+    for (i = 1; i < nproc; i++) {
+        q = procs[(p->id + i) % nproc];
+        if (__atomic_load_n(&q->nrunqueue, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        l.head = l.tail = nil;
+        spinlock(&q->lk);
+        for (k = 0, n = (q->nrunqueue + 1) / 2; k < n; k++) {
+            t = q->runqueue.head;
+            deltask(&q->runqueue, t);
+            addtask(&l, t);
+        }
+        q->nrunqueue -= k;
+        spinunlock(&q->lk);
+        if (k == 0) {
+            continue;
+        }
+
+        t = l.head;
+        deltask(&l, t);
+        if (k > 1) {
+            spinlock(&p->lk);
+            while ((u = l.head) != nil) {
+                deltask(&l, u);
+                addtask(&p->runqueue, u);
+            }
+            p->nrunqueue += k - 1;
+            spinunlock(&p->lk);
+        }
+        taskxadd(&tasknready, -1);
+        return t;
+    }
+
+    return nil;
+}
+
+/**
+ * @brief 切换完成之后在切进来的上下文里调用
+ *
+ * 被切走的协程的上下文到这里才保存好, 清掉它的 oncpu, 等着切进它的调度器才能继续.
+ * oncpu 只在 M:N 模式下维护
+ */
+static void taskswitched(void)
+{
+    Proc *p;
+
+    if (!taskmt) {
+        return;
+    }
+
+    p = proc();
+    if (p->prev != nil) {
+        __atomic_store_n(&p->prev->oncpu, 0, __ATOMIC_RELEASE);
+        p->prev = nil;
+    }
+}
 
 /**
  * @brief 协程信息 debug
@@ -88,6 +279,8 @@ static void taskstart(uint y, uint x)
     z |= y;
     t = (Task *)z;
 
+    taskswitched();
+
     //print("taskstart %p\n", t);
     t->startfn(t->startarg);
     //print("taskexits %p\n", t);
@@ -109,19 +302,19 @@ static Task *taskalloc(void (*fn)(void *), void *arg, uint stack)
     sigset_t zero;
     uint x, y;
     ulong z;
+    uchar *stk;
 
-    /* allocate the task and stack together */
-    t = malloc(sizeof *t + stack);
-    if (t == nil) {
-        fprint(2, "taskalloc malloc: %r\n");
-        abort();
-    }
+    /* allocate the task and stack together
+     * 内存布局: `保护页--栈内存--task 结构(High)`, 栈向下增长, 溢出会撞上保护页 */
+    stack = (stack + 15) & ~15;
+    stk = stackalloc(stack + sizeof *t);
+    t = (Task *)(stk + stack);
 
     memset(t, 0, sizeof *t);
 
-    t->stk = (uchar *)(t + 1); /* 设置栈指针 */
+    t->stk = stk;              /* 设置栈指针 */
     t->stksize = stack;        /* 运行时栈大小 */
-    t->id = ++taskidgen;       /* 协程 id */
+    t->splicefd[0] = t->splicefd[1] = -1;
 
     /* 入口函数与函数参数 */
     t->startfn = fn;
@@ -183,11 +376,12 @@ int taskcreate(void (*fn)(void *), void *arg, uint stack)
     Task *t;
 
     t = taskalloc(fn, arg, stack);
-    taskcount++;
-    id = t->id;
+    taskxadd(&taskcount, 1);
 
     /* 所有任务都在 alltask 上面记录
      * 然后用 `t->alltaskslot` 记录在 alltask 里面的索引号 */
+    spinlock(&alllk);
+    id = t->id = ++taskidgen; /* 协程 id */
     if (nalltask % 64 == 0) {
         alltask = realloc(alltask, (nalltask + 64) * sizeof(alltask[0]));
         if (alltask == nil) {
@@ -198,6 +392,7 @@ int taskcreate(void (*fn)(void *), void *arg, uint stack)
 
     t->alltaskslot = nalltask;
     alltask[nalltask++] = t;
+    spinunlock(&alllk);
     taskready(t);
     return id;
 }
@@ -213,17 +408,153 @@ void tasksystem(void)
 {
     if (!taskrunning->system) {
         taskrunning->system = 1;
-        --taskcount;
+        taskxadd(&taskcount, -1);
+    }
+}
+
+/**
+ * @brief 运行统计用的时钟, 没有打开 taskaccounting 的时候不读时钟, 返回 0
+ *
+ * 总是直接读 CLOCK_MONOTONIC, 不跟着 TASKCLOCK: USE_COARSECLOCK 的时候 nsec 一个 jiffy
+ * 才走一步, 比它短的运行时间都会记成 0
+ */
+static uvlong statclock(void)
+{
+    struct timespec ts;
+
+    if (!taskacct) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uvlong)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 协程 t 从 now 开始运行
+ */
+static void taskrunstart(Task *t, uvlong now)
+{
+    t->nrun++;
+    if (!taskacct) {
+        return;
+    }
+    t->waittime += now - t->readyat;
+    t->runstart = now;
+}
+
+/**
+ * @brief 协程 t 在 now 停止运行
+ *
+ * taskyield 里 taskready 自己的时候还在运行, 就绪时间从这里开始算
+ */
+static void taskrunstop(Task *t, uvlong now)
+{
+    uvlong d;
+
+    if (!taskacct) {
+        return;
+    }
+    d = now - t->runstart;
+    t->runtime += d;
+    if (d > t->maxslice) {
+        t->maxslice = d;
+    }
+    if (t->ready) {
+        t->readyat = now;
     }
 }
 
 /**
- * @brief 切换到调度器协程运行
+ * @brief 切换到下一个协程运行
+ *
+ * 直接切换模式下, 从调度队列取出下一个协程直接切过去, 一次交接只需要一次上下文切换.
+ * 只有当前协程要退出(需要调度器释放它的栈), 调度队列为空(需要调度器去别的线程偷或者等待),
+ * 已经没有非系统任务(需要调度器退出程序), 或者取到的协程还在别的线程上切走(需要调度器等它)
+ * 的时候才切回调度器
+ *
+ * 调用者不能持有任何锁, 返回的时候可能已经在另一个线程上
  */
 void taskswitch(void)
 {
+    Proc *p;
+    Task *from, *t;
+    uvlong now;
+
     needstack(0);
-    contextswitch(&taskrunning->context, &taskschedcontext);
+    p = proc();
+    from = p->running;
+    now = statclock();
+    p->switchat = now;
+    taskrunstop(from, now);
+    if (taskdirect && !from->exiting && taskcount > 0 && (t = runqpop(p)) != nil) {
+        /* 取出来的就是自己(yield 时队列里只有自己), 不需要切换 */
+        if (t == from) {
+            t->ready = 0;
+            p->nswitch++;
+            taskrunstart(t, now);
+            return;
+        }
+
+        if (!taskmt || !__atomic_load_n(&t->oncpu, __ATOMIC_ACQUIRE)) {
+            t->ready = 0;
+            if (taskmt) {
+                t->oncpu = 1;
+                p->prev = from;
+            }
+            p->running = t;
+            p->nswitch++;
+            taskrunstart(t, now);
+            taskdebug("run %d (%s)", t->id, t->name);
+            contextswitch(&from->context, &t->context);
+            taskswitched();
+            return;
+        }
+        p->handoff = t;
+    }
+
+    if (taskmt) {
+        p->prev = from;
+    }
+    contextswitch(&from->context, &p->schedcontext);
+    taskswitched();
+}
+
+/**
+ * @brief 打开或关闭协程之间的直接切换, 默认打开
+ *
+ * 关闭后每次切换都经过调度器, 即 `协程->调度器->协程`
+ *
+ * @param on
+ */
+void taskdirectswitch(int on)
+{
+    taskdirect = on;
+}
+
+/**
+ * @brief 打开或关闭运行时间的统计, 默认关闭
+ *
+ * 打开之后每次切换读一次 CLOCK_MONOTONIC. 从打开的时候开始计时,
+ * 之前的运行和等待不算
+ *
+ * @param on
+ */
+void taskaccounting(int on)
+{
+    uvlong now;
+    int i;
+
+    spinlock(&alllk);
+    taskacct = on;
+    now = statclock();
+    for (i = 0; i < nalltask; i++) {
+        alltask[i]->runstart = now;
+        alltask[i]->readyat = now;
+    }
+    for (i = 0; i < nproc; i++) {
+        procs[i]->switchat = now;
+    }
+    spinunlock(&alllk);
 }
 
 /**
@@ -235,23 +566,37 @@ void taskswitch(void)
  */
 void taskready(Task *t)
 {
+    Proc *p;
+    uvlong now;
+
+    /* 正在运行的协程(taskyield)在 taskrunstop 里记就绪时间.
+     * 别的不再读时钟, 取这个线程最近一次切换和 fdtask 最近一次刷新时钟里晚的那个,
+     * 唤醒者这一段已经运行的时间会算进等待里 */
+    p = proc();
+    if (taskacct && t != taskrunning) {
+        now = tasknow();
+        t->readyat = now > p->switchat ? now : p->switchat;
+    }
     t->ready = 1;
-    addtask(&taskrunqueue, t);
+    runqpush(p, t);
 }
 
 /**
  * @brief 主动交出 CPU
  *
  * 返回值 -1 表示让出去资源之后没有做任何调度又回到这里来了
- * 这种情况不会发生因为我们的 taskrunqueue 队列里面最少有一个当前运行的 taskrunning
+ * 这种情况不会发生因为我们的待运行队列里面最少有一个当前运行的 taskrunning
  *
  * 本函数返回此次 yield 之后, 到再度重新被执行, 经历了多少次任务切换
- * 如果只有这个任务自己在被调度, 返回值应该是 0 */
+ * 如果只有这个任务自己在被调度, 返回值应该是 0.
+ * M:N 模式下只数当前线程上的切换, 回来的时候换了线程返回 0 */
 int taskyield(void)
 {
+    Proc *p;
     int n;
 
-    n = tasknswitch;
+    p = proc();
+    n = p->nswitch;
 
     /* 先把当前任务放回到调度队列 */
     taskready(taskrunning);
@@ -262,7 +607,10 @@ int taskyield(void)
     /* 切换到其他任务执行 */
     taskswitch();
 
-    return tasknswitch - n - 1;
+    if (proc() != p) {
+        return 0;
+    }
+    return p->nswitch - n - 1;
 }
 
 /**
@@ -272,7 +620,7 @@ int taskyield(void)
  */
 int anyready(void)
 {
-    return taskrunqueue.head != nil;
+    return tasknready > 0;
 }
 
 /**
@@ -318,52 +666,169 @@ static void contextswitch(Context *from, Context *to)
  * @brief 协程调度器
  *
  * 这个函数实际上不在定义好的 Task 里面执行(为描述方便, 把这个函数的执行流程叫做调度器协程),
- * 所有的协程间任务切换, 都是从 `调度器协程->自定义 task ->调度器协程` 这样处理的
+ * 关闭直接切换的时候, 所有的协程间任务切换, 都是从 `调度器协程->自定义 task ->调度器协程` 这样处理的.
+ * 打开直接切换的时候, 只有协程退出或者没有可运行协程的时候才会回到这里.
+ *
+ * M:N 模式下每个线程都运行一个调度器. 调度器的上下文属于线程, 不会迁移
  */
 static void taskscheduler(void)
 {
     int i;
+    Proc *p;
     Task *t;
 
     taskdebug("scheduler enter");
 
+    p = proc();
     for (;;) {
         if (taskcount == 0) {
             /* 当最后一个 non-system 任务退出之后, 这个程序随之退出 */
             exit(taskexitval);
         }
 
-        t = taskrunqueue.head;
-        if (t == nil) {
-            fprint(2, "no runnable tasks! %d tasks stalled\n", taskcount);
-            exit(1);
+        if ((t = p->handoff) != nil) {
+            p->handoff = nil;
+        } else if ((t = runqpop(p)) == nil && (t = runqsteal(p)) == nil) {
+            if (!taskmt) {
+                fprint(2, "no runnable tasks! %d tasks stalled\n", taskcount);
+                exit(1);
+            }
+
+            pthread_mutex_lock(&idlelock);
+            __atomic_add_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&tasknready, __ATOMIC_SEQ_CST) == 0) {
+                /* 别的线程也都空闲, 并且没有 fdtask 在等 I/O, 再也不会有协程就绪了 */
+                if (nidle == nproc && !__atomic_load_n(&fdpolling, __ATOMIC_SEQ_CST)) {
+                    fprint(2, "no runnable tasks! %d tasks stalled\n", taskcount);
+                    exit(1);
+                }
+                pthread_cond_wait(&taskidle, &idlelock);
+            }
+            __atomic_sub_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&idlelock);
+            continue;
+        }
+
+        /* 还在别的线程上切走, 等它的上下文保存好. 这时候这个线程上没有协程在运行, 不会互相等 */
+        while (__atomic_load_n(&t->oncpu, __ATOMIC_ACQUIRE)) {
+            sched_yield();
         }
 
-        deltask(&taskrunqueue, t);
         t->ready = 0;
-        taskrunning = t;
-        tasknswitch++; /* 协程切换统计计数 */
+        if (taskmt) {
+            t->oncpu = 1;
+        }
+        p->running = t;
+        p->nswitch++; /* 协程切换统计计数 */
+        p->switchat = statclock();
+        taskrunstart(t, p->switchat);
         taskdebug("run %d (%s)", t->id, t->name);
 
         /* 切换任务, 从调度器切换到具体的协程 */
-        contextswitch(&taskschedcontext, &t->context);
+        contextswitch(&p->schedcontext, &t->context);
+        taskswitched();
 
+        /* 协程之间可能已经直接切换了很多次, 切回调度器的是当前的 taskrunning, 不一定是 t */
         //print("back in scheduler\n");
-        taskrunning = nil;
+        t = p->running;
+        p->running = nil;
 
         /* 协程已经退出, 清理 */
         if (t->exiting) {
             if (!t->system) {
-                taskcount--;
+                taskxadd(&taskcount, -1);
             }
 
             /* 把倒数第一个任务, 移动到现在要被删除的这个任务位置上来 */
+            spinlock(&alllk);
             i = t->alltaskslot;
             alltask[i] = alltask[--nalltask];
             alltask[i]->alltaskslot = i;
-            free(t);
+            spinunlock(&alllk);
+            if (t->splicefd[0] >= 0) {
+                close(t->splicefd[0]);
+                close(t->splicefd[1]);
+            }
+            stackfree(t->stk, t->stksize + sizeof *t);
+        }
+    }
+}
+
+/**
+ * @brief 调度线程的入口, 在新线程上运行一个调度器
+ *
+ * @param v 线程的 Proc
+ */
+static void *procmain(void *v)
+{
+    procself = v;
+    taskscheduler();
+    return nil;
+}
+
+/**
+ * @brief 切换到 M:N 模式, 用 n 个线程运行协程
+ *
+ * 只能打开一次, 打开之后不能关闭. 需要 epoll 后端, io_uring 引擎会被关闭
+ *
+ * @param n 线程数量(包括当前线程), 小于等于 0 表示 CPU 数量
+ * @return int 实际的线程数量
+ */
+int taskprocs(int n)
+{
+    int i;
+    Proc *p;
+    Proc **pp;
+
+    if (taskmt) {
+        return nproc;
+    }
+
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (n <= 1) {
+        return 1;
+    }
+
+    /* 所有线程共用一个 fdtask, 它等待 I/O 的时候别的线程还在注册 fd */
+    if (fdmtinit() < 0) {
+        fprint(2, "taskprocs: multiple procs need the epoll backend\n");
+        return 1;
+    }
+
+    pp = malloc(n * sizeof pp[0]);
+    if (pp == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+
+    pp[0] = &proc0;
+    for (i = 1; i < n; i++) {
+        if ((p = calloc(1, sizeof *p)) == nil) {
+            fprint(2, "out of memory\n");
+            abort();
+        }
+        p->id = i;
+        pp[i] = p;
+    }
+
+    /* 从这里开始加解锁都是真的了. 现在没有持有着的锁, 新线程创建之后才会有别人来抢.
+     * 单线程的时候不维护 oncpu, 只有我们自己正在运行 */
+    procs = pp;
+    nproc = n;
+    taskrunning->oncpu = 1;
+    taskmt = 1;
+
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&pp[i]->thread, nil, procmain, pp[i]) != 0) {
+            fprint(2, "taskprocs: pthread_create: %r\n");
+            abort();
         }
     }
+
+    return n;
 }
 
 /**
@@ -446,9 +911,9 @@ void needstack(int n)
     char *at = (char *)&t; /* 这里取局部变量 t 的地址, 这个地址在栈上 */
     char *stk = (char *)t->stk;
 
-    /* 一个 task 结构的内存如下: `开始(Low)--task 结构(也是stk指向)--栈内存--结束(High)`
+    /* 一个 task 的内存如下: `保护页--栈内存(stk 指向开始)--task 结构(High)`
      *
-     * 1. at < stk 的话, 说明栈已经溢出以 stk 为栈边界的内存范围, 侵入到 task 数据结构体范围内了
+     * 1. at < stk 的话, 说明栈已经溢出到保护页了(真到了这一步早就 SIGSEGV 了)
      * 2. at 和 stk 间距离过小(小于 256), 有栈溢出的风险, 也阻止执行 */
     if (at <= stk || at - stk < 256 + n) {
         fprint(2, "task stack overflow: &t=%p tstk=%p n=%d\n", &t, t->stk, 256 + n);
@@ -456,6 +921,68 @@ void needstack(int n)
     }
 }
 
+/**
+ * @brief 取 t 的运行统计, 正在运行和正在等待运行的那一段也算进去, 调用者持有 alllk
+ */
+static void taskstats1(Task *t, Taskstats *s)
+{
+    uvlong now, d;
+    int i;
+
+    now = statclock();
+    s->nrun = t->nrun;
+    s->runtime = t->runtime;
+    s->waittime = t->waittime;
+    s->maxslice = t->maxslice;
+    if (!taskacct) {
+        return;
+    }
+    if (t->ready) {
+        s->waittime += now - t->readyat;
+        return;
+    }
+    for (i = 0; i < nproc; i++) {
+        if (procs[i]->running == t) {
+            d = now - t->runstart;
+            s->runtime += d;
+            if (d > s->maxslice) {
+                s->maxslice = d;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 取协程的运行统计
+ *
+ * 统计在每次协程切换的时候维护. 运行次数一直在记, 时间要先用 taskaccounting 打开,
+ * 打开之后每次切换读一次时钟. 用来找两次让出之间占着 CPU 不放的协程(maxslice),
+ * 和就绪之后等很久才轮到的协程(waittime)
+ *
+ * @param id 协程 id, 0 表示当前协程
+ * @param s
+ * @return int 成功返回 0, 没有这个协程返回 -1
+ */
+int taskstats(uint id, Taskstats *s)
+{
+    int i;
+
+    if (id == 0) {
+        id = taskrunning->id;
+    }
+    spinlock(&alllk);
+    for (i = 0; i < nalltask; i++) {
+        if (alltask[i]->id == id) {
+            taskstats1(alltask[i], s);
+            spinunlock(&alllk);
+            return 0;
+        }
+    }
+    spinunlock(&alllk);
+    return -1;
+}
+
 /**
  * @brief 往标准错误输出全部协程的信息
  *
@@ -469,11 +996,13 @@ static void taskinfo(int s)
     int i;
     Task *t;
     char *extra;
+    Taskstats st;
 
     fprint(2, "task list:\n");
-    fprint(2, "-------------------------------------------------------------------\n");
-    fprint(2, "%-6s\t%-15s\t%-25s\t%-15s\n", "TaskID", "TaskName", "State", "Extra");
-    fprint(2, "-------------------------------------------------------------------\n");
+    fprint(2, "----------------------------------------------------------------------------------------------------------\n");
+    fprint(2, "%-6s\t%-15s\t%-25s\t%-10s\t%8s %10s %10s %10s\n", "TaskID", "TaskName", "State", "Extra", "Runs",
+           "Run(ms)", "Wait(ms)", "Slice(us)");
+    fprint(2, "----------------------------------------------------------------------------------------------------------\n");
 
     for (i = 0; i < nalltask; i++) {
         t = alltask[i];
@@ -486,8 +1015,10 @@ static void taskinfo(int s)
             extra = "-";
         }
 
+        taskstats1(t, &st);
         sprintf(buf, "%d%c", t->id, t->system ? 's' : ' ');
-        fprint(2, "%-6s\t%-15s\t%-25s\t%-15s\n", buf, t->name, t->state, extra);
+        fprint(2, "%-6s\t%-15s\t%-25s\t%-10s\t%8llud %10llud %10llud %10llud\n", buf, t->name, t->state, extra,
+               st.nrun, st.runtime / 1000000, st.waittime / 1000000, st.maxslice / 1000);
     }
 }
 
@@ -536,6 +1067,7 @@ int main(int argc, char **argv)
 
     taskargc = argc;
     taskargv = argv;
+    procself = &proc0;
 
     if (mainstacksize == 0)
         mainstacksize = 256 * 1024;
@@ -593,6 +1125,50 @@ void deltask(Tasklist *l, Task *t)
     }
 }
 
+/**
+ * @brief 当前协程开始一次新的等待, 在挂到等待的地方之前调用
+ *
+ * 一次等待可能被几方同时唤醒: 通道的几个分支, 截止时间, 别的线程上的唤醒者.
+ * 唤醒者先用 taskclaim 认领, 认领成功的一方才把协程从等待的地方摘下来并 taskready,
+ * 认领失败的跳过它, 留给认领成功的一方(或者协程自己醒来之后)去摘.
+ * 等待的地方用的链表节点和待运行队列是同一个, 所以只有认领成功的一方能动它.
+ *
+ * 要在持有等待对象的锁的时候调用, 唤醒者在同一把锁下面看到这个协程的时候已经可以认领了
+ */
+void taskwaitbegin(void)
+{
+    Task *t;
+
+    t = taskrunning;
+    t->timedout = 0;
+    if (++t->waitseq == 0) {
+        t->waitseq = 1;
+    }
+    __atomic_store_n(&t->wake, t->waitseq, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 认领正在等待的协程 t, 见 taskwaitbegin
+ *
+ * @param t
+ * @return int 成功返回 1, 已经被别人认领了返回 0
+ */
+int taskclaim(Task *t)
+{
+    uint seq;
+
+    if ((seq = __atomic_load_n(&t->wake, __ATOMIC_RELAXED)) == 0) {
+        return 0;
+    }
+
+    /* 单线程没有人和我们抢, 省掉带 lock 前缀的 cmpxchg */
+    if (!taskmt) {
+        t->wake = 0;
+        return 1;
+    }
+    return __atomic_compare_exchange_n(&t->wake, &seq, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
 /**
  * @brief 返回当前正在运行的协程 id
  *
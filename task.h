@@ -9,6 +9,8 @@ extern "C" {
 
 #include <inttypes.h>
 #include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 /*
  * basic procs and threads
@@ -16,6 +18,7 @@ extern "C" {
 
 typedef struct Task Task;
 typedef struct Tasklist Tasklist;
+typedef struct Lock Lock;
 
 int anyready(void);
 int taskcreate(void (*f)(void *arg), void *arg, unsigned int stacksize);
@@ -32,6 +35,23 @@ char *taskgetstate(void);
 void tasksystem(void);
 unsigned int taskdelay(unsigned int);
 unsigned int taskid(void);
+void taskdirectswitch(int);
+void taskaccounting(int);
+int taskprocs(int);
+
+/*
+ * 协程的运行统计, 时间单位是 ns
+ */
+typedef struct Taskstats Taskstats;
+struct Taskstats {
+    uint64_t nrun;     /* 被调度运行的次数 */
+    uint64_t runtime;  /* 累计运行时间 */
+    uint64_t waittime; /* 累计就绪之后等待运行的时间 */
+    uint64_t maxslice; /* 最长的一次连续运行(两次让出之间) */
+};
+
+int taskstats(unsigned int, Taskstats *);
+uint64_t tasknow(void);
 
 struct Tasklist /* used internally */
 {
@@ -39,17 +59,24 @@ struct Tasklist /* used internally */
     Task *tail;
 };
 
+struct Lock /* used internally, M:N 模式下保护它所在的对象 */
+{
+    int held;
+};
+
 /*
  * queuing locks
  */
 typedef struct QLock QLock;
 
 struct QLock {
+    Lock lk;
     Task *owner;      /* 当前锁持有者 */
     Tasklist waiting; /* 等待持有锁的协程列表 */
 };
 
 void qlock(QLock *);
+int qlockt(QLock *, uint64_t);
 int canqlock(QLock *);
 void qunlock(QLock *);
 
@@ -58,6 +85,7 @@ void qunlock(QLock *);
  */
 typedef struct RWLock RWLock;
 struct RWLock {
+    Lock lk;
     int readers;       /* 持有锁的读者数量 */
     Task *writer;      /* 持有锁的写协程 */
     Tasklist rwaiting; /* 读等待协程 */
@@ -89,10 +117,12 @@ typedef struct Rendez Rendez;
  */
 struct Rendez {
     QLock *l;
+    Lock lk;
     Tasklist waiting;
 };
 
 void tasksleep(Rendez *);
+int tasksleept(Rendez *, uint64_t);
 int taskwakeup(Rendez *);
 int taskwakeupall(Rendez *);
 
@@ -117,15 +147,22 @@ struct Alt {
     unsigned int op;
     Task *task;
     Alt *xalt;
+    int closed;      /* 输出: 因为通道关闭而结束, 接收到的是全 0 */
+    unsigned int ai; /* 内部: 在通道等待队列里的下标, 已经摘下来的是 ~0 */
 };
 
+/* 通道上等待的收发者, 在 a[h, e) 里. 随机策略下 h 总是 0, 没有空位;
+ * FIFO 策略下撤掉的留下 nil, 保持排队顺序 */
 struct Altarray {
     Alt **a;
-    unsigned int n;
+    unsigned int n; /* 等待者个数 */
     unsigned int m;
+    unsigned int h;
+    unsigned int e;
 };
 
 struct Channel {
+    Lock lk;
     unsigned int bufsize;
     unsigned int elemsize;
     unsigned char *buf;
@@ -134,11 +171,16 @@ struct Channel {
     Altarray asend;
     Altarray arecv;
     char *name;
+    int fifo;   /* 等待的收发者按先来先配对, 默认随机 */
+    int closed; /* chanclose 之后 */
 };
 
 int chanalt(Alt *alts);
+int chanaltt(Alt *alts, uint64_t deadline);
 Channel *chancreate(int elemsize, int elemcnt);
 void chanfree(Channel *c);
+void chanfifo(Channel *c, int on);
+void chanclose(Channel *c);
 int chaninit(Channel *c, int elemsize, int elemcnt);
 int channbrecv(Channel *c, void *v);
 void *channbrecvp(Channel *c);
@@ -147,37 +189,141 @@ int channbsend(Channel *c, void *v);
 int channbsendp(Channel *c, void *v);
 int channbsendul(Channel *c, unsigned long v);
 int chanrecv(Channel *c, void *v);
+int chanrecvt(Channel *c, void *v, uint64_t deadline);
 void *chanrecvp(Channel *c);
 unsigned long chanrecvul(Channel *c);
 int chansend(Channel *c, void *v);
+int chansendt(Channel *c, void *v, uint64_t deadline);
 int chansendp(Channel *c, void *v);
 int chansendul(Channel *c, unsigned long v);
+int chansendn(Channel *c, void *v, int n);
+int chanrecvn(Channel *c, void *v, int n);
+
+/*
+ * 跨线程的通道, 任何线程(协程或者用户自己创建的线程)都可以收发
+ */
+typedef struct Xchan Xchan;
+
+Xchan *xchancreate(int elemsize, int bufsize);
+void xchanfree(Xchan *c);
+int xchansend(Xchan *c, void *v);
+int xchannbsend(Xchan *c, void *v);
+int xchanrecv(Xchan *c, void *v);
+int xchannbrecv(Xchan *c, void *v);
 
 /*
  * Threaded I/O.
  */
 int fdread(int, void *, int);
+int fdreadt(int, void *, int, uint64_t);
 int fdread1(int, void *, int); /* always uses fdwait */
 int fdwrite(int, void *, int);
+int fdwritet(int, void *, int, uint64_t);
+int fdreadv(int, struct iovec *, int);
+int fdwritev(int, struct iovec *, int);
+int fdsplice(int, int, int);
 void fdwait(int, int);
+int fdwaitt(int, int, uint64_t);
 int fdnoblock(int);
+int fdclose(int);
 
 void fdtask(void *);
 
+/*
+ * 阻塞调用交给工作线程, 用于普通文件等没有非阻塞版本的调用
+ */
+long taskblocking(long (*fn)(void *), void *arg);
+int taskblockingprocs(int);
+int fileopen(char *, int);
+int fileread(int, void *, int);
+int filewrite(int, void *, int);
+int filesync(int);
+
+/*
+ * Buffered I/O, 类似 Plan 9 的 bio
+ */
+typedef struct Biobuf Biobuf;
+
+enum {
+    BIOSIZE = 8192,
+};
+
+struct Biobuf {
+    int fd;
+    unsigned char *rbuf; /* 读缓冲, 未读的数据是 rbuf[rp, re) */
+    int rp;
+    int re;
+    unsigned char *wbuf; /* 写缓冲, 待写的数据是 wbuf[0, wn) */
+    int wn;
+};
+
+void bioinit(Biobuf *, int);
+int bioterm(Biobuf *);
+int bioread(Biobuf *, void *, int);
+int bioreadn(Biobuf *, void *, int);
+char *bioreadline(Biobuf *, int, int *);
+void *biopeek(Biobuf *, int);
+int biowrite(Biobuf *, void *, int);
+int bioprint(Biobuf *, char *, ...);
+int bioflush(Biobuf *);
+
 /*
  * Network dialing - sets non-blocking automatically
  */
 enum {
     UDP = 0,
     TCP = 1,
+    NETADDRLEN = 46, /* netaccept 填 IPv6 地址需要的缓冲区大小, 同 INET6_ADDRSTRLEN */
+    NETREUSEPORT = 1, /* netannouncex 的 flags */
 };
 
 int netannounce(int, char *, int);
+int netannouncex(int, char *, int, int, int);
 int netaccept(int, char *, int *);
+int netacceptt(int, char *, int *, uint64_t);
+int netacceptn(int, int *, int, uint64_t);
 int netdial(int, char *, int);
-int netlookup(char *, uint32_t *); /* blocks entire program! */
+int netdialt(int, char *, int, uint64_t);
+int netlookup(char *, uint32_t *);
+int netnameserver(char *, int);
 int netdial(int, char *, int);
 
+/*
+ * Batched datagram I/O
+ */
+typedef struct Udpmsg Udpmsg;
+typedef struct Udpbatch Udpbatch;
+
+struct Udpmsg {
+    unsigned char *buf; /* 数据, 在 Udpbatch 的内存里, 容量是 size */
+    int len;
+    struct sockaddr_storage addr; /* 对端地址 */
+    socklen_t addrlen;            /* 发送时为 0 表示用 connect 过的地址 */
+};
+
+struct Udpbatch {
+    int n;       /* 消息个数 */
+    int size;    /* 每个消息的容量 */
+    Udpmsg *msg; /* msg[0, n) */
+    void *hdr;   /* struct mmsghdr 数组, 内部使用 */
+};
+
+Udpbatch *udpalloc(int, int);
+void udpfree(Udpbatch *);
+int udprecv(int, Udpbatch *);
+int udpsend(int, Udpbatch *, int);
+
+/*
+ * Outbound connection pool
+ */
+typedef struct Netpool Netpool;
+
+Netpool *netpoolcreate(char *, int, int, int);
+int netpoolget(Netpool *);
+int netpoolgett(Netpool *, uint64_t);
+void netpoolput(Netpool *, int);
+void netpoolfree(Netpool *);
+
 #ifdef __cplusplus
 }
 #endif
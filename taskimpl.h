@@ -1,6 +1,6 @@
 /* Copyright (c) 2005-2006 Russ Cox, MIT; see COPYRIGHT */
 
-/* 文件做了精简, 只研究 i386 平台上的实现 */
+/* 文件做了精简, 只保留 i386 和 x86-64 平台上的实现 */
 
 /* 研究 libtask 自带的上下文切换实现, 不使用 OS 提供的相关功能 */
 #define USE_UCONTEXT 0
@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -48,9 +49,15 @@ char *vsnprint(char *, uint, char *, va_list);
 char *vseprint(char *, char *, char *, va_list);
 char *strecpy(char *, char *, char *);
 
+#if defined(__x86_64__)
+#include "amd64-ucontext.h"
+#else
 #include "386-ucontext.h"
+#endif
 
 typedef struct Context Context;
+typedef struct Timer Timer;
+typedef struct Proc Proc;
 
 enum { STACK = 8192 };
 
@@ -58,6 +65,21 @@ struct Context {
     xucontext_t uc;
 };
 
+/**
+ * @brief 时间轮上的定时器(timer.c)
+ */
+struct Timer {
+    uvlong when; /* 到期时间(ns) */
+    uvlong tick; /* 到期时间(ms), 向上取整 */
+    Timer *next;
+    Timer *prev;
+    Task *task; /* 到期时要唤醒的协程 */
+    int level;  /* 所在的层和槽, 由 timer.c 维护 */
+    int slot;
+    int armed; /* 是否挂在时间轮上 */
+    uint seq;  /* 等待超时的时候是那一次等待的 waitseq, taskdelay 是 0 */
+};
+
 struct Task {
     char name[256];  /* 协程名称 */
     char state[256]; /* 协程状态描述 */
@@ -66,7 +88,17 @@ struct Task {
     Task *allnext;
     Task *allprev;
     Context context;
-    uvlong alarmtime; /* 协程的超时时间(fd.c) */
+    Timer timer; /* 协程的定时器(fd.c) */
+    int splicefd[2]; /* fdsplice 用的管道, 第一次用的时候创建, -1 表示没有(fd.c) */
+
+    /* 等待和唤醒(taskwaitbegin/taskclaim/taskwait): 超时的时候 fdtask 调用 waitcancel
+     * 把协程从它等待的地方摘下来 */
+    void (*waitcancel)(Task *);
+    void *waitarg;
+    int timedout; /* 上一次带超时的等待是因为超时结束的 */
+    uint waitseq; /* 第几次等待, 只有协程自己修改 */
+    uint wake;    /* 正在等待的那一次的 waitseq, 被唤醒者认领之后清零 */
+    int oncpu;    /* 正在运行, 或者已经切走但上下文还没保存完 */
 
     uint id;      /* 协程 id */
     uchar *stk;   /* 栈底 */
@@ -76,16 +108,106 @@ struct Task {
     int system;
     int ready;
 
+    /* 运行统计(task.c), 在切换的时候维护, 时间都是 CLOCK_MONOTONIC 的 ns */
+    uvlong nrun;     /* 被调度运行的次数 */
+    uvlong runtime;  /* 累计运行时间, 不含正在运行的这一段 */
+    uvlong waittime; /* 累计就绪之后等待运行的时间 */
+    uvlong maxslice; /* 最长的一次连续运行 */
+    uvlong runstart; /* 这一次开始运行的时间 */
+    uvlong readyat;  /* 最近一次就绪的时间 */
+
     void (*startfn)(void *); /* 用户指定的协程入口函数 */
     void *startarg;          /* 用户指定的协程入口参数 */
     void *udata;
 };
 
+/**
+ * @brief 调度线程, M:N 模式下每个线程一个(task.c)
+ */
+struct Proc {
+    int id;
+    pthread_t thread;
+    Task *running;        /* 这个线程上正在运行的协程 */
+    Task *prev;           /* 刚刚切走的协程, 由切进来的一方清掉它的 oncpu */
+    Task *handoff;        /* 直接切换取到的协程还没切走, 交给调度器去等 */
+    Context schedcontext; /* 这个线程的调度器上下文 */
+    Lock lk;              /* 保护 runqueue 和 nrunqueue */
+    Tasklist runqueue;    /* 这个线程的待运行队列 */
+    int nrunqueue;
+    int nswitch;          /* 这个线程上的协程切换次数 */
+    uvlong rng;           /* 这个线程的伪随机数状态(channel.c) */
+    uvlong switchat;      /* 这个线程最近一次切换协程的时间(task.c 运行统计) */
+};
+
 void taskready(Task *);
 void taskswitch(void);
 
 void addtask(Tasklist *, Task *);
 void deltask(Tasklist *, Task *);
 
-extern Task *taskrunning;
+Proc *proc(void);
+#define taskrunning (proc()->running)
+
 extern int taskcount;
+extern int tasknready;
+
+/* 自旋锁和计数, 见 task.c 里面 M:N 模式的说明.
+ * 单线程的时候锁是空操作, 计数是普通的加法, 都不调用函数 */
+extern int taskmt;
+void _spinlock(Lock *);
+void _spinunlock(Lock *);
+int _taskxadd(int *, int);
+#define spinlock(l) do { if (taskmt) _spinlock(l); } while (0)
+#define spinunlock(l) do { if (taskmt) _spinunlock(l); } while (0)
+#define taskxadd(p, v) (taskmt ? _taskxadd((p), (v)) : (*(p) += (v)))
+
+void taskwaitbegin(void);
+int taskclaim(Task *);
+int taskwait(uvlong, void (*)(Task *), void *);
+
+int dnslookup(char *, int, void *);
+
+extern int fdpolling;
+int fdmtinit(void);
+
+/* 别的线程唤醒挂起的协程(blocking.c) */
+typedef struct Taskwake Taskwake;
+struct Taskwake {
+    Task *task;
+    Taskwake *next;
+};
+void taskwakeinit(void);
+void taskwakeasync(Taskwake *);
+
+void startfdtask(void);
+void fdwakeup(int);
+void fdreset(int);
+int _fdwait(int, int, uvlong);
+uvlong nsec(void);
+uvlong taskclock(void);
+
+void *stackalloc(uint);
+void stackfree(void *, uint);
+
+void timerset(Timer *, uvlong);
+void timerdel(Timer *);
+Timer *timerexpired(uvlong);
+uvlong timernext(void);
+
+#ifdef USE_IOURING
+#include <sys/socket.h>
+
+/* io_uring 引擎(uring.c) */
+extern int uringon;
+int uringsetup(void);
+void uringflush(void);
+int uringreap(void);
+void uringclear(void);
+int uringread(int, void *, int);
+int uringwrite(int, void *, int);
+int uringreadv(int, struct iovec *, int);
+int uringwritev(int, struct iovec *, int);
+int uringaccept(int, struct sockaddr *, socklen_t *);
+int uringconnect(int, struct sockaddr *, socklen_t);
+void uringcancel(int);
+#endif
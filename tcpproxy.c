@@ -13,18 +13,41 @@ int port;
 void proxytask(void *);
 void rwtask(void *);
 
-int *mkfd2(int fd1, int fd2)
+/* 一条代理连接, 两个方向的 rwtask 共用. 最后结束的那个才关闭两个 fd:
+ * 先关掉的 fd 号可能马上被新连接复用, 另一个方向却还在往里 splice 或者 shutdown */
+typedef struct Conn Conn;
+struct Conn {
+    int ref;
+    int fd[2];
+};
+
+/* 一个方向: 从 fd[dir] 读, 写到 fd[1-dir] */
+typedef struct Rw Rw;
+struct Rw {
+    Conn *c;
+    int dir;
+};
+
+void *emalloc(unsigned long n)
 {
-    int *a;
+    void *p;
 
-    a = malloc(2 * sizeof a[0]);
-    if (a == 0) {
+    p = calloc(n, 1);
+    if (p == 0) {
         fprintf(stderr, "out of memory\n");
         abort();
     }
-    a[0] = fd1;
-    a[1] = fd2;
-    return a;
+    return p;
+}
+
+Rw *mkrw(Conn *c, int dir)
+{
+    Rw *rw;
+
+    rw = emalloc(sizeof *rw);
+    rw->c = c;
+    rw->dir = dir;
+    return rw;
 }
 
 void sleeptest(void *v)
@@ -61,38 +84,52 @@ void taskmain(int argc, char **argv)
     fdnoblock(fd);
     while ((cfd = netaccept(fd, remote, &rport)) >= 0) {
         fprintf(stderr, "connection from %s:%d\n", remote, rport);
-        taskcreate(proxytask, (void *)cfd, STACK);
+        taskcreate(proxytask, (void *)(long)cfd, STACK);
     }
 }
 
 void proxytask(void *v)
 {
     int fd, remotefd;
+    Conn *c;
 
-    fd = (int)v;
+    fd = (int)(long)v;
     if ((remotefd = netdial(TCP, server, port)) < 0) {
-        close(fd);
+        fdclose(fd);
         return;
     }
 
     fprintf(stderr, "connected to %s:%d\n", server, port);
 
-    taskcreate(rwtask, mkfd2(fd, remotefd), STACK);
-    taskcreate(rwtask, mkfd2(remotefd, fd), STACK);
+    c = emalloc(sizeof *c);
+    c->ref = 2;
+    c->fd[0] = fd;
+    c->fd[1] = remotefd;
+    taskcreate(rwtask, mkrw(c, 0), STACK);
+    taskcreate(rwtask, mkrw(c, 1), STACK);
 }
 
 void rwtask(void *v)
 {
-    int *a, rfd, wfd, n;
-    char buf[2048];
-
-    a = v;
-    rfd = a[0];
-    wfd = a[1];
-    free(a);
-
-    while ((n = fdread(rfd, buf, sizeof buf)) > 0)
-        fdwrite(wfd, buf, n);
+    Rw *rw;
+    Conn *c;
+    int rfd, wfd;
+
+    rw = v;
+    c = rw->c;
+    rfd = c->fd[rw->dir];
+    wfd = c->fd[1 - rw->dir];
+    free(rw);
+
+    /* splice 直接在内核里搬运, 数据不经过用户态 */
+    while (fdsplice(rfd, wfd, 65536) > 0)
+        ;
     shutdown(wfd, SHUT_WR);
-    close(rfd);
+
+    /* 协程之间不会抢占, 减计数不用加锁 */
+    if (--c->ref == 0) {
+        fdclose(c->fd[0]);
+        fdclose(c->fd[1]);
+        free(c);
+    }
 }
@@ -0,0 +1,249 @@
+/*
+ * 测试 Biobuf.
+ *
+ * 检查:
+ *  - bioreadline 按行切分, 读缓冲读满(re == BIOSIZE)之后把没读完的一行挪到开头接着读
+ *  - 比 BIOSIZE 长的行返回 ENOBUFS, 数据还在, 可以用 bioread 读走
+ *  - biopeek 不消耗数据, 要挪动缓冲区的时候也对
+ *  - bioread 缓冲为空并且 n 不小于 BIOSIZE 的时候直接读, 不占读缓冲
+ *  - bioreadn 读满, EOF 之前读到多少返回多少
+ *  - biowrite 攒在缓冲里, bioflush 才写出去, 写缓冲还给池子; 大块写直接写
+ *  - bioprint 比原来 256 字节的限制长的输出完整写出, 放不下的返回 ENOBUFS
+ *
+ * 全部在一对 socketpair 上进行.
+ *
+ * 用法: testbio, 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+static int nfail;
+static char big[3 * BIOSIZE];
+static char buf[3 * BIOSIZE];
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+/* 一对不阻塞的 socketpair, fd[0] 用 Biobuf, fd[1] 是对端 */
+static void pair(int fd[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+        perror("socketpair");
+        taskexitall(1);
+    }
+    fdnoblock(fd[0]);
+    fdnoblock(fd[1]);
+}
+
+static void put(int fd, char *s, int n)
+{
+    check(fdwrite(fd, s, n) == n);
+}
+
+static int isline(char *p, int n, char *want)
+{
+    return p != NULL && n == (int)strlen(want) && memcmp(p, want, n) == 0;
+}
+
+static void testreadline(void)
+{
+    int fd[2], n;
+    char *p;
+    Biobuf b;
+
+    pair(fd);
+    bioinit(&b, fd[0]);
+
+    put(fd[1], "a\nbb\nccc\n", 9);
+    p = bioreadline(&b, '\n', &n);
+    check(isline(p, n, "a\n"));
+    p = bioreadline(&b, '\n', &n);
+    check(isline(p, n, "bb\n"));
+    p = bioreadline(&b, '\n', &n);
+    check(isline(p, n, "ccc\n"));
+
+    /* 第一行加上 "abc" 正好 BIOSIZE 字节, 一次读满缓冲; "abc" 没有结尾,
+     * 再读的时候要先挪到开头 */
+    memset(big, 'x', BIOSIZE - 4);
+    big[BIOSIZE - 4] = '\n';
+    memcpy(big + BIOSIZE - 3, "abcdef\n", 7);
+    put(fd[1], big, BIOSIZE + 4);
+    p = bioreadline(&b, '\n', &n);
+    check(p != NULL && n == BIOSIZE - 3 && p[n - 1] == '\n' && p[0] == 'x');
+    p = bioreadline(&b, '\n', &n);
+    check(isline(p, n, "abcdef\n"));
+
+    /* 比 BIOSIZE 长的行 */
+    memset(big, 'y', BIOSIZE + 10);
+    big[BIOSIZE + 10] = '\n';
+    put(fd[1], big, BIOSIZE + 11);
+    put(fd[1], "z\n", 2);
+    p = bioreadline(&b, '\n', &n);
+    check(p == NULL && errno == ENOBUFS && n == BIOSIZE);
+    check(bioreadn(&b, buf, BIOSIZE + 11) == BIOSIZE + 11 && buf[0] == 'y' && buf[BIOSIZE + 10] == '\n');
+    p = bioreadline(&b, '\n', &n);
+    check(isline(p, n, "z\n"));
+
+    /* EOF 之前不完整的一行用 bioread 读 */
+    put(fd[1], "tail", 4);
+    close(fd[1]);
+    p = bioreadline(&b, '\n', &n);
+    check(p == NULL && n == 4);
+    check(bioread(&b, buf, sizeof buf) == 4 && memcmp(buf, "tail", 4) == 0);
+    check(bioread(&b, buf, sizeof buf) == 0);
+
+    bioterm(&b);
+    check(b.rbuf == NULL);
+    close(fd[0]);
+}
+
+static void testpeek(void)
+{
+    int fd[2], n;
+    char *p;
+    Biobuf b;
+
+    pair(fd);
+    bioinit(&b, fd[0]);
+
+    put(fd[1], "hello world", 11);
+    p = biopeek(&b, 5);
+    check(p != NULL && memcmp(p, "hello", 5) == 0);
+    check(bioread(&b, buf, 6) == 6 && memcmp(buf, "hello ", 6) == 0);
+
+    /* 读位置在缓冲区末尾附近, 要 peek 的放不下, 先挪到开头 */
+    check(bioread(&b, buf, 5) == 5);
+    memset(big, 'q', BIOSIZE - 5);
+    put(fd[1], big, BIOSIZE - 5);
+    check(bioreadn(&b, buf, BIOSIZE - 10) == BIOSIZE - 10);
+    put(fd[1], "0123456789", 10);
+    p = biopeek(&b, 15);
+    check(p != NULL && memcmp(p, "qqqqq0123456789", 15) == 0);
+    p = bioreadline(&b, '9', &n);
+    check(isline(p, n, "qqqqq0123456789"));
+
+    check(biopeek(&b, BIOSIZE + 1) == NULL && errno == ENOBUFS);
+
+    close(fd[1]);
+    check(biopeek(&b, 1) == NULL);
+    bioterm(&b);
+    close(fd[0]);
+}
+
+static void testbypass(void)
+{
+    int fd[2], i, n, tot;
+    Biobuf b;
+
+    pair(fd);
+    bioinit(&b, fd[0]);
+
+    /* 缓冲是空的, 大块读直接读到 buf 里, 不取读缓冲 */
+    for (i = 0; i < 2 * BIOSIZE; i++)
+        big[i] = i % 251;
+    put(fd[1], big, 2 * BIOSIZE);
+    for (tot = 0; tot < 2 * BIOSIZE; tot += n)
+        if ((n = bioread(&b, buf + tot, sizeof buf - tot)) <= 0)
+            break;
+    check(tot == 2 * BIOSIZE && memcmp(buf, big, tot) == 0);
+    check(b.rbuf == NULL);
+
+    /* bioreadn 在 EOF 之前读到多少返回多少 */
+    put(fd[1], "abc", 3);
+    close(fd[1]);
+    check(bioreadn(&b, buf, 10) == 3 && memcmp(buf, "abc", 3) == 0);
+    check(bioreadn(&b, buf, 10) == 0);
+    bioterm(&b);
+    close(fd[0]);
+}
+
+static void testwrite(void)
+{
+    int fd[2], n;
+    unsigned char *w;
+    Biobuf b;
+
+    pair(fd);
+    bioinit(&b, fd[1]);
+
+    /* 小的写攒在缓冲里, 对端读不到 */
+    check(biowrite(&b, "hello ", 6) == 6);
+    check(bioprint(&b, "%s %d\n", "world", 42) == 9);
+    check(read(fd[0], buf, sizeof buf) == -1 && errno == EAGAIN);
+    w = b.wbuf;
+    check(w != NULL && b.wn == 15);
+
+    /* bioflush 写出去并把写缓冲还给池子, 下一次写从池子里取回同一块 */
+    check(bioflush(&b) == 0);
+    check(b.wbuf == NULL && b.wn == 0);
+    check(fdread(fd[0], buf, sizeof buf) == 15 && memcmp(buf, "hello world 42\n", 15) == 0);
+    check(biowrite(&b, "x", 1) == 1 && b.wbuf == w);
+    check(bioflush(&b) == 0);
+    check(fdread(fd[0], buf, sizeof buf) == 1);
+
+    /* 缓冲是空的, 大块写直接写 */
+    memset(big, 'b', 2 * BIOSIZE);
+    check(biowrite(&b, big, 2 * BIOSIZE) == 2 * BIOSIZE);
+    check(b.wbuf == NULL);
+    for (n = 0; n < 2 * BIOSIZE;)
+        n += fdread(fd[0], buf + n, sizeof buf - n);
+    check(n == 2 * BIOSIZE && memcmp(buf, big, n) == 0);
+
+    /* 写满缓冲的时候自动写出去 */
+    check(biowrite(&b, "12", 2) == 2);
+    check(biowrite(&b, big, BIOSIZE) == BIOSIZE);
+    check(b.wn == 2);
+    for (n = 0; n < BIOSIZE;)
+        n += fdread(fd[0], buf + n, sizeof buf - n);
+    check(n == BIOSIZE && memcmp(buf, "12", 2) == 0);
+    check(bioflush(&b) == 0);
+    check(fdread(fd[0], buf, sizeof buf) == 2);
+
+    /* bioprint 超过 256 字节的输出; 放不下剩下的地方先写出去 */
+    memset(big, 'p', 1000);
+    big[1000] = 0;
+    check(biowrite(&b, big, BIOSIZE - 100) == BIOSIZE - 100);
+    check(bioprint(&b, "<%s>", big) == 1002);
+    check(b.wn == 1002);
+    check(bioflush(&b) == 0);
+    for (n = 0; n < BIOSIZE - 100 + 1002;)
+        n += fdread(fd[0], buf + n, sizeof buf - n);
+    check(n == BIOSIZE - 100 + 1002 && buf[BIOSIZE - 100] == '<' && buf[n - 1] == '>');
+
+    /* 整个缓冲都放不下的不写 */
+    memset(big, 'p', BIOSIZE);
+    big[BIOSIZE] = 0;
+    check(bioprint(&b, "%s", big) == -1 && errno == ENOBUFS);
+    check(b.wn == 0);
+    big[BIOSIZE - 2] = 0;
+    check(bioprint(&b, "%s", big) == BIOSIZE - 2);
+    check(bioterm(&b) == 0);
+    for (n = 0; n < BIOSIZE - 2;)
+        n += fdread(fd[0], buf + n, sizeof buf - n);
+    check(n == BIOSIZE - 2);
+
+    close(fd[0]);
+    close(fd[1]);
+}
+
+void taskmain(int argc, char **argv)
+{
+    testreadline();
+    testpeek();
+    testbypass();
+    testwrite();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
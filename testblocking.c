@@ -0,0 +1,124 @@
+/*
+ * 测试 taskblocking 和 fileread/filewrite.
+ *
+ * 检查:
+ *  - fileopen/filewrite/filesync/fileread 读写一个临时文件, 出错的时候 errno 带回来
+ *  - 工作线程里慢的调用不耽误别的协程
+ *  - 多个调用在工作线程里并行, 最多 taskblockingprocs 个
+ *  - M:N 模式下很多协程同时 taskblocking
+ *
+ * 用法: testblocking, 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768, NMT = 200, NCALL = 10 };
+
+static int nfail;
+static int ticks;
+static Channel *done;
+static long ncalls;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+static long sleep100(void *v)
+{
+    usleep(100000);
+    return (long)v;
+}
+
+static long count(void *v)
+{
+    __sync_fetch_and_add(&ncalls, 1);
+    return 1;
+}
+
+void ticktask(void *v)
+{
+    for (;;) {
+        taskdelay(10);
+        ticks++;
+    }
+}
+
+void sleeper(void *v)
+{
+    check(taskblocking(sleep100, v) == (long)v);
+    chansendul(done, 0);
+}
+
+void counter(void *v)
+{
+    int i;
+
+    for (i = 0; i < NCALL; i++)
+        check(taskblocking(count, 0) == 1);
+    chansendul(done, 0);
+}
+
+void taskmain(int argc, char **argv)
+{
+    char path[] = "/tmp/testblockingXXXXXX";
+    char buf[64];
+    int fd, i, t0;
+    uint64_t start, ms;
+
+    done = chancreate(sizeof(unsigned long), 0);
+    taskcreate(ticktask, 0, STACK);
+
+    /* 文件读写 */
+    if ((fd = mkstemp(path)) < 0) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        taskexitall(1);
+    }
+    close(fd);
+    check((fd = fileopen(path, O_RDWR | O_TRUNC)) >= 0);
+    check(filewrite(fd, "hello, world", 12) == 12);
+    check(filesync(fd) == 0);
+    check(lseek(fd, 0, SEEK_SET) == 0);
+    memset(buf, 0, sizeof buf);
+    check(fileread(fd, buf, sizeof buf) == 12 && strcmp(buf, "hello, world") == 0);
+    check(fileread(fd, buf, sizeof buf) == 0);
+    close(fd);
+    unlink(path);
+    check(fileopen(path, O_RDONLY) == -1 && errno == ENOENT);
+    check(fileread(-1, buf, 1) == -1 && errno == EBADF);
+
+    /* 工作线程睡 100ms 的时候 ticktask 照常运行 */
+    t0 = ticks;
+    check(taskblocking(sleep100, (void *)42) == 42);
+    check(ticks - t0 >= 5);
+
+    /* 8 个调用 4 个线程, 两轮做完 */
+    taskblockingprocs(4);
+    start = tasknow();
+    for (i = 0; i < 8; i++)
+        taskcreate(sleeper, (void *)(long)i, STACK);
+    for (i = 0; i < 8; i++)
+        chanrecvul(done);
+    ms = (tasknow() - start) / 1000000;
+    check(ms >= 190 && ms < 390);
+
+    /* M:N 模式 */
+    taskprocs(4);
+    for (i = 0; i < NMT; i++)
+        taskcreate(counter, 0, STACK);
+    for (i = 0; i < NMT; i++)
+        chanrecvul(done);
+    check(ncalls == NMT * NCALL);
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
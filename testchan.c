@@ -0,0 +1,548 @@
+/*
+ * 测试通道.
+ *
+ * 检查:
+ *  - 无缓冲和有缓冲通道的收发, 非阻塞收发
+ *  - FIFO 策略下等待的发送者, 接收者按先来后到配对
+ *  - chanalt 在多个能执行的操作里随机选, 每个都能选到
+ *  - chansendn/chanrecvn: 环形缓冲绕回, 直接交给等着的接收者, 收的时候放走等着的发送者
+ *  - Xchan: 多个线程发给多个协程, 协程发给线程, 缓冲满的时候两边都能等
+ *  - chanclose: 唤醒所有等着的收发者, 缓冲区里的还能取完, 之后的操作失败
+ *  - chanaltt: 默认分支, 超时, 在很多通道上选; 很多等待者中间反复登记撤掉之后
+ *    两种策略的队列都还是对的, FIFO 的顺序不变
+ *
+ * 用法: testchan, 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <task.h>
+
+enum { STACK = 32768, NWAIT = 8, NTHREAD = 4, NXRECV = 3, NXMSG = 20000, NSEL = 16, NPARK = 1000 };
+
+static int nfail;
+static Channel *c;
+static Channel *done;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+void sender(void *v)
+{
+    chansendul(c, (unsigned long)v);
+}
+
+void receiver(void *v)
+{
+    chansendul(done, (unsigned long)v * 100 + chanrecvul(c));
+}
+
+/* n 个协程按顺序排到 c 上等待, 返回时都已经在等了 */
+static void queue(void (*fn)(void *), int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        taskcreate(fn, (void *)(long)i, STACK);
+        taskyield();
+    }
+}
+
+static void testbasic(void)
+{
+    unsigned long v;
+    int i;
+
+    c = chancreate(sizeof(unsigned long), 0);
+    check(channbrecv(c, &v) == -1);
+    check(channbsendul(c, 1) == -1);
+    queue(sender, 1);
+    check(channbrecv(c, &v) == 1 && v == 0);
+    chanfree(c);
+
+    c = chancreate(sizeof(unsigned long), 4);
+    for (i = 0; i < 4; i++)
+        check(channbsendul(c, i) == 1);
+    check(channbsendul(c, 4) == -1);
+    for (i = 0; i < 4; i++)
+        check(chanrecvul(c) == i);
+    check(channbrecv(c, &v) == -1);
+    chanfree(c);
+}
+
+static void testfifo(int bufsize)
+{
+    int i, ok;
+    unsigned long v;
+
+    /* 缓冲满了之后排队的发送者 */
+    c = chancreate(sizeof(unsigned long), bufsize);
+    chanfifo(c, 1);
+    for (i = 0; i < bufsize; i++)
+        chansendul(c, 1000 + i);
+    queue(sender, NWAIT);
+    for (i = 0; i < bufsize; i++)
+        check(chanrecvul(c) == 1000 + i);
+    ok = 1;
+    for (i = 0; i < NWAIT; i++)
+        if (chanrecvul(c) != i)
+            ok = 0;
+    check(ok);
+
+    /* 排队的接收者 */
+    queue(receiver, NWAIT);
+    for (i = 0; i < NWAIT; i++)
+        chansendul(c, i);
+    ok = 1;
+    for (i = 0; i < NWAIT; i++) {
+        v = chanrecvul(done);
+        if (v / 100 != v % 100)
+            ok = 0;
+    }
+    check(ok);
+    chanfree(c);
+}
+
+void nsender(void *v)
+{
+    unsigned long buf[4];
+    int i, j;
+
+    for (i = 0; i < 4; i++)
+        buf[i] = (unsigned long)v + i;
+    for (j = 0; j < 4; j += chansendn(c, buf + j, 4 - j))
+        ;
+}
+
+static void testbatch(void)
+{
+    unsigned long buf[16], in[10];
+    int i, n, ok;
+
+    /* 缓冲区 5 个, 反复收发让 off 绕回 */
+    c = chancreate(sizeof(unsigned long), 5);
+    ok = 1;
+    for (i = 0; i < 7; i++) {
+        buf[0] = 3 * i;
+        buf[1] = 3 * i + 1;
+        buf[2] = 3 * i + 2;
+        if (chansendn(c, buf, 3) != 3 || chanrecvn(c, in, 10) != 3)
+            ok = 0;
+        if (in[0] != 3 * i || in[1] != 3 * i + 1 || in[2] != 3 * i + 2)
+            ok = 0;
+    }
+    check(ok);
+
+    /* 放不下的只发一部分 */
+    for (i = 0; i < 8; i++)
+        buf[i] = i;
+    check(chansendn(c, buf, 8) == 5);
+    check(chanrecvn(c, in, 2) == 2 && in[0] == 0 && in[1] == 1);
+    check(chanrecvn(c, in, 10) == 3 && in[0] == 2 && in[2] == 4);
+
+    /* 缓冲满了, 两个发送者各带着第一个元素在等: 收完缓冲区再直接收它们的 */
+    check(chansendn(c, buf, 5) == 5);
+    chanfifo(c, 1);
+    taskcreate(nsender, (void *)100, STACK);
+    taskcreate(nsender, (void *)200, STACK);
+    taskyield();
+    n = chanrecvn(c, in, 7);
+    check(n == 7 && in[4] == 4 && in[5] == 100 && in[6] == 200);
+
+    /* 它们醒来之后把剩下的放进缓冲区, 放不下的 203 又在等 */
+    taskyield();
+    n = chanrecvn(c, in, 3);
+    check(n == 3 && in[0] == 101 && in[2] == 103);
+    n = chanrecvn(c, in, 10);
+    check(n == 3 && in[0] == 201 && in[1] == 202 && in[2] == 203);
+
+    /* 收的个数比缓冲区里的少, 腾出来的地方给等着的发送者 */
+    check(chansendn(c, buf, 5) == 5);
+    taskcreate(nsender, (void *)400, STACK);
+    taskyield();
+    check(chanrecvn(c, in, 2) == 2 && in[0] == 0 && in[1] == 1);
+    check(c->nbuf == 4);
+    taskyield();
+    check(c->nbuf == 5);
+    n = chanrecvn(c, in, 10);
+    check(n == 6 && in[2] == 4 && in[3] == 400 && in[5] == 402);
+    check(chanrecvn(c, in, 10) == 1 && in[0] == 403);
+    chanfree(c);
+
+    /* 无缓冲: 排队的接收者一次发完 */
+    c = chancreate(sizeof(unsigned long), 0);
+    queue(receiver, 3);
+    check(chansendn(c, buf, 8) == 3);
+    ok = 1;
+    for (i = 0; i < 3; i++) {
+        n = chanrecvul(done);
+        if (n % 100 >= 3)
+            ok = 0;
+    }
+    check(ok);
+
+    /* 没有发送者的时候阻塞到收到第一个 */
+    taskcreate(nsender, (void *)300, STACK);
+    for (i = 0; i < 4; i += n)
+        n = chanrecvn(c, in + i, 10 - i);
+    check(i == 4 && in[0] == 300 && in[1] == 301 && in[3] == 303);
+    chanfree(c);
+}
+
+void closer(void *v)
+{
+    chanclose(v);
+}
+
+/* 等着收或者发, 通道关闭之后把结果报告回去 */
+void closerecv(void *v)
+{
+    unsigned long x;
+    int r;
+
+    x = 99;
+    r = chanrecv(c, &x);
+    chansendul(done, r == -1 && errno == EPIPE && x == 0);
+}
+
+void closesend(void *v)
+{
+    chansendul(done, chansendul(c, 1) == -1 && errno == EPIPE);
+}
+
+void closerecvt(void *v)
+{
+    unsigned long x;
+
+    chansendul(done, chanrecvt(c, &x, tasknow() + 10000000000ULL) == -1 && errno == EPIPE);
+}
+
+static void testclose(void)
+{
+    unsigned long x, buf[8];
+    int i, ok;
+    Channel *c2;
+    Alt a[3];
+
+    /* 无缓冲: 等着收的, 等着发的(包括带截止时间的)都被叫醒并且失败 */
+    c = chancreate(sizeof(unsigned long), 0);
+    queue(closerecv, 3);
+    queue(closerecvt, 1);
+    chanclose(c);
+    ok = 1;
+    for (i = 0; i < 4; i++)
+        if (!chanrecvul(done))
+            ok = 0;
+    check(ok);
+    check(chansendul(c, 1) == -1 && errno == EPIPE);
+    check(channbrecv(c, &x) == -1 && errno == EPIPE);
+    check(chanrecvul(c) == 0);
+    chanclose(c);
+    chanfree(c);
+
+    c = chancreate(sizeof(unsigned long), 0);
+    queue(closesend, 3);
+    chanclose(c);
+    ok = 1;
+    for (i = 0; i < 3; i++)
+        if (!chanrecvul(done))
+            ok = 0;
+    check(ok);
+    chanfree(c);
+
+    /* 有缓冲: 关闭之后还能取完, 发送者被叫醒失败 */
+    c = chancreate(sizeof(unsigned long), 3);
+    for (i = 0; i < 3; i++)
+        chansendul(c, 10 + i);
+    queue(closesend, 2);
+    chanclose(c);
+    check(chanrecvul(done) && chanrecvul(done));
+    check(chansendul(c, 1) == -1);
+    check(chanrecvul(c) == 10);
+    check(chanrecvn(c, buf, 8) == 2 && buf[0] == 11 && buf[1] == 12);
+    check(chanrecvn(c, buf, 8) == -1 && errno == EPIPE);
+    check(chansendn(c, buf, 8) == -1 && errno == EPIPE);
+    chanfree(c);
+
+    /* chanalt: 关闭的通道马上可以执行, closed 置位 */
+    c = chancreate(sizeof(unsigned long), 0);
+    c2 = chancreate(sizeof(unsigned long), 0);
+    chanclose(c2);
+    a[0].c = c;
+    a[0].v = &x;
+    a[0].op = CHANRCV;
+    a[1].c = c2;
+    a[1].v = &x;
+    a[1].op = CHANRCV;
+    a[2].op = CHANEND;
+    check(chanalt(a) == 1 && a[1].closed && !a[0].closed);
+
+    /* 在多个通道上等着的, 其中一个关闭就醒来 */
+    chanfree(c2);
+    c2 = chancreate(sizeof(unsigned long), 0);
+    a[1].c = c2;
+    taskcreate(closer, c2, STACK);
+    check(chanalt(a) == 1 && a[1].closed);
+    check(c->arecv.n == 0 && c2->arecv.n == 0);
+    chanfree(c);
+    chanfree(c2);
+}
+
+static Xchan *xc;
+static Xchan *xback;
+
+/* 线程: 发 NXMSG 个数 */
+static void *xsender(void *v)
+{
+    long i, base;
+
+    base = (long)v * NXMSG;
+    for (i = 0; i < NXMSG; i++)
+        xchansend(xc, &i);
+    i = -1 - base;
+    xchansend(xc, &i);
+    return 0;
+}
+
+/* 协程: 收到一个 -1 就结束, 把自己收到的和发回去 */
+void xreceiver(void *v)
+{
+    long x, sum;
+
+    sum = 0;
+    for (;;) {
+        xchanrecv(xc, &x);
+        if (x < 0)
+            break;
+        sum += x;
+    }
+    chansendul(done, sum);
+}
+
+/* 线程: 从协程那里收 */
+static void *xthreadrecv(void *v)
+{
+    long x, sum;
+
+    sum = 0;
+    do {
+        xchanrecv(xback, &x);
+        sum += x;
+    } while (x != 0);
+    return (void *)sum;
+}
+
+static void testxchan(void)
+{
+    pthread_t tid[NTHREAD];
+    long i, x, sum, want;
+    void *r;
+
+    /* 缓冲区很小, 线程经常要等协程收走 */
+    xc = xchancreate(sizeof(long), 8);
+    for (i = 0; i < NXRECV; i++)
+        taskcreate(xreceiver, 0, STACK);
+    for (i = 0; i < NTHREAD; i++)
+        pthread_create(&tid[i], 0, xsender, (void *)i);
+
+    /* NTHREAD 个结束标记, NXRECV 个接收者各拿一个就走, 剩下的在这里收 */
+    sum = 0;
+    for (i = 0; i < NXRECV; i++)
+        sum += chanrecvul(done);
+    for (i = 0; i < NTHREAD - NXRECV; i++) {
+        do {
+            xchanrecv(xc, &x);
+            if (x >= 0)
+                sum += x;
+        } while (x >= 0);
+    }
+    for (i = 0; i < NTHREAD; i++)
+        pthread_join(tid[i], 0);
+    check(xchannbrecv(xc, &x) == -1);
+    want = (long)NTHREAD * NXMSG * (NXMSG - 1) / 2;
+    check(sum == want);
+
+    /* 协程发给线程, 缓冲区满了协程挂起 */
+    xback = xchancreate(sizeof(long), 2);
+    pthread_create(&tid[0], 0, xthreadrecv, 0);
+    for (i = NXMSG; i >= 0; i--)
+        xchansend(xback, &i);
+    pthread_join(tid[0], &r);
+    check((long)r == (long)NXMSG * (NXMSG + 1) / 2);
+
+    x = 7;
+    check(xchannbsend(xback, &x) == 1);
+    check(xchannbsend(xback, &x) == 1);
+    check(xchannbsend(xback, &x) == -1);
+    xchanfree(xback);
+    xchanfree(xc);
+}
+
+static void testalt(void)
+{
+    Channel *c1, *c2;
+    unsigned long v1, v2;
+    int i, n[2];
+    Alt a[3];
+
+    c1 = chancreate(sizeof(unsigned long), 1);
+    c2 = chancreate(sizeof(unsigned long), 1);
+    n[0] = n[1] = 0;
+    for (i = 0; i < 1000; i++) {
+        channbsendul(c1, 1);
+        channbsendul(c2, 2);
+        a[0].c = c1;
+        a[0].v = &v1;
+        a[0].op = CHANRCV;
+        a[1].c = c2;
+        a[1].v = &v2;
+        a[1].op = CHANRCV;
+        a[2].op = CHANEND;
+        n[chanalt(a)]++;
+    }
+    check(n[0] > 300 && n[1] > 300);
+    chanfree(c1);
+    chanfree(c2);
+}
+
+/* 奇数的一直等, 偶数的 10ms 之后超时走掉, 在 FIFO 队列的头上和中间留下空位 */
+void holerecv(void *v)
+{
+    unsigned long x;
+
+    if ((long)v % 2 == 0)
+        chanrecvt(c, &x, tasknow() + 10000000);
+    else
+        chansendul(done, (unsigned long)v * 100 + chanrecvul(c));
+}
+
+void selsend(void *v)
+{
+    chansendul(v, 42);
+}
+
+void parkrecv(void *v)
+{
+    chansendul(done, chanrecvul(c));
+}
+
+static void testselect(void)
+{
+    Channel *cs[NSEL], *d;
+    unsigned long x, sum;
+    uint64_t start;
+    int i, ok, fifo;
+    Alt a[NSEL + 1];
+
+    for (i = 0; i < NSEL; i++) {
+        cs[i] = chancreate(sizeof(unsigned long), 0);
+        a[i].c = cs[i];
+        a[i].v = &x;
+        a[i].op = CHANRCV;
+    }
+
+    /* 默认分支 */
+    a[NSEL].op = CHANNOBLK;
+    check(chanaltt(a, 0) == -1 && errno == EAGAIN);
+
+    /* 超时, 之后所有通道上都不留登记 */
+    a[NSEL].op = CHANEND;
+    start = tasknow();
+    check(chanaltt(a, start + 20000000) == -1 && errno == ETIMEDOUT);
+    check(tasknow() - start >= 20000000);
+    ok = 1;
+    for (i = 0; i < NSEL; i++)
+        if (cs[i]->arecv.n != 0)
+            ok = 0;
+    check(ok);
+
+    /* 在 NSEL 个通道上等, CHANNOP 的不参加 */
+    a[3].op = CHANNOP;
+    taskcreate(selsend, cs[3], STACK);
+    taskcreate(selsend, cs[7], STACK);
+    x = 0;
+    check(chanaltt(a, tasknow() + 1000000000) == 7 && x == 42);
+    check(cs[3]->asend.n == 1);
+    check(chanrecvul(cs[3]) == 42);
+    for (i = 0; i < NSEL; i++)
+        chanfree(cs[i]);
+
+    /* FIFO 队列里有空位的时候还是按先来后到 */
+    c = chancreate(sizeof(unsigned long), 0);
+    chanfifo(c, 1);
+    queue(holerecv, NWAIT);
+    taskdelay(30);
+    check(c->arecv.n == NWAIT / 2);
+    for (i = 0; i < NWAIT / 2; i++)
+        chansendul(c, i);
+    ok = 1;
+    for (i = 0; i < NWAIT / 2; i++)
+        if (chanrecvul(done) != (2 * i + 1) * 100 + i)
+            ok = 0;
+    check(ok);
+    chanfree(c);
+
+    /* 每次在 c 上登记之后后面又排上一个等待者, 然后撤掉: 随机策略下末尾的挪进空位,
+     * FIFO 下留下的空位夹在等待者中间, 放满的时候被挤掉. 下标都要跟着对 */
+    for (fifo = 0; fifo < 2; fifo++) {
+        c = chancreate(sizeof(unsigned long), 0);
+        d = chancreate(sizeof(unsigned long), 1);
+        chanfifo(c, fifo);
+        chanfree(done);
+        done = chancreate(sizeof(unsigned long), NPARK);
+        a[0].c = c;
+        a[0].v = &x;
+        a[0].op = CHANRCV;
+        a[1].c = d;
+        a[1].v = &x;
+        a[1].op = CHANRCV;
+        a[2].op = CHANEND;
+        for (i = 0; i < NPARK; i++) {
+            taskcreate(parkrecv, 0, STACK);
+            taskcreate(selsend, d, STACK);
+            if (chanalt(a) != 1)
+                break;
+        }
+        check(i == NPARK && c->arecv.n == NPARK);
+        for (i = 0; i < NPARK; i++)
+            chansendul(c, i);
+        ok = 1;
+        sum = 0;
+        for (i = 0; i < NPARK; i++) {
+            x = chanrecvul(done);
+            sum += x;
+            if (fifo && x != i)
+                ok = 0;
+        }
+        check(ok && sum == NPARK * (NPARK - 1) / 2);
+        chanfree(c);
+        chanfree(d);
+    }
+    chanfree(done);
+    done = chancreate(sizeof(unsigned long), NWAIT);
+}
+
+void taskmain(int argc, char **argv)
+{
+    done = chancreate(sizeof(unsigned long), NWAIT);
+
+    testbasic();
+    testfifo(0);
+    testfifo(3);
+    testbatch();
+    testxchan();
+    testclose();
+    testalt();
+    testselect();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
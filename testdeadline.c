@@ -0,0 +1,272 @@
+/*
+ * 测试带截止时间的等待.
+ *
+ * 对 fdwaitt, fdreadt, fdwritet, netacceptt, qlockt, tasksleept, chanrecvt, chansendt 检查:
+ *  - 等不到的时候在截止时间前后返回失败, errno 为 ETIMEDOUT; 截止时间已经过了马上返回
+ *  - 截止时间之前等到了返回成功, 定时器被撤掉: 接着在没有截止时间的 tasksleep 里一直睡到
+ *    原来的截止时间之后, 不会被旧的定时器提前叫醒
+ *
+ * fd 的等待在 epoll 和 poll 两种后端上撤销的方法不一样(epollcancel/pollcancel),
+ * 分别用 make 和 make DEFS=-DUSE_POLL 编译运行.
+ *
+ * 用法: testdeadline, 全部通过时退出码为 0.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768, WAIT = 30, EARLY = 10, SLACK = 40 };
+
+#define MS 1000000ULL
+
+static int nfail;
+static int p[2];
+static QLock l;
+static Rendez r;
+static Rendez late;
+static int woke;
+static Channel *c;
+static char buf[65536];
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+static int ms(uint64_t t0)
+{
+    return (tasknow() - t0) / MS;
+}
+
+/* 超时的时候用了多久: 不早于 WAIT, 也不晚太多 */
+static int ontime(uint64_t t0)
+{
+    int t;
+
+    t = ms(t0);
+    return t >= WAIT - 1 && t < WAIT + SLACK;
+}
+
+static int localport(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t sn;
+
+    sn = sizeof ss;
+    getsockname(fd, (struct sockaddr *)&ss, &sn);
+    return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+}
+
+void latewaker(void *v)
+{
+    taskdelay((int)(long)v);
+    woke = 1;
+    taskwakeup(&late);
+}
+
+/* 早醒之后一直睡到截止时间之后, 旧的定时器没撤掉的话会提前把我们叫醒 */
+static void nospurious(uint64_t deadline)
+{
+    woke = 0;
+    taskcreate(latewaker, (void *)(long)((deadline - tasknow()) / MS + 20), STACK);
+    tasksleep(&late);
+    check(woke);
+}
+
+void writer(void *v)
+{
+    taskdelay((int)(long)v);
+    check(write(p[1], "x", 1) == 1);
+}
+
+void drainer(void *v)
+{
+    taskdelay((int)(long)v);
+    while (read(p[0], buf, sizeof buf) > 0)
+        ;
+}
+
+void holder(void *v)
+{
+    qlock(&l);
+    taskdelay((int)(long)v);
+    qunlock(&l);
+}
+
+void waker(void *v)
+{
+    taskdelay((int)(long)v);
+    taskwakeup(&r);
+}
+
+void sender(void *v)
+{
+    taskdelay((int)(long)v);
+    chansendul(c, 42);
+}
+
+void receiver(void *v)
+{
+    taskdelay((int)(long)v);
+    chanrecvul(c);
+}
+
+void dialer(void *v)
+{
+    int fd;
+
+    taskdelay(EARLY);
+    if ((fd = netdial(TCP, "127.0.0.1", (int)(long)v)) >= 0)
+        close(fd);
+}
+
+static void testfd(void)
+{
+    uint64_t t0, d;
+    char ch;
+
+    if (pipe(p) < 0) {
+        perror("pipe");
+        taskexitall(1);
+    }
+    fdnoblock(p[0]);
+    fdnoblock(p[1]);
+
+    /* fdwaitt */
+    t0 = tasknow();
+    check(fdwaitt(p[0], 'r', t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    check(fdwaitt(p[0], 'r', tasknow() - 1) == -1 && errno == ETIMEDOUT);
+    taskcreate(writer, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    check(fdwaitt(p[0], 'r', d) == 0);
+    nospurious(d);
+    check(read(p[0], &ch, 1) == 1);
+
+    /* fdreadt */
+    t0 = tasknow();
+    check(fdreadt(p[0], &ch, 1, t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    taskcreate(writer, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    check(fdreadt(p[0], &ch, 1, d) == 1 && ch == 'x');
+    nospurious(d);
+
+    /* fdwritet: 先把管道写满 */
+    while (write(p[1], buf, sizeof buf) > 0)
+        ;
+    t0 = tasknow();
+    check(fdwritet(p[1], "y", 1, t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    taskcreate(drainer, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    check(fdwritet(p[1], "y", 1, d) == 1);
+    nospurious(d);
+    check(read(p[0], &ch, 1) == 1 && ch == 'y');
+
+    close(p[0]);
+    close(p[1]);
+}
+
+static void testaccept(void)
+{
+    int lfd, fd, port;
+    uint64_t t0, d;
+
+    lfd = netannounce(TCP, "127.0.0.1", 0);
+    check(lfd >= 0);
+    t0 = tasknow();
+    check(netacceptt(lfd, 0, 0, t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    check(netacceptt(lfd, 0, 0, tasknow() - 1) == -1 && errno == ETIMEDOUT);
+
+    port = localport(lfd);
+
+    taskcreate(dialer, (void *)(long)port, STACK);
+    d = tasknow() + WAIT * MS;
+    check((fd = netacceptt(lfd, 0, 0, d)) >= 0);
+    nospurious(d);
+    close(fd);
+    close(lfd);
+}
+
+static void testqlock(void)
+{
+    uint64_t t0, d;
+
+    taskcreate(holder, (void *)(long)(WAIT + SLACK), STACK);
+    taskyield();
+    t0 = tasknow();
+    check(qlockt(&l, t0 + WAIT * MS) == 0 && errno == ETIMEDOUT && ontime(t0));
+    check(qlockt(&l, tasknow() - 1) == 0 && errno == ETIMEDOUT);
+
+    /* 超时的等待者已经从队列上摘掉了, 锁交给排在后面的 */
+    qlock(&l);
+    qunlock(&l);
+
+    taskcreate(holder, (void *)EARLY, STACK);
+    taskyield();
+    d = tasknow() + WAIT * MS;
+    check(qlockt(&l, d) == 1);
+    nospurious(d);
+    qunlock(&l);
+}
+
+static void testsleep(void)
+{
+    uint64_t t0, d;
+
+    t0 = tasknow();
+    check(tasksleept(&r, t0 + WAIT * MS) == 0 && errno == ETIMEDOUT && ontime(t0));
+    check(tasksleept(&r, tasknow() - 1) == 0 && errno == ETIMEDOUT);
+
+    /* 超时之后不在等待队列上了, 唤醒不到任何人 */
+    check(taskwakeup(&r) == 0);
+
+    taskcreate(waker, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    check(tasksleept(&r, d) == 1);
+    nospurious(d);
+}
+
+static void testchan(void)
+{
+    uint64_t t0, d;
+    unsigned long x;
+
+    c = chancreate(sizeof(unsigned long), 0);
+    t0 = tasknow();
+    check(chanrecvt(c, &x, t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    t0 = tasknow();
+    check(chansendt(c, &x, t0 + WAIT * MS) == -1 && errno == ETIMEDOUT && ontime(t0));
+    check(c->arecv.n == 0 && c->asend.n == 0);
+
+    taskcreate(sender, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    check(chanrecvt(c, &x, d) == 1 && x == 42);
+    nospurious(d);
+
+    taskcreate(receiver, (void *)EARLY, STACK);
+    d = tasknow() + WAIT * MS;
+    x = 7;
+    check(chansendt(c, &x, d) == 1);
+    nospurious(d);
+    chanfree(c);
+}
+
+void taskmain(int argc, char **argv)
+{
+    testfd();
+    testaccept();
+    testqlock();
+    testsleep();
+    testchan();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
@@ -11,8 +11,8 @@ Channel *c;
 
 void delaytask(void *v)
 {
-    taskdelay((int)v);
-    printf("awake after %d ms\n", (int)v);
+    taskdelay((int)(long)v);
+    printf("awake after %d ms\n", (int)(long)v);
     chansendul(c, 0);
 }
 
@@ -26,7 +26,7 @@ void taskmain(int argc, char **argv)
     for (i = 1; i < argc; i++) {
         n++;
         printf("x");
-        taskcreate(delaytask, (void *)atoi(argv[i]), STACK);
+        taskcreate(delaytask, (void *)(long)atoi(argv[i]), STACK);
     }
 
     /* wait for n tasks to finish */
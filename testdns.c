@@ -0,0 +1,254 @@
+/*
+ * 测试 netlookup 的 DNS 解析.
+ *
+ * 同一个进程里跑一个 UDP 的桩 DNS 服务器, 用 netnameserver 指过去, 检查:
+ *  - 普通的 A 记录和 CNAME 应答
+ *  - 缓存: 第二次查询不发包, TTL 到了重新查
+ *  - 同一个名字的并发查询只发一个包
+ *  - NXDOMAIN 返回失败并且被缓存
+ *  - id 不对的应答被丢掉
+ *  - 等应答期间别的协程照常运行
+ *  - /etc/hosts 里的名字(localhost)不发包
+ *
+ * 用法: testdns, 全部通过时退出码为 0.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768 };
+
+static int nfail;
+static int ticks;
+static int nquery[8];
+static Channel *done;
+
+static char *names[] = {"a.test", "cname.test", "slow.test", "nx.test", "spoof.test"};
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+/* 把 "a.test" 转成报文里的格式 */
+static int putname(unsigned char *p, char *name)
+{
+    unsigned char *q, *lp;
+
+    q = p;
+    while (*name) {
+        lp = q++;
+        while (*name && *name != '.')
+            *q++ = *name++;
+        *lp = q - lp - 1;
+        if (*name == '.')
+            name++;
+    }
+    *q++ = 0;
+    return q - p;
+}
+
+static int putrr(unsigned char *p, unsigned char *name, int nname, int type, unsigned ttl, unsigned char *rdata, int n)
+{
+    unsigned char *q;
+
+    q = p;
+    memmove(q, name, nname);
+    q += nname;
+    *q++ = 0;
+    *q++ = type;
+    *q++ = 0;
+    *q++ = 1;
+    *q++ = ttl >> 24;
+    *q++ = ttl >> 16;
+    *q++ = ttl >> 8;
+    *q++ = ttl;
+    *q++ = n >> 8;
+    *q++ = n;
+    memmove(q, rdata, n);
+    return q + n - p;
+}
+
+static int putip(unsigned char *p, unsigned ttl, char *ip)
+{
+    unsigned char ptr[2] = {0xC0, 12}; /* 指向问题里的名字 */
+    struct in_addr a;
+
+    inet_pton(AF_INET, ip, &a);
+    return putrr(p, ptr, 2, 1, ttl, (unsigned char *)&a, 4);
+}
+
+/* 问题里的名字, 转回 "a.test" */
+static void getname(unsigned char *p, char *buf)
+{
+    char *b;
+
+    b = buf;
+    while (*p) {
+        if (b != buf)
+            *b++ = '.';
+        memmove(b, p + 1, *p);
+        b += *p;
+        p += *p + 1;
+    }
+    *b = 0;
+}
+
+void stubtask(void *v)
+{
+    int fd, n, m, i, qlen;
+    unsigned char q[512], r[512], target[64];
+    char name[256];
+    struct sockaddr_in sa;
+    socklen_t sn;
+
+    fd = (int)(long)v;
+    for (;;) {
+        sn = sizeof sa;
+        while ((n = recvfrom(fd, q, sizeof q, 0, (struct sockaddr *)&sa, &sn)) < 0 && errno == EAGAIN) {
+            fdwait(fd, 'r');
+            sn = sizeof sa;
+        }
+        if (n < 12)
+            continue;
+
+        getname(q + 12, name);
+        for (i = 0; i < 5; i++)
+            if (strcmp(name, names[i]) == 0)
+                nquery[i]++;
+
+        qlen = 12 + strlen((char *)q + 12) + 1 + 4;
+        memmove(r, q, qlen);
+        r[2] = 0x81; /* QR, RD */
+        r[3] = 0x80; /* RA */
+        m = qlen;
+        if (strcmp(name, "a.test") == 0) {
+            r[7] = 1;
+            m += putip(r + m, 1, "10.0.0.1");
+        } else if (strcmp(name, "cname.test") == 0) {
+            unsigned char ptr[2] = {0xC0, 12};
+            int nt = putname(target, "real.test");
+            r[7] = 2;
+            m += putrr(r + m, ptr, 2, 5, 30, target, nt);
+            m += putrr(r + m, target, nt, 1, 60, (unsigned char *)"\x0a\x00\x00\x02", 4);
+        } else if (strcmp(name, "slow.test") == 0) {
+            taskdelay(100);
+            r[7] = 1;
+            m += putip(r + m, 60, "10.0.0.3");
+        } else if (strcmp(name, "nx.test") == 0) {
+            r[3] |= 3;
+        } else if (strcmp(name, "spoof.test") == 0) {
+            /* 先发一个 id 不对的假应答 */
+            r[7] = 1;
+            m += putip(r + m, 60, "6.6.6.6");
+            r[0] ^= 0xFF;
+            sendto(fd, r, m, 0, (struct sockaddr *)&sa, sn);
+            r[0] ^= 0xFF;
+            m = qlen;
+            m += putip(r + m, 60, "10.0.0.4");
+        } else {
+            r[3] |= 3;
+        }
+        sendto(fd, r, m, 0, (struct sockaddr *)&sa, sn);
+    }
+}
+
+void ticktask(void *v)
+{
+    for (;;) {
+        taskdelay(10);
+        ticks++;
+    }
+}
+
+void slowlookup(void *v)
+{
+    uint32_t ip;
+
+    check(netlookup("slow.test", &ip) == 0 && ip == inet_addr("10.0.0.3"));
+    chansendul(done, 0);
+}
+
+static int lookup(char *name, char *want)
+{
+    uint32_t ip;
+
+    if (netlookup(name, &ip) < 0)
+        return want == 0;
+    return want != 0 && ip == inet_addr(want);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int fd, i, t0;
+    struct sockaddr_in sa;
+    socklen_t sn;
+    char port[16];
+
+    /* 桩服务器监听在随机端口上 */
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0) {
+        fprintf(stderr, "cannot bind udp socket: %s\n", strerror(errno));
+        taskexitall(1);
+    }
+    sn = sizeof sa;
+    getsockname(fd, (struct sockaddr *)&sa, &sn);
+    fdnoblock(fd);
+    snprintf(port, sizeof port, "%d", ntohs(sa.sin_port));
+    netnameserver("127.0.0.1", ntohs(sa.sin_port));
+    printf("stub dns server on 127.0.0.1:%s\n", port);
+
+    taskcreate(stubtask, (void *)(long)fd, STACK);
+    taskcreate(ticktask, 0, STACK);
+    done = chancreate(sizeof(unsigned long), 0);
+
+    /* A 记录, 然后命中缓存 */
+    check(lookup("a.test", "10.0.0.1"));
+    check(lookup("A.TEST", "10.0.0.1"));
+    check(nquery[0] == 1);
+
+    /* TTL 1 秒, 过期之后重新查 */
+    taskdelay(1100);
+    check(lookup("a.test", "10.0.0.1"));
+    check(nquery[0] == 2);
+
+    /* CNAME 跟着走到 A 记录 */
+    check(lookup("cname.test", "10.0.0.2"));
+
+    /* 20 个协程同时查同一个名字, 只发一个包; 等待期间 ticktask 照常运行 */
+    t0 = ticks;
+    for (i = 0; i < 20; i++)
+        taskcreate(slowlookup, 0, STACK);
+    for (i = 0; i < 20; i++)
+        chanrecvul(done);
+    check(nquery[2] == 1);
+    check(ticks - t0 >= 5);
+
+    /* NXDOMAIN 失败, 并且在缓存里 */
+    check(lookup("nx.test", 0));
+    check(lookup("nx.test", 0));
+    check(nquery[3] == 1);
+
+    /* id 不对的应答被丢掉 */
+    check(lookup("spoof.test", "10.0.0.4"));
+
+    /* /etc/hosts 里的名字不会发包 */
+    if (access("/etc/hosts", R_OK) == 0)
+        check(lookup("localhost", "127.0.0.1"));
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
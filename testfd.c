@@ -0,0 +1,149 @@
+/*
+ * 测试 fdwait 的语义.
+ *
+ * epoll 后端以边沿触发方式注册 fd, 检查:
+ *  - 数据没有读完的时候再 fdwait 马上返回: 管道里有 40 字节, fdread1 每次读 10 字节,
+ *    四次都能读到, 之后没有数据了才阻塞, 新数据来了再醒
+ *  - 先 fdwait 再读写: 管道一直可写, 连续 fdwait(fd, 'w') 都马上返回
+ *  - 对端关闭之后 fdwait 一直返回
+ *  - 等待过的 fd 被直接 close, 编号被没有经过 fdnoblock 的 SOCK_NONBLOCK 套接字复用,
+ *    fdwait 还能等到新 fd 上的事件
+ *
+ * 卡住的话看门狗协程在 5 秒之后报告失败退出.
+ *
+ * 用法: testfd, 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768 };
+
+static int nfail;
+static int p[2];
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+void watchdog(void *v)
+{
+    tasksystem();
+    taskdelay(5000);
+    printf("FAIL: %s stuck\n", (char *)v);
+    taskexitall(1);
+}
+
+void writer(void *v)
+{
+    taskdelay(10);
+    check(write(p[1], v, strlen(v)) == (int)strlen(v));
+}
+
+static void mkpipe(void)
+{
+    if (pipe(p) < 0) {
+        perror("pipe");
+        taskexitall(1);
+    }
+    fdnoblock(p[0]);
+    fdnoblock(p[1]);
+}
+
+static void testread1(void)
+{
+    char buf[64];
+    int i, ok;
+
+    mkpipe();
+    check(write(p[1], "0123456789abcdefghijABCDEFGHIJklmnopqrst", 40) == 40);
+    ok = 1;
+    for (i = 0; i < 4; i++)
+        if (fdread1(p[0], buf, 10) != 10)
+            ok = 0;
+    check(ok && memcmp(buf, "klmnopqrst", 10) == 0);
+
+    /* 读空了才真的等, 新数据来了醒过来 */
+    taskcreate(writer, "late", STACK);
+    check(fdread1(p[0], buf, sizeof buf) == 4 && memcmp(buf, "late", 4) == 0);
+
+    /* 先 fdwait 再读, 一次只读一个字节 */
+    check(write(p[1], "xyz", 3) == 3);
+    ok = 1;
+    for (i = 0; i < 3; i++) {
+        fdwait(p[0], 'r');
+        if (read(p[0], buf + i, 1) != 1)
+            ok = 0;
+    }
+    check(ok && memcmp(buf, "xyz", 3) == 0);
+
+    /* 带截止时间的也一样 */
+    check(write(p[1], "ab", 2) == 2);
+    check(fdwaitt(p[0], 'r', tasknow() + 1000000000) == 0 && read(p[0], buf, 1) == 1);
+    check(fdwaitt(p[0], 'r', tasknow() + 1000000000) == 0 && read(p[0], buf, 1) == 1);
+    check(fdwaitt(p[0], 'r', tasknow() + 20000000) == -1 && errno == ETIMEDOUT);
+
+    close(p[1]);
+    check(fdread1(p[0], buf, sizeof buf) == 0);
+    fdwait(p[0], 'r');
+    fdwait(p[0], 'r');
+    fdclose(p[0]);
+}
+
+static void testwrite(void)
+{
+    int i;
+
+    mkpipe();
+    for (i = 0; i < 3; i++)
+        fdwait(p[1], 'w');
+    check(write(p[1], "x", 1) == 1);
+    fdwait(p[1], 'w');
+    fdclose(p[0]);
+    fdclose(p[1]);
+}
+
+static void testreuse(void)
+{
+    int old, sv[2];
+    char ch;
+
+    mkpipe();
+    fdwait(p[1], 'w');
+    check(write(p[1], "x", 1) == 1);
+    fdwait(p[0], 'r');
+    old = p[0];
+    close(p[0]);
+    close(p[1]);
+
+    /* 同一个编号上的新 fd, 内核里已经没有注册了, fdtab 里还记着旧的 */
+    check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+    check(sv[0] == old);
+    p[1] = sv[1];
+    taskcreate(writer, "y", STACK);
+    fdwait(sv[0], 'r');
+    check(read(sv[0], &ch, 1) == 1 && ch == 'y');
+    fdclose(sv[0]);
+    fdclose(sv[1]);
+}
+
+void taskmain(int argc, char **argv)
+{
+    taskcreate(watchdog, "testfd", STACK);
+
+    testread1();
+    testwrite();
+    testreuse();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
@@ -0,0 +1,489 @@
+/*
+ * 测试 M:N 调度(taskprocs).
+ *
+ * 在 NPROC 个线程上检查:
+ *  - 协程都在第一个线程上创建, 别的线程要偷过去运行; 同一个协程前后在不同的线程上运行
+ *  - 通道: 无缓冲和有缓冲的 ping-pong, 多个发送者多个接收者, chanalt, chansendn/chanrecvn,
+ *    chanclose 叫醒等着的, chanrecvt 超时. 等待者在哪个线程上醒来不确定, 只检查收到的数据
+ *  - fdwait: 很多对 socketpair 上的 ping-pong, 读写两边经常不在一个线程上
+ *  - qlock 下的计数不丢, QLock + Rendez 做的有界队列收发的和对得上
+ *  - taskdelay 不会提前醒
+ *
+ * 一个线程上是看不出来的问题(跨线程叫醒, 偷队列)才会在这里出现, 所以多跑几轮.
+ * taskprocs 需要 epoll 后端, poll 后端下退回到一个线程, 只跑功能检查.
+ *
+ * 用法: testmt [nproc], 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    STACK = 32768,
+    NPROC = 4,
+    NSPIN = 16,
+    NPAIR = 32,
+    NMSG = 2000,
+    NSEND = 8,
+    NBATCH = 300,
+    NRECV = 8,
+    NSOCK = 16,
+    NROUND = 500,
+    NLOCK = 32,
+    NINC = 1000,
+    NPROD = 8,
+    NCONS = 8,
+    NITEM = 1000,
+    NSLEEP = 32,
+    NQUEUE = 8,
+    MAXTHREAD = 64,
+};
+
+static int nfail;
+static int nproc;
+static Channel *done;
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            pthread_mutex_lock(&mu);                                  \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+            pthread_mutex_unlock(&mu);                                \
+        }                                                             \
+    } while (0)
+
+/* 等 n 个协程各发一个完成通知, 返回通知的和 */
+static unsigned long collect(int n)
+{
+    unsigned long sum;
+
+    sum = 0;
+    while (n-- > 0)
+        sum += chanrecvul(done);
+    return sum;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static pthread_t threads[MAXTHREAD];
+static int nthread;
+static int nmigrate;
+
+/* 记下运行过协程的线程 */
+static void seen(pthread_t self)
+{
+    int i;
+
+    pthread_mutex_lock(&mu);
+    for (i = 0; i < nthread; i++)
+        if (pthread_equal(threads[i], self))
+            break;
+    if (i == nthread && nthread < MAXTHREAD)
+        threads[nthread++] = self;
+    pthread_mutex_unlock(&mu);
+}
+
+/* 每次运行都忙 1ms 不进库, 占着所在的线程, 队列里的别的协程只能被偷走 */
+void spinner(void *v)
+{
+    pthread_t first, self;
+    uint64_t t;
+    int i, moved;
+
+    first = pthread_self();
+    moved = 0;
+    for (i = 0; i < 20; i++) {
+        self = pthread_self();
+        seen(self);
+        if (!pthread_equal(self, first))
+            moved = 1;
+        for (t = now(); now() - t < 1000000;)
+            ;
+        taskyield();
+    }
+    if (moved) {
+        pthread_mutex_lock(&mu);
+        nmigrate++;
+        pthread_mutex_unlock(&mu);
+    }
+    chansendul(done, 1);
+}
+
+static void teststeal(void)
+{
+    int i;
+
+    for (i = 0; i < NSPIN; i++)
+        taskcreate(spinner, 0, STACK);
+    check(collect(NSPIN) == NSPIN);
+    if (nproc > 1)
+        check(nthread > 1 && nmigrate > 0);
+}
+
+void ping(void *v)
+{
+    Channel **c;
+    int i, ok;
+
+    c = v;
+    ok = 1;
+    for (i = 0; i < NMSG; i++) {
+        chansendul(c[0], i);
+        if (chanrecvul(c[1]) != i + 1)
+            ok = 0;
+        if (i % 97 == 0)
+            taskyield();
+    }
+    chansendul(done, ok);
+}
+
+void pong(void *v)
+{
+    Channel **c;
+    int i;
+
+    c = v;
+    for (i = 0; i < NMSG; i++)
+        chansendul(c[1], chanrecvul(c[0]) + 1);
+}
+
+static Channel *mc;
+
+void msend(void *v)
+{
+    unsigned long i;
+
+    for (i = 1; i <= NMSG; i++)
+        chansendul(mc, i);
+    chansendul(done, 0);
+}
+
+/* 收到 0 结束, 把收到的和报告回去 */
+void mrecv(void *v)
+{
+    unsigned long x, sum;
+
+    sum = 0;
+    while ((x = chanrecvul(mc)) != 0)
+        sum += x;
+    chansendul(done, sum);
+}
+
+void nsend(void *v)
+{
+    unsigned long buf[7];
+    int i, j, n;
+
+    for (i = 0; i < NBATCH; i++) {
+        for (j = 0; j < 7; j++)
+            buf[j] = 1;
+        for (j = 0; j < 7; j += n)
+            n = chansendn(mc, buf + j, 7 - j);
+    }
+}
+
+void altsend(void *v)
+{
+    int i;
+
+    for (i = 0; i < NMSG; i++)
+        chansendul(v, 1);
+}
+
+void closerecv(void *v)
+{
+    unsigned long x;
+
+    chansendul(done, chanrecv(mc, &x) == -1 && errno == EPIPE);
+}
+
+void timedrecv(void *v)
+{
+    unsigned long x;
+    uint64_t t;
+
+    t = tasknow();
+    chansendul(done, chanrecvt(mc, &x, t + 20000000) == -1 && errno == ETIMEDOUT && tasknow() - t >= 19000000);
+}
+
+static void testchan(void)
+{
+    Channel *c[NPAIR][2], *a1, *a2;
+    unsigned long x, y, sum, buf[16];
+    int i, n, got[2];
+    Alt a[3];
+
+    /* ping-pong, 一半无缓冲一半有缓冲 */
+    for (i = 0; i < NPAIR; i++) {
+        c[i][0] = chancreate(sizeof(unsigned long), i % 3);
+        c[i][1] = chancreate(sizeof(unsigned long), i % 2);
+        taskcreate(ping, c[i], STACK);
+        taskcreate(pong, c[i], STACK);
+    }
+    check(collect(NPAIR) == NPAIR);
+    for (i = 0; i < NPAIR; i++) {
+        chanfree(c[i][0]);
+        chanfree(c[i][1]);
+    }
+
+    /* 多个发送者多个接收者, 无缓冲和有缓冲. 发送者都发完了再给每个接收者一个 0,
+     * 有缓冲的时候 0 排在缓冲区里剩下的数后面 */
+    for (n = 0; n <= 4; n += 4) {
+        mc = chancreate(sizeof(unsigned long), n);
+        for (i = 0; i < NRECV; i++)
+            taskcreate(mrecv, 0, STACK);
+        for (i = 0; i < NSEND; i++)
+            taskcreate(msend, 0, STACK);
+        check(collect(NSEND) == 0);
+        for (i = 0; i < NRECV; i++)
+            chansendul(mc, 0);
+        check(collect(NRECV) == (unsigned long)NSEND * NMSG * (NMSG + 1) / 2);
+        chanfree(mc);
+    }
+
+    /* chansendn/chanrecvn 分批收发 */
+    mc = chancreate(sizeof(unsigned long), 16);
+    for (i = 0; i < NSEND; i++)
+        taskcreate(nsend, 0, STACK);
+    sum = 0;
+    while (sum < (unsigned long)NSEND * NBATCH * 7) {
+        n = chanrecvn(mc, buf, 16);
+        for (i = 0; i < n; i++)
+            sum += buf[i];
+    }
+    check(sum == (unsigned long)NSEND * NBATCH * 7);
+    check(channbrecv(mc, &x) == -1);
+    chanfree(mc);
+
+    /* chanalt 在两个通道上收 */
+    a1 = chancreate(sizeof(unsigned long), 0);
+    a2 = chancreate(sizeof(unsigned long), 2);
+    taskcreate(altsend, a1, STACK);
+    taskcreate(altsend, a2, STACK);
+    a[0].c = a1;
+    a[0].v = &x;
+    a[0].op = CHANRCV;
+    a[1].c = a2;
+    a[1].v = &y;
+    a[1].op = CHANRCV;
+    a[2].op = CHANEND;
+    got[0] = got[1] = 0;
+    for (i = 0; i < 2 * NMSG; i++)
+        got[chanalt(a)]++;
+    check(got[0] == NMSG && got[1] == NMSG);
+    chanfree(a1);
+    chanfree(a2);
+
+    /* chanclose 叫醒别的线程上等着的接收者 */
+    mc = chancreate(sizeof(unsigned long), 0);
+    for (i = 0; i < NRECV; i++)
+        taskcreate(closerecv, 0, STACK);
+    taskdelay(5);
+    chanclose(mc);
+    check(collect(NRECV) == NRECV);
+    chanfree(mc);
+
+    /* chanrecvt 超时 */
+    mc = chancreate(sizeof(unsigned long), 0);
+    for (i = 0; i < NRECV; i++)
+        taskcreate(timedrecv, 0, STACK);
+    check(collect(NRECV) == NRECV);
+    check(mc->arecv.n == 0);
+    chanfree(mc);
+}
+
+/* fd[0] 发 i, fd[1] 回 i+1, 每次都要等对面 */
+void sockping(void *v)
+{
+    int *fd, i, ok, x;
+
+    fd = v;
+    ok = 1;
+    for (i = 0; i < NROUND; i++) {
+        if (fdwrite(fd[0], &i, sizeof i) != sizeof i || fdread(fd[0], &x, sizeof x) != sizeof x || x != i + 1)
+            ok = 0;
+    }
+    chansendul(done, ok);
+}
+
+void sockpong(void *v)
+{
+    int *fd, i, x;
+
+    fd = v;
+    for (i = 0; i < NROUND; i++) {
+        if (fdread(fd[1], &x, sizeof x) != sizeof x)
+            break;
+        x++;
+        fdwrite(fd[1], &x, sizeof x);
+    }
+}
+
+static void testfd(void)
+{
+    static int fd[NSOCK][2];
+    int i;
+
+    for (i = 0; i < NSOCK; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd[i]) < 0) {
+            perror("socketpair");
+            taskexitall(1);
+        }
+        fdnoblock(fd[i][0]);
+        fdnoblock(fd[i][1]);
+        taskcreate(sockping, fd[i], STACK);
+        taskcreate(sockpong, fd[i], STACK);
+    }
+    check(collect(NSOCK) == NSOCK);
+    for (i = 0; i < NSOCK; i++) {
+        fdclose(fd[i][0]);
+        fdclose(fd[i][1]);
+    }
+}
+
+static QLock lk;
+static long counter;
+
+/* 在锁里面让出, 读改写之间别的线程上的协程如果进来了计数就会丢 */
+void locker(void *v)
+{
+    long x;
+    int i;
+
+    for (i = 0; i < NINC; i++) {
+        qlock(&lk);
+        x = counter;
+        if (i % 10 == 0)
+            taskyield();
+        counter = x + 1;
+        qunlock(&lk);
+    }
+    chansendul(done, 1);
+}
+
+/* QLock + Rendez 做的有界队列 */
+static QLock ql;
+static Rendez notempty = { &ql };
+static Rendez notfull = { &ql };
+static unsigned long queue[NQUEUE];
+static int nqueue;
+
+void producer(void *v)
+{
+    unsigned long i;
+
+    for (i = 1; i <= NITEM; i++) {
+        qlock(&ql);
+        while (nqueue == NQUEUE)
+            tasksleep(&notfull);
+        queue[nqueue++] = i;
+        taskwakeup(&notempty);
+        qunlock(&ql);
+    }
+    chansendul(done, 0);
+}
+
+/* 收到 0 结束 */
+void consumer(void *v)
+{
+    unsigned long x, sum;
+
+    sum = 0;
+    for (;;) {
+        qlock(&ql);
+        while (nqueue == 0)
+            tasksleep(&notempty);
+        x = queue[--nqueue];
+        taskwakeup(&notfull);
+        qunlock(&ql);
+        if (x == 0)
+            break;
+        sum += x;
+    }
+    chansendul(done, sum);
+}
+
+static void put(unsigned long x)
+{
+    qlock(&ql);
+    while (nqueue == NQUEUE)
+        tasksleep(&notfull);
+    queue[nqueue++] = x;
+    taskwakeup(&notempty);
+    qunlock(&ql);
+}
+
+static void testlock(void)
+{
+    int i;
+
+    for (i = 0; i < NLOCK; i++)
+        taskcreate(locker, 0, STACK);
+    check(collect(NLOCK) == NLOCK);
+    check(counter == (long)NLOCK * NINC);
+
+    for (i = 0; i < NCONS; i++)
+        taskcreate(consumer, 0, STACK);
+    for (i = 0; i < NPROD; i++)
+        taskcreate(producer, 0, STACK);
+    check(collect(NPROD) == 0);
+    for (i = 0; i < NCONS; i++)
+        put(0);
+    check(collect(NCONS) == (unsigned long)NPROD * NITEM * (NITEM + 1) / 2);
+    check(nqueue == 0);
+}
+
+/* taskdelay 按 tasknow 的时钟算 */
+void sleeper(void *v)
+{
+    uint64_t t;
+    int ms;
+
+    ms = (long)v;
+    t = tasknow();
+    chansendul(done, taskdelay(ms) >= ms && tasknow() - t >= (uint64_t)ms * 1000000);
+}
+
+static void testdelay(void)
+{
+    int i;
+
+    for (i = 0; i < NSLEEP; i++)
+        taskcreate(sleeper, (void *)(long)(i * 7 % 50), STACK);
+    check(collect(NSLEEP) == NSLEEP);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int i;
+
+    nproc = taskprocs(argc > 1 ? atoi(argv[1]) : NPROC);
+    done = chancreate(sizeof(unsigned long), 64);
+
+    teststeal();
+    for (i = 0; i < 3; i++) {
+        testchan();
+        testfd();
+        testlock();
+        testdelay();
+        counter = 0;
+    }
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
@@ -0,0 +1,518 @@
+/*
+ * 测试 netannounce/netaccept/netdial 的 IPv6 和双栈支持, 全部走回环地址.
+ *
+ *  - "::" 的双栈监听套接字同时接受 127.0.0.1 和 ::1 的连接, 对端地址的写法正确
+ *  - 只监听 ::1 的时候 IPv4 连不上
+ *  - UDP 的 IPv6 收发
+ *  - 域名同时有 A 和 AAAA 记录(桩 DNS 服务器)的时候:
+ *    IPv6 能连就用 IPv6; IPv6 被拒绝立刻换 IPv4; IPv6 丢包(接收队列满了, 内核丢掉 SYN)
+ *    的时候 IPv4 在 250ms 左右接上, 不用等 IPv6 超时; 都连不上的时候按截止时间返回
+ *  - NETREUSEPORT 可以在同一个端口上 announce 多次
+ *  - 一次连过来 100 个连接: listen 队列放得下, netacceptn 一次唤醒接走积压的连接,
+ *    接到的 fd 不阻塞并且有 TCP_NODELAY
+ *  - 连接池: 放回的连接被重用; 对端关闭, 空闲超时的连接被 reaper 关掉; 超过 maxidle 的直接关掉
+ *  - fdwritev 写不完一次的时候接着写, 数据完整, 调用者的 iovec 数组不变; fdreadv 分散读
+ *  - udpsend/udprecv 成批收发, 地址和长度正确, 超长的数据报被截断
+ *
+ * 用法: testnet, 全部通过时退出码为 0.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768, NSTORM = 100 };
+
+static int nfail;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+/* 桩 DNS 服务器的数据: 名字, A, AAAA, 没有的填 0 */
+static char *zone[][3] = {
+    {"both.test", "127.0.0.1", "::1"},
+    {"v6.test", 0, "::1"},
+};
+
+void stubtask(void *v)
+{
+    int fd, n, m, i, qlen, type, alen;
+    unsigned char q[512], r[512], addr[16];
+    char name[256], *b, *ip;
+    unsigned char *p;
+    struct sockaddr_in sa;
+    socklen_t sn;
+
+    fd = (int)(long)v;
+    for (;;) {
+        sn = sizeof sa;
+        while ((n = recvfrom(fd, q, sizeof q, 0, (struct sockaddr *)&sa, &sn)) < 0 && errno == EAGAIN) {
+            fdwait(fd, 'r');
+            sn = sizeof sa;
+        }
+        if (n < 12)
+            continue;
+
+        b = name;
+        for (p = q + 12; *p; p += *p + 1) {
+            if (b != name)
+                *b++ = '.';
+            memmove(b, p + 1, *p);
+            b += *p;
+        }
+        *b = 0;
+        type = p[2];
+        qlen = p + 5 - q;
+
+        memmove(r, q, qlen);
+        r[2] = 0x81;
+        r[3] = 0x80;
+        m = qlen;
+        ip = 0;
+        for (i = 0; i < sizeof zone / sizeof zone[0]; i++)
+            if (strcmp(name, zone[i][0]) == 0)
+                ip = zone[i][type == 28 ? 2 : 1];
+        if (ip != 0) {
+            alen = type == 28 ? 16 : 4;
+            inet_pton(type == 28 ? AF_INET6 : AF_INET, ip, addr);
+            r[7] = 1;
+            memmove(r + m, "\xC0\x0C\x00\x00\x00\x01\x00\x00\x00\x3C\x00\x00", 12);
+            r[m + 3] = type;
+            r[m + 11] = alen;
+            memmove(r + m + 12, addr, alen);
+            m += 12 + alen;
+        }
+        sendto(fd, r, m, 0, (struct sockaddr *)&sa, sn);
+    }
+}
+
+static int localport(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t sn;
+
+    sn = sizeof ss;
+    getsockname(fd, (struct sockaddr *)&ss, &sn);
+    if (ss.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+    return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+}
+
+static int peerfamily(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t sn;
+
+    sn = sizeof ss;
+    if (getpeername(fd, (struct sockaddr *)&ss, &sn) < 0)
+        return -1;
+    return ss.ss_family;
+}
+
+/* 接一个连接, 检查对端地址 */
+static int acceptfrom(int lfd, char *want)
+{
+    char server[NETADDRLEN];
+    int fd, port;
+
+    if ((fd = netacceptt(lfd, server, &port, tasknow() + 1000000000ULL)) < 0)
+        return 0;
+    close(fd);
+    if (strcmp(server, want) != 0) {
+        printf("accepted from %s, want %s\n", server, want);
+        return 0;
+    }
+    return port > 0;
+}
+
+static int ms(uint64_t t0)
+{
+    return (tasknow() - t0) / 1000000;
+}
+
+static int naccept;
+static int closeall;
+
+/* 回显服务器, closeall 置位之后回显完就关闭连接 */
+void echotask(void *v)
+{
+    int fd, n;
+    char buf[64];
+
+    fd = (int)(long)v;
+    while ((n = fdread(fd, buf, sizeof buf)) > 0) {
+        fdwrite(fd, buf, n);
+        if (closeall)
+            break;
+    }
+    close(fd);
+}
+
+void echoserver(void *v)
+{
+    int lfd, fd;
+
+    lfd = (int)(long)v;
+    while ((fd = netaccept(lfd, 0, 0)) >= 0) {
+        naccept++;
+        taskcreate(echotask, (void *)(long)fd, STACK);
+    }
+}
+
+static int echo(int fd)
+{
+    char buf[8];
+
+    return fdwrite(fd, "ping", 4) == 4 && fdread(fd, buf, sizeof buf) == 4;
+}
+
+static int isopen(int fd)
+{
+    return fcntl(fd, F_GETFD) >= 0;
+}
+
+static void testpool(void)
+{
+    Netpool *p;
+    int lfd, fd, fd2, fd3;
+
+    lfd = netannounce(TCP, "127.0.0.1", 0);
+    taskcreate(echoserver, (void *)(long)lfd, STACK);
+    p = netpoolcreate("127.0.0.1", localport(lfd), 2, 300);
+
+    /* 放回去的连接被重用 */
+    fd = netpoolget(p);
+    check(fd >= 0 && echo(fd));
+    netpoolput(p, fd);
+    fd2 = netpoolget(p);
+    check(fd2 == fd && echo(fd2));
+    check(naccept == 1);
+
+    /* 超过 maxidle 的直接关掉 */
+    fd = netpoolget(p);
+    fd3 = netpoolget(p);
+    check(naccept == 3);
+    netpoolput(p, fd);
+    netpoolput(p, fd2);
+    netpoolput(p, fd3);
+    check(isopen(fd) && isopen(fd2) && !isopen(fd3));
+
+    /* 空闲超时 */
+    taskdelay(700);
+    check(!isopen(fd) && !isopen(fd2));
+
+    /* 对端关闭之后马上被淘汰, 不等超时 */
+    closeall = 1;
+    fd = netpoolget(p);
+    check(naccept == 4 && echo(fd));
+    netpoolput(p, fd);
+    taskdelay(50);
+    check(!isopen(fd));
+    closeall = 0;
+
+    fd = netpoolget(p);
+    check(naccept == 5 && echo(fd));
+    netpoolput(p, fd);
+    netpoolfree(p);
+    taskdelay(10);
+    check(!isopen(fd));
+    fdclose(lfd);
+}
+
+enum { VLEN = 300000 };
+static char vbuf[3][VLEN];
+
+void vreader(void *v)
+{
+    int fd, n, i, tot, bad;
+    char buf[4096];
+
+    fd = (int)(long)v;
+    tot = 0;
+    bad = 0;
+    while ((n = fdread(fd, buf, sizeof buf)) > 0) {
+        for (i = 0; i < n; i++)
+            if (buf[i] != vbuf[(tot + i) / VLEN][(tot + i) % VLEN])
+                bad++;
+        tot += n;
+        taskyield();
+    }
+    check(tot == 3 * VLEN && bad == 0);
+    close(fd);
+}
+
+static void testiov(void)
+{
+    int sv[2], i;
+    struct iovec iov[4], save[4];
+    char a[3], b[5];
+
+    for (i = 0; i < 3 * VLEN; i++)
+        vbuf[i / VLEN][i % VLEN] = i * 7 + i / 251;
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fdnoblock(sv[0]);
+    fdnoblock(sv[1]);
+    taskcreate(vreader, (void *)(long)sv[1], STACK);
+
+    iov[0].iov_base = vbuf[0];
+    iov[0].iov_len = VLEN;
+    iov[1].iov_base = 0;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = vbuf[1];
+    iov[2].iov_len = VLEN;
+    iov[3].iov_base = vbuf[2];
+    iov[3].iov_len = VLEN;
+    memmove(save, iov, sizeof iov);
+    check(fdwritev(sv[0], iov, 4) == 3 * VLEN);
+    check(memcmp(save, iov, sizeof iov) == 0);
+    close(sv[0]);
+    taskdelay(100);
+
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fdnoblock(sv[0]);
+    fdnoblock(sv[1]);
+    iov[0].iov_base = a;
+    iov[0].iov_len = sizeof a;
+    iov[1].iov_base = b;
+    iov[1].iov_len = sizeof b;
+    check(fdwrite(sv[0], "abcdefgh", 8) == 8);
+    check(fdreadv(sv[1], iov, 2) == 8 && memcmp(a, "abc", 3) == 0 && memcmp(b, "defgh", 5) == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void testudp(void)
+{
+    int rfd, sfd, i, n, tot, port;
+    Udpbatch *b, *rb;
+    struct sockaddr_in *sa;
+
+    rfd = netannounce(UDP, "127.0.0.1", 0);
+    sfd = netannounce(UDP, "127.0.0.1", 0);
+    check(rfd >= 0 && sfd >= 0);
+    port = localport(sfd);
+
+    b = udpalloc(8, 100);
+    for (i = 0; i < 8; i++) {
+        b->msg[i].len = snprintf((char *)b->msg[i].buf, 100, "msg %d", i);
+        sa = (struct sockaddr_in *)&b->msg[i].addr;
+        sa->sin_family = AF_INET;
+        sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sa->sin_port = htons(localport(rfd));
+        b->msg[i].addrlen = sizeof *sa;
+    }
+    memset(b->msg[7].buf, 'x', 100);
+    b->msg[7].len = 100;
+    check(udpsend(sfd, b, 8) == 8);
+
+    rb = udpalloc(4, 16);
+    for (tot = 0; tot < 8; tot += n) {
+        if ((n = udprecv(rfd, rb)) <= 0)
+            break;
+        for (i = 0; i < n; i++) {
+            sa = (struct sockaddr_in *)&rb->msg[i].addr;
+            check(rb->msg[i].addrlen == sizeof *sa && ntohs(sa->sin_port) == port);
+            if (tot + i < 7)
+                check(rb->msg[i].len == 5 && memcmp(rb->msg[i].buf, "msg ", 4) == 0 &&
+                      rb->msg[i].buf[4] == '0' + tot + i);
+            else
+                check(rb->msg[i].len == 16);
+        }
+    }
+    check(tot == 8);
+    udpfree(b);
+    udpfree(rb);
+    close(rfd);
+    close(sfd);
+}
+
+static void testaccept(void)
+{
+    int lfd, lfd2, port, fd[NSTORM], cfd[NSTORM], i, n, tot, first, one;
+    struct sockaddr_in sa;
+    socklen_t sn;
+
+    lfd = netannouncex(TCP, "127.0.0.1", 0, 0, NETREUSEPORT);
+    check(lfd >= 0);
+    one = 0;
+    sn = sizeof one;
+    check(getsockopt(lfd, IPPROTO_TCP, TCP_NODELAY, &one, &sn) == 0 && one != 0);
+    port = localport(lfd);
+    lfd2 = netannouncex(TCP, "127.0.0.1", port, 0, NETREUSEPORT);
+    check(lfd2 >= 0);
+    close(lfd2);
+    check(netannounce(TCP, "127.0.0.1", port) < 0);
+
+    /* 一次来 NSTORM 个连接, 原来 16 的 listen 队列放不下, 多出来的 SYN 被丢掉要等 1 秒重传 */
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+    for (i = 0; i < NSTORM; i++) {
+        fd[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fdnoblock(fd[i]);
+        connect(fd[i], (struct sockaddr *)&sa, sizeof sa);
+    }
+    taskdelay(50);
+
+    first = 0;
+    for (tot = 0; tot < NSTORM; tot += n) {
+        if ((n = netacceptn(lfd, cfd + tot, NSTORM - tot, tasknow() + 500000000ULL)) < 0)
+            break;
+        if (first == 0)
+            first = n;
+    }
+    printf("accepted %d connections, %d in the first call\n", tot, first);
+    check(tot == NSTORM);
+    check(first > 1);
+    if (tot > 0) {
+        one = 0;
+        sn = sizeof one;
+        getsockopt(cfd[0], IPPROTO_TCP, TCP_NODELAY, &one, &sn);
+        check(one != 0);
+        check(fcntl(cfd[tot - 1], F_GETFL) & O_NONBLOCK);
+    }
+    for (i = 0; i < tot; i++)
+        close(cfd[i]);
+    for (i = 0; i < NSTORM; i++)
+        close(fd[i]);
+    close(lfd);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int fd, lfd, lfd6, ufd, i, port, hole[4], t;
+    struct sockaddr_in6 sa6;
+    struct sockaddr_in sa;
+    uint64_t t0;
+    char buf[16];
+
+    /* 双栈监听 */
+    lfd = netannounce(TCP, "::", 0);
+    check(lfd >= 0);
+    port = localport(lfd);
+    fd = netdial(TCP, "127.0.0.1", port);
+    check(fd >= 0 && peerfamily(fd) == AF_INET);
+    close(fd);
+    check(acceptfrom(lfd, "127.0.0.1"));
+    fd = netdial(TCP, "::1", port);
+    check(fd >= 0 && peerfamily(fd) == AF_INET6);
+    close(fd);
+    check(acceptfrom(lfd, "::1"));
+    close(lfd);
+
+    /* 只监听 ::1 */
+    lfd = netannounce(TCP, "::1", 0);
+    check(lfd >= 0);
+    port = localport(lfd);
+    check(netdial(TCP, "127.0.0.1", port) < 0 && errno == ECONNREFUSED);
+    close(lfd);
+
+    /* 不合法的地址 */
+    check(netannounce(TCP, "::zz", 0) < 0);
+
+    /* UDP */
+    ufd = netannounce(UDP, "::1", 0);
+    check(ufd >= 0);
+    fd = netdial(UDP, "::1", localport(ufd));
+    check(fd >= 0 && write(fd, "ping", 4) == 4);
+    check(fdread(ufd, buf, sizeof buf) == 4 && memcmp(buf, "ping", 4) == 0);
+    close(fd);
+    close(ufd);
+
+    /* 以下用桩 DNS 服务器 */
+    ufd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(ufd, (struct sockaddr *)&sa, sizeof sa);
+    fdnoblock(ufd);
+    netnameserver("127.0.0.1", localport(ufd));
+    taskcreate(stubtask, (void *)(long)ufd, STACK);
+
+    /* 两边都能连, 用 IPv6 */
+    lfd = netannounce(TCP, "::", 0);
+    port = localport(lfd);
+    t0 = tasknow();
+    fd = netdial(TCP, "both.test", port);
+    check(fd >= 0 && peerfamily(fd) == AF_INET6);
+    check(ms(t0) < 200);
+    close(fd);
+    check(acceptfrom(lfd, "::1"));
+
+    /* 只有 AAAA 记录 */
+    fd = netdial(TCP, "v6.test", port);
+    check(fd >= 0 && peerfamily(fd) == AF_INET6);
+    close(fd);
+    check(acceptfrom(lfd, "::1"));
+    close(lfd);
+
+    /* IPv6 被拒绝, 马上换 IPv4 */
+    lfd = netannounce(TCP, "127.0.0.1", 0);
+    port = localport(lfd);
+    t0 = tasknow();
+    fd = netdial(TCP, "both.test", port);
+    check(fd >= 0 && peerfamily(fd) == AF_INET);
+    check(ms(t0) < 200);
+    close(fd);
+    check(acceptfrom(lfd, "127.0.0.1"));
+
+    /* IPv6 不应答: 同一个端口上 ::1 的监听队列塞满, 内核丢掉新的 SYN */
+    lfd6 = socket(AF_INET6, SOCK_STREAM, 0);
+    memset(&sa6, 0, sizeof sa6);
+    sa6.sin6_family = AF_INET6;
+    sa6.sin6_addr = in6addr_loopback;
+    sa6.sin6_port = htons(port);
+    check(bind(lfd6, (struct sockaddr *)&sa6, sizeof sa6) == 0 && listen(lfd6, 0) == 0);
+    for (i = 0; i < 4; i++) {
+        hole[i] = socket(AF_INET6, SOCK_STREAM, 0);
+        fdnoblock(hole[i]);
+        connect(hole[i], (struct sockaddr *)&sa6, sizeof sa6);
+    }
+    taskdelay(50);
+
+    t0 = tasknow();
+    fd = netdial(TCP, "both.test", port);
+    t = ms(t0);
+    printf("fallback to ipv4 after %d ms\n", t);
+    check(fd >= 0 && peerfamily(fd) == AF_INET);
+    check(t >= 200 && t < 900);
+    close(fd);
+    check(acceptfrom(lfd, "127.0.0.1"));
+
+    /* IPv4 也不通, 截止时间到了就返回 */
+    close(lfd);
+    t0 = tasknow();
+    fd = netdialt(TCP, "both.test", port, tasknow() + 500000000ULL);
+    t = ms(t0);
+    check(fd < 0 && errno == ETIMEDOUT);
+    check(t >= 400 && t < 900);
+
+    /* 不存在的名字 */
+    check(netdial(TCP, "nx.test", port) < 0);
+
+    for (i = 0; i < 4; i++)
+        close(hole[i]);
+    close(lfd6);
+
+    testaccept();
+    testpool();
+    testiov();
+    testudp();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
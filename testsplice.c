@@ -0,0 +1,165 @@
+/*
+ * 测试 fdsplice.
+ *
+ * 检查:
+ *  - 通过 socketpair 转发 1MB, 写端的套接字缓冲很小, 读的一方很慢: 管道里的数据要分多次
+ *    等 wfd 可写才排空, 数据完整, 读到 EOF 返回 0
+ *  - 协程第一次 fdsplice 时创建的管道在协程退出的时候关掉
+ *  - 一端不支持 splice(eventfd 上 splice 返回 EINVAL)的时候退回到用户态拷贝:
+ *    rfd 不支持的时候直接 fdread/fdwrite, wfd 不支持的时候把已经进了管道的数据读出来写过去
+ *
+ * 用法: testsplice, 全部通过时退出码为 0.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <task.h>
+#include <unistd.h>
+
+enum { STACK = 32768, NDATA = 1 << 20, CHUNK = 1000, SOCKBUF = 4096 };
+
+static int nfail;
+static int a[2]; /* feeder 写 a[0], relay 从 a[1] 读 */
+static int b[2]; /* relay 写 b[0], 读的一方从 b[1] 读 */
+static int relayopen;
+static char src[NDATA];
+static char dst[NDATA];
+static Channel *done;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+static void pair(int fd[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+        perror("socketpair");
+        taskexitall(1);
+    }
+    fdnoblock(fd[0]);
+    fdnoblock(fd[1]);
+}
+
+/* 打开着的 fd 个数 */
+static int nopen(void)
+{
+    int fd, n;
+
+    n = 0;
+    for (fd = 0; fd < 1024; fd++)
+        if (fcntl(fd, F_GETFD) >= 0)
+            n++;
+    return n;
+}
+
+void feeder(void *v)
+{
+    check(fdwrite(a[0], src, NDATA) == NDATA);
+    shutdown(a[0], SHUT_WR);
+}
+
+void relay(void *v)
+{
+    long tot;
+    int n;
+
+    tot = 0;
+    while ((n = fdsplice(a[1], b[0], 65536)) > 0)
+        tot += n;
+    check(n == 0);
+    shutdown(b[0], SHUT_WR);
+    relayopen = nopen();
+    chansendul(done, tot);
+}
+
+static void testrelay(void)
+{
+    int i, n, tot, sz;
+
+    for (i = 0; i < NDATA; i++)
+        src[i] = i * 7 + i / 251;
+    pair(a);
+    pair(b);
+    sz = SOCKBUF;
+    setsockopt(b[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz);
+    setsockopt(b[1], SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+
+    taskcreate(feeder, 0, STACK);
+    taskcreate(relay, 0, STACK);
+
+    /* 读得慢, 每读 100 次睡 1ms */
+    for (tot = 0, i = 0; tot < NDATA; tot += n, i++) {
+        if ((n = fdread(b[1], dst + tot, NDATA - tot < CHUNK ? NDATA - tot : CHUNK)) <= 0)
+            break;
+        if (i % 100 == 99)
+            taskdelay(1);
+    }
+    check(tot == NDATA && memcmp(src, dst, NDATA) == 0);
+    check(fdread(b[1], dst, 1) == 0);
+    check(chanrecvul(done) == NDATA);
+
+    /* relay 退出之后它的管道关掉了 */
+    taskyield();
+    check(nopen() == relayopen - 2);
+
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+}
+
+static void testfallback(void)
+{
+    int efd;
+    uint64_t x;
+
+    /* rfd 是 eventfd, 读出来的是 8 字节的计数 */
+    pair(b);
+    efd = eventfd(5, EFD_NONBLOCK | EFD_CLOEXEC);
+    fdnoblock(efd);
+    check(fdsplice(efd, b[0], 64) == 8);
+    check(fdread(b[1], &x, sizeof x) == 8 && x == 5);
+    close(efd);
+    close(b[0]);
+    close(b[1]);
+
+    /* wfd 是 eventfd, 数据先进了管道, 再读出来写过去 */
+    pair(a);
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fdnoblock(efd);
+    x = 7;
+    check(fdwrite(a[0], &x, sizeof x) == 8);
+    check(fdsplice(a[1], efd, 8) == 8);
+    x = 0;
+    check(read(efd, &x, sizeof x) == 8 && x == 7);
+
+    /* 管道排空了, 还能接着用 */
+    x = 9;
+    check(fdwrite(a[0], &x, sizeof x) == 8);
+    check(fdsplice(a[1], efd, 8) == 8);
+    check(read(efd, &x, sizeof x) == 8 && x == 9);
+    close(efd);
+    close(a[0]);
+    close(a[1]);
+}
+
+void taskmain(int argc, char **argv)
+{
+    done = chancreate(sizeof(unsigned long), 1);
+
+    testrelay();
+    testfallback();
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
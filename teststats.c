@@ -0,0 +1,109 @@
+/*
+ * 测试 taskstats 的运行统计.
+ *
+ * 一个 hog 协程每次占着 CPU 忙 20ms 再让出, 一个 yielder 协程每次马上让出, 检查:
+ *  - 运行次数
+ *  - hog 的累计运行时间和最长一段
+ *  - yielder 的等待时间里有 hog 占着的时间
+ *  - 不存在的 id 返回 -1
+ *  - 没有打开 taskaccounting 的时候只记运行次数, 时间都是 0
+ *
+ * 用法: teststats [-v], -v 最后发一个 SIGQUIT 打印协程列表. 全部通过时退出码为 0.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <task.h>
+#include <time.h>
+
+enum { STACK = 32768, NROUND = 10, HOGMS = 20 };
+
+static int nfail;
+static Channel *done;
+static Channel *quit;
+
+#define check(x)                                                      \
+    do {                                                              \
+        if (!(x)) {                                                   \
+            printf("FAIL line %d: %s\n", __LINE__, #x);               \
+            nfail++;                                                  \
+        }                                                             \
+    } while (0)
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void hog(void *v)
+{
+    int i;
+    uint64_t t;
+
+    taskname("hog");
+    for (i = 0; i < NROUND; i++) {
+        t = now();
+        while (now() - t < HOGMS * 1000000ULL)
+            ;
+        taskyield();
+    }
+    chansendul(done, 0);
+    chanrecvul(quit);
+}
+
+void yielder(void *v)
+{
+    int i;
+
+    taskname("yielder");
+    for (i = 0; i < NROUND; i++)
+        taskyield();
+    chansendul(done, 0);
+    chanrecvul(quit);
+}
+
+void taskmain(int argc, char **argv)
+{
+    int hid, yid;
+    Taskstats hs, ys, ms;
+
+    /* 默认不计时 */
+    taskyield();
+    check(taskstats(0, &ms) == 0 && ms.nrun >= 2 && ms.runtime == 0 && ms.maxslice == 0);
+    taskaccounting(1);
+
+    done = chancreate(sizeof(unsigned long), 2);
+    quit = chancreate(sizeof(unsigned long), 0);
+    hid = taskcreate(hog, 0, STACK);
+    yid = taskcreate(yielder, 0, STACK);
+
+    /* 两个都在等 quit, 还没退出, 统计还在 */
+    chanrecvul(done);
+    chanrecvul(done);
+    check(taskstats(hid, &hs) == 0);
+    check(taskstats(yid, &ys) == 0);
+
+    check(hs.nrun >= NROUND + 1);
+    check(ys.nrun >= NROUND + 1);
+    check(hs.runtime >= NROUND * HOGMS * 1000000ULL);
+    check(hs.maxslice >= HOGMS * 1000000ULL);
+    check(ys.maxslice < HOGMS * 1000000ULL);
+
+    /* yielder 每次让出之后都要等 hog 忙完一段 */
+    check(ys.waittime >= (NROUND - 1) * HOGMS * 1000000ULL);
+
+    /* 自己: 正在运行的这一段也算进去 */
+    check(taskstats(0, &ms) == 0 && ms.nrun >= 1 && ms.runtime > 0);
+    check(taskstats(100000, &ms) == -1);
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0)
+        raise(SIGQUIT);
+
+    printf("%s\n", nfail ? "FAIL" : "ok");
+    taskexitall(nfail != 0);
+}
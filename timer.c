@@ -0,0 +1,293 @@
+#include "taskimpl.h"
+
+/*
+ * 分层时间轮
+ *
+ * 时间以毫秒为一格(tick), 共 WHEELLEVELS 层, 每层 WHEELSIZE 个槽:
+ *  - 第 0 层每槽 1ms, 覆盖接下来的 64ms
+ *  - 第 1 层每槽 64ms, 覆盖 4s 左右
+ *  - 第 2 层每槽 4096ms, 覆盖 4.5 分钟左右
+ *  - 第 3 层每槽 262144ms, 覆盖 4.6 小时左右
+ * 更远的定时器放在 overflow 链表里, 每 4.6 小时重新分配一次.
+ *
+ * 插入和删除都是 O(1): 根据到期格数算出所在的层和槽, 挂到槽的双向链表上.
+ * 时间推进的时候, 低层转完一圈就把上一层对应槽里的定时器重新分配到下面各层(cascade),
+ * 到期的定时器先移到 due 链表, 再由调用者逐个取走.
+ *
+ * 定时器的到期格数向上取整, 所以只会晚到期(最多 1ms), 不会早到期.
+ *
+ * 这里的函数都不加锁, 调用者持有 fd.c 的 timerlk.
+ */
+
+enum {
+    WHEELBITS = 6,
+    WHEELSIZE = 1 << WHEELBITS,
+    WHEELMASK = WHEELSIZE - 1,
+    WHEELLEVELS = 4,
+
+    TIMERDUE = -1,                /* 在 due 链表上 */
+    TIMEROVERFLOW = WHEELLEVELS, /* 在 overflow 链表上 */
+};
+
+static Timer *wheel[WHEELLEVELS][WHEELSIZE];
+static uvlong wheelmask[WHEELLEVELS]; /* 每层非空槽的位图, 用来快速找下一个事件 */
+static Timer *overflow;
+static Timer *due;
+static uvlong wheelnow; /* 已经处理到的格数(ms) */
+static int ntimer;      /* 挂着的定时器数量(含 due) */
+
+/**
+ * @brief 把定时器挂到链表头
+ */
+static void timerlink(Timer **head, Timer *t)
+{
+    t->prev = nil;
+    t->next = *head;
+    if (*head) {
+        (*head)->prev = t;
+    }
+    *head = t;
+}
+
+/**
+ * @brief 根据到期格数把定时器放到合适的层和槽
+ *
+ * @param t
+ */
+static void wheelinsert(Timer *t)
+{
+    uvlong d;
+    int level, slot;
+
+    if (t->tick <= wheelnow) {
+        t->level = TIMERDUE;
+        timerlink(&due, t);
+        return;
+    }
+
+    d = t->tick - wheelnow;
+    for (level = 0; level < WHEELLEVELS; level++) {
+        if (d < (1ULL << (WHEELBITS * (level + 1)))) {
+            slot = (t->tick >> (WHEELBITS * level)) & WHEELMASK;
+            t->level = level;
+            t->slot = slot;
+            timerlink(&wheel[level][slot], t);
+            wheelmask[level] |= 1ULL << slot;
+            return;
+        }
+    }
+
+    t->level = TIMEROVERFLOW;
+    timerlink(&overflow, t);
+}
+
+/**
+ * @brief 把一条链表上的定时器按当前时间重新分配
+ *
+ * @param head
+ */
+static void cascade(Timer **head)
+{
+    Timer *t, *next;
+
+    t = *head;
+    *head = nil;
+    for (; t; t = next) {
+        next = t->next;
+        wheelinsert(t);
+    }
+}
+
+/**
+ * @brief 时间轮推进到 nowtick, 到期的定时器移到 due 链表
+ *
+ * @param nowtick
+ */
+static void wheeladvance(uvlong nowtick)
+{
+    int level, slot;
+    uvlong skip;
+
+    while (wheelnow < nowtick) {
+        /* 轮上没有定时器了, 直接跳到现在 */
+        if (ntimer == 0) {
+            wheelnow = nowtick;
+            break;
+        }
+
+        /* 第 0 层是空的, 中间这些格子不会有到期的定时器, 直接跳到下一次 cascade 之前 */
+        if (wheelmask[0] == 0) {
+            skip = wheelnow | WHEELMASK;
+            if (skip >= nowtick) {
+                wheelnow = nowtick;
+                break;
+            }
+            wheelnow = skip;
+        }
+
+        wheelnow++;
+
+        /* 低层转完一圈, 从高到低把上一层对应槽里的定时器分下来 */
+        if ((wheelnow & ((1ULL << (WHEELBITS * WHEELLEVELS)) - 1)) == 0) {
+            cascade(&overflow);
+        }
+
+        for (level = WHEELLEVELS - 1; level > 0; level--) {
+            if ((wheelnow & ((1ULL << (WHEELBITS * level)) - 1)) == 0) {
+                slot = (wheelnow >> (WHEELBITS * level)) & WHEELMASK;
+                wheelmask[level] &= ~(1ULL << slot);
+                cascade(&wheel[level][slot]);
+            }
+        }
+
+        slot = wheelnow & WHEELMASK;
+        wheelmask[0] &= ~(1ULL << slot);
+        cascade(&wheel[0][slot]);
+    }
+}
+
+/**
+ * @brief 启动定时器
+ *
+ * @param t 定时器, t->task 由调用者设置
+ * @param when 到期时间(ns)
+ */
+void timerset(Timer *t, uvlong when)
+{
+    /* 轮上没有定时器的时候可以放心地把起点挪到现在 */
+    if (ntimer == 0) {
+        wheelnow = tasknow() / 1000000;
+    }
+
+    t->when = when;
+    t->tick = (when + 999999) / 1000000;
+    t->armed = 1;
+    ntimer++;
+    wheelinsert(t);
+}
+
+/**
+ * @brief 取消定时器, 不在时间轮上的定时器什么也不做
+ *
+ * @param t
+ */
+void timerdel(Timer *t)
+{
+    Timer **head;
+
+    if (!t->armed) {
+        return;
+    }
+
+    switch (t->level) {
+    case TIMERDUE:
+        head = &due;
+        break;
+    case TIMEROVERFLOW:
+        head = &overflow;
+        break;
+    default:
+        head = &wheel[t->level][t->slot];
+        break;
+    }
+
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        *head = t->next;
+    }
+
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+
+    if (t->level >= 0 && t->level < WHEELLEVELS && *head == nil) {
+        wheelmask[t->level] &= ~(1ULL << t->slot);
+    }
+
+    t->armed = 0;
+    ntimer--;
+}
+
+/**
+ * @brief 取出一个已经到期的定时器
+ *
+ * @param now 当前时间(ns)
+ * @return Timer* 到期的定时器(已经从时间轮上摘下), 没有则返回 nil
+ */
+Timer *timerexpired(uvlong now)
+{
+    Timer *t;
+
+    wheeladvance(now / 1000000);
+    if ((t = due) == nil) {
+        return nil;
+    }
+
+    due = t->next;
+    if (due) {
+        due->prev = nil;
+    }
+
+    t->armed = 0;
+    ntimer--;
+    return t;
+}
+
+/**
+ * @brief 在位图 m 里面从 from 开始循环查找第一个非空槽
+ *
+ * @return int 距离 from 的槽数, 位图为空返回 -1
+ */
+static int nextslot(uvlong m, int from)
+{
+    m = (m >> from) | (from ? m << (WHEELSIZE - from) : 0);
+    if (m == 0) {
+        return -1;
+    }
+    return __builtin_ctzll(m);
+}
+
+/**
+ * @brief 下一次需要处理时间轮的时间
+ *
+ * 可能是某个定时器到期, 也可能只是需要 cascade, 调用者在这个时间之前醒来就不会错过到期
+ *
+ * @return uvlong 时间(ns), 没有定时器返回 ~0
+ */
+uvlong timernext(void)
+{
+    uvlong best, tick, base;
+    int level, d;
+
+    if (due) {
+        return 0;
+    }
+
+    if (ntimer == 0) {
+        return ~0ULL;
+    }
+
+    best = ~0ULL;
+    for (level = 0; level < WHEELLEVELS; level++) {
+        /* 第 level 层当前槽已经处理过, 从下一个槽开始找 */
+        base = wheelnow >> (WHEELBITS * level);
+        if ((d = nextslot(wheelmask[level], (base + 1) & WHEELMASK)) < 0) {
+            continue;
+        }
+
+        tick = (base + 1 + d) << (WHEELBITS * level);
+        if (tick < best) {
+            best = tick;
+        }
+    }
+
+    if (overflow) {
+        tick = ((wheelnow >> (WHEELBITS * WHEELLEVELS)) + 1) << (WHEELBITS * WHEELLEVELS);
+        if (tick < best) {
+            best = tick;
+        }
+    }
+
+    return best * 1000000;
+}
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+#include "taskimpl.h"
+#include <sys/socket.h>
+
+/*
+ * 成批收发 UDP 数据报
+ *
+ * 一个 Udpbatch 是一块连续的内存: n 个 Udpmsg, 给 recvmmsg/sendmmsg 用的 mmsghdr 和
+ * iovec, 以及 n 个 size 字节的数据缓冲区. 分配一次反复使用, 收发都不再分配内存.
+ *
+ * udprecv 一次系统调用收下 socket 里已有的消息, 最多 n 个, 只有一个都没有的时候才
+ * fdwait; udpsend 一次系统调用发出一批, 发不完(EAGAIN)的时候 fdwait 之后接着发.
+ * io_uring 没有对应的操作, 两种引擎下都是非阻塞调用加 fdwait.
+ *
+ * 同一个 Udpbatch 同一时间只能由一个协程使用.
+ */
+
+/**
+ * @brief 分配 n 个消息, 每个最多 size 字节
+ *
+ * @param n
+ * @param size
+ * @return Udpbatch*
+ */
+Udpbatch *udpalloc(int n, int size)
+{
+    Udpbatch *b;
+    struct mmsghdr *h;
+    struct iovec *iov;
+    uchar *p;
+    int i;
+
+    size = (size + 15) & ~15;
+    b = malloc(sizeof *b + n * (sizeof b->msg[0] + sizeof h[0] + sizeof iov[0]) + (size_t)n * size);
+    if (b == nil) {
+        fprint(2, "udpalloc malloc: %r\n");
+        abort();
+    }
+
+    b->n = n;
+    b->size = size;
+    b->msg = (Udpmsg *)(b + 1);
+    h = (struct mmsghdr *)(b->msg + n);
+    iov = (struct iovec *)(h + n);
+    p = (uchar *)(iov + n);
+    b->hdr = h;
+
+    memset(b->msg, 0, n * sizeof b->msg[0]);
+    memset(h, 0, n * sizeof h[0]);
+    for (i = 0; i < n; i++) {
+        b->msg[i].buf = p + (size_t)i * size;
+        iov[i].iov_base = b->msg[i].buf;
+        h[i].msg_hdr.msg_iov = &iov[i];
+        h[i].msg_hdr.msg_iovlen = 1;
+        h[i].msg_hdr.msg_name = &b->msg[i].addr;
+    }
+    return b;
+}
+
+void udpfree(Udpbatch *b)
+{
+    free(b);
+}
+
+/**
+ * @brief 收一批数据报
+ *
+ * 结果在 b->msg[0, 返回值) 里: buf/len 是数据, addr/addrlen 是发送方.
+ * 比 size 长的数据报被截断
+ *
+ * @param fd 不阻塞的 UDP 套接字
+ * @param b
+ * @return int 收到的个数, 出错返回 -1
+ */
+int udprecv(int fd, Udpbatch *b)
+{
+    struct mmsghdr *h;
+    int i, m;
+
+    h = b->hdr;
+    for (i = 0; i < b->n; i++) {
+        h[i].msg_hdr.msg_iov->iov_len = b->size;
+        h[i].msg_hdr.msg_name = &b->msg[i].addr;
+        h[i].msg_hdr.msg_namelen = sizeof b->msg[i].addr;
+    }
+
+    while ((m = recvmmsg(fd, h, b->n, 0, nil)) < 0 && errno == EAGAIN) {
+        _fdwait(fd, 'r', 0);
+    }
+
+    for (i = 0; i < m; i++) {
+        b->msg[i].len = h[i].msg_len;
+        b->msg[i].addrlen = h[i].msg_hdr.msg_namelen;
+    }
+    return m;
+}
+
+/**
+ * @brief 发出 b->msg[0, n) 里的数据报
+ *
+ * 每个消息发 buf 的前 len 字节到 addr; addrlen 为 0 的时候发到 connect 过的地址
+ *
+ * @param fd 不阻塞的 UDP 套接字
+ * @param b
+ * @param n 要发的个数
+ * @return int 发出去的个数. 中途出错返回已经发出的个数, 一个都没发出去返回 -1
+ */
+int udpsend(int fd, Udpbatch *b, int n)
+{
+    struct mmsghdr *h;
+    int i, m, tot;
+
+    h = b->hdr;
+    for (i = 0; i < n; i++) {
+        h[i].msg_hdr.msg_iov->iov_len = b->msg[i].len;
+        h[i].msg_hdr.msg_namelen = b->msg[i].addrlen;
+        h[i].msg_hdr.msg_name = b->msg[i].addrlen ? &b->msg[i].addr : nil;
+    }
+
+    for (tot = 0; tot < n; tot += m) {
+        while ((m = sendmmsg(fd, h + tot, n - tot, 0)) < 0 && errno == EAGAIN) {
+            _fdwait(fd, 'w', 0);
+        }
+        if (m < 0) {
+            return tot > 0 ? tot : -1;
+        }
+    }
+    return tot;
+}
@@ -0,0 +1,478 @@
+#include "taskimpl.h"
+
+/*
+ * io_uring I/O 引擎
+ *
+ * 打开 USE_IOURING 编译之后, fdread/fdwrite/netaccept/netdial 不再先试一次系统调用再 fdwait,
+ * 而是把操作填进提交队列(SQ)然后挂起协程. fdtask 在所有协程都跑过一轮之后统一调用一次
+ * io_uring_enter 把积攒的操作全部提交, 完成事件(CQE)通过注册到 epoll 的 eventfd 唤醒
+ * fdtask, 再由 fdtask 批量收割, 把对应的协程重新放回调度队列.
+ *
+ * 没有依赖 liburing, 直接使用系统调用和共享内存环.
+ */
+
+#ifdef USE_IOURING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+enum { URINGENTRIES = 4096 };
+
+/**
+ * @brief 一个正在进行中的操作, 放在发起操作的协程栈上
+ *
+ * sqe 的 user_data 指向它, 收割的时候据此找到要唤醒的协程
+ */
+typedef struct Uringop Uringop;
+struct Uringop {
+    Task *task;
+    int res;
+};
+
+/**
+ * @brief 映射到用户态的提交/完成环
+ */
+static struct {
+    int fd;
+    int efd;     /* 完成通知用的 eventfd */
+    uint unsent; /* 已经放进 SQ 但还没有 io_uring_enter 的数量 */
+
+    uint *sqhead;
+    uint *sqtail;
+    uint *sqmask;
+    uint *sqentries;
+    uint *sqarray;
+    struct io_uring_sqe *sqes;
+
+    uint *cqhead;
+    uint *cqtail;
+    uint *cqmask;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1, .efd = -1};
+
+int uringon;
+
+/**
+ * @brief 初始化 io_uring
+ *
+ * @return int 成功返回需要 fdtask 监视的 eventfd, 内核不支持等失败情况返回 -1
+ */
+int uringsetup(void)
+{
+    struct io_uring_params p;
+    struct io_uring_sqe *sqes;
+    uchar *sq, *cq;
+    size_t sqsize, cqsize, sqessize;
+    int fd, efd;
+
+    memset(&p, 0, sizeof p);
+    if ((fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p)) < 0) {
+        return -1;
+    }
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(uint);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* 新内核上 SQ 和 CQ 两个环可以用一次 mmap 映射 */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqsize > sqsize) {
+            sqsize = cqsize;
+        }
+        cqsize = sqsize;
+    }
+
+    /* 失败的时候按相反的顺序撤销已经做过的映射 */
+    sq = mmap(nil, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+              IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        goto closefd;
+    }
+
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(nil, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                  IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            goto unmapsq;
+        }
+    }
+
+    sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(nil, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        goto unmapcq;
+    }
+
+    /* 完成事件通过 eventfd 通知, fdtask 把它和其他 fd 一起交给 epoll 等待 */
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        goto unmapsqes;
+    }
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        close(efd);
+        goto unmapsqes;
+    }
+
+    ring.sqes = sqes;
+    ring.sqhead = (uint *)(sq + p.sq_off.head);
+    ring.sqtail = (uint *)(sq + p.sq_off.tail);
+    ring.sqmask = (uint *)(sq + p.sq_off.ring_mask);
+    ring.sqentries = (uint *)(sq + p.sq_off.ring_entries);
+    ring.sqarray = (uint *)(sq + p.sq_off.array);
+
+    ring.cqhead = (uint *)(cq + p.cq_off.head);
+    ring.cqtail = (uint *)(cq + p.cq_off.tail);
+    ring.cqmask = (uint *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    ring.fd = fd;
+    ring.efd = efd;
+    uringon = 1;
+    return efd;
+
+unmapsqes:
+    munmap(sqes, sqessize);
+unmapcq:
+    if (cq != sq) {
+        munmap(cq, cqsize);
+    }
+unmapsq:
+    munmap(sq, sqsize);
+closefd:
+    close(fd);
+    return -1;
+}
+
+/**
+ * @brief 把已经放进 SQ 的操作一次性提交给内核
+ *
+ * 由 fdtask 在阻塞等待之前调用, SQ 满的时候也会提前调用
+ */
+void uringflush(void)
+{
+    int n;
+
+    while (ring.unsent > 0) {
+        n = syscall(__NR_io_uring_enter, ring.fd, ring.unsent, 0, 0, nil, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* EBUSY/EAGAIN: 完成队列积压, 先收割再提交 */
+            if ((errno == EBUSY || errno == EAGAIN) && uringreap() > 0) {
+                continue;
+            }
+
+            fprint(2, "io_uring_enter: %s\n", strerror(errno));
+            abort();
+        }
+
+        ring.unsent -= n;
+    }
+}
+
+/**
+ * @brief 清掉完成通知 eventfd 的计数, 避免 epoll 反复报告
+ *
+ * 只在 epoll 报告它可读的时候调用, 必须在随后的 uringreap 之前:
+ * 清零之后才完成的操作会再写一次 eventfd, 不会漏掉
+ */
+void uringclear(void)
+{
+    uvlong cnt;
+
+    while (read(ring.efd, &cnt, sizeof cnt) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * @brief 收割所有已完成的操作, 唤醒对应的协程
+ *
+ * 只读共享内存里 CQ 的头尾, 不需要任何系统调用
+ *
+ * @return int 唤醒的协程数量
+ */
+int uringreap(void)
+{
+    struct io_uring_cqe *cqe;
+    Uringop *op;
+    uint head, tail;
+    int n;
+
+    /* M:N 模式会关掉 uringon, 但是已经提交的操作还要收割 */
+    if (ring.fd < 0) {
+        return 0;
+    }
+
+    n = 0;
+    head = *ring.cqhead;
+    tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &ring.cqes[head & *ring.cqmask];
+        op = (Uringop *)(uintptr_t)cqe->user_data;
+        op->res = cqe->res;
+        taskready(op->task);
+        n++;
+    }
+
+    __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * @brief 提交一个操作并挂起当前协程, 直到操作完成
+ *
+ * @param e 除 user_data 外都已经填好的 sqe
+ * @param what 协程状态描述
+ * @return int cqe 的结果, 出错时是负的 errno
+ */
+static int uringdo(struct io_uring_sqe *e, char *what)
+{
+    struct io_uring_sqe *sqe;
+    Uringop op;
+    uint tail, i;
+
+    /* SQ 满了就先把积攒的操作交给内核腾出位置 */
+    tail = *ring.sqtail;
+    if (tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) >= *ring.sqentries) {
+        uringflush();
+    }
+
+    op.task = taskrunning;
+    op.res = 0;
+    e->user_data = (uintptr_t)&op;
+
+    i = tail & *ring.sqmask;
+    sqe = &ring.sqes[i];
+    *sqe = *e;
+    ring.sqarray[i] = i;
+    __atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+    ring.unsent++;
+
+    taskstate("uring %s", what);
+    taskswitch();
+    return op.res;
+}
+
+/**
+ * @brief io_uring 版本的 fdread
+ *
+ * 老内核对 O_NONBLOCK 的 fd 可能直接返回 EAGAIN, 这时候退回到 fdwait 之后重新提交
+ *
+ * @param fd
+ * @param buf
+ * @param n
+ * @return int
+ */
+int uringread(int fd, void *buf, int n)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    for (;;) {
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_READ;
+        e.fd = fd;
+        e.addr = (uintptr_t)buf;
+        e.len = n;
+        e.off = (uvlong)-1; /* 使用(并推进)文件的当前偏移 */
+
+        if ((m = uringdo(&e, "read")) != -EAGAIN) {
+            break;
+        }
+
+        _fdwait(fd, 'r', 0);
+    }
+
+    if (m < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return m;
+}
+
+/**
+ * @brief io_uring 版本的 write, 只提交一次, 可能只写了一部分
+ *
+ * @param fd
+ * @param buf
+ * @param n
+ * @return int
+ */
+int uringwrite(int fd, void *buf, int n)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    for (;;) {
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_WRITE;
+        e.fd = fd;
+        e.addr = (uintptr_t)buf;
+        e.len = n;
+        e.off = (uvlong)-1;
+
+        if ((m = uringdo(&e, "write")) != -EAGAIN) {
+            break;
+        }
+
+        _fdwait(fd, 'w', 0);
+    }
+
+    if (m < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return m;
+}
+
+/**
+ * @brief io_uring 版本的 readv
+ */
+int uringreadv(int fd, struct iovec *iov, int niov)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    for (;;) {
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_READV;
+        e.fd = fd;
+        e.addr = (uintptr_t)iov;
+        e.len = niov;
+        e.off = (uvlong)-1;
+
+        if ((m = uringdo(&e, "readv")) != -EAGAIN) {
+            break;
+        }
+
+        _fdwait(fd, 'r', 0);
+    }
+
+    if (m < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return m;
+}
+
+/**
+ * @brief io_uring 版本的 writev, 只提交一次, 可能只写了一部分
+ */
+int uringwritev(int fd, struct iovec *iov, int niov)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    for (;;) {
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_WRITEV;
+        e.fd = fd;
+        e.addr = (uintptr_t)iov;
+        e.len = niov;
+        e.off = (uvlong)-1;
+
+        if ((m = uringdo(&e, "writev")) != -EAGAIN) {
+            break;
+        }
+
+        _fdwait(fd, 'w', 0);
+    }
+
+    if (m < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return m;
+}
+
+/**
+ * @brief io_uring 版本的 accept
+ *
+ * @param fd 监听套接字
+ * @param sa 对端地址
+ * @param len 对端地址长度
+ * @return int 新连接的 fd, 已经是不阻塞的
+ */
+int uringaccept(int fd, struct sockaddr *sa, socklen_t *len)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    for (;;) {
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_ACCEPT;
+        e.fd = fd;
+        e.addr = (uintptr_t)sa;
+        e.addr2 = (uintptr_t)len;
+        e.accept_flags = SOCK_NONBLOCK;
+
+        if ((m = uringdo(&e, "accept")) != -EAGAIN) {
+            break;
+        }
+
+        _fdwait(fd, 'r', 0);
+    }
+
+    if (m < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return m;
+}
+
+/**
+ * @brief io_uring 版本的 connect
+ *
+ * @param fd
+ * @param sa
+ * @param len
+ * @return int 成功返回 0, 失败返回 -1. 老内核上可能以 EINPROGRESS 失败, 调用者需要再 fdwait
+ */
+int uringconnect(int fd, struct sockaddr *sa, socklen_t len)
+{
+    struct io_uring_sqe e;
+    int m;
+
+    memset(&e, 0, sizeof e);
+    e.opcode = IORING_OP_CONNECT;
+    e.fd = fd;
+    e.addr = (uintptr_t)sa;
+    e.off = len;
+
+    if ((m = uringdo(&e, "connect")) < 0) {
+        errno = -m;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 取消 fd 上所有还在进行中的操作
+ *
+ * 进行中的操作持有文件引用, 单纯 close 不会让它们结束. 被取消的操作以 ECANCELED 完成
+ *
+ * @param fd
+ */
+void uringcancel(int fd)
+{
+    struct io_uring_sqe e;
+
+    memset(&e, 0, sizeof e);
+    e.opcode = IORING_OP_ASYNC_CANCEL;
+    e.fd = fd;
+    e.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    uringdo(&e, "cancel");
+}
+
+#endif
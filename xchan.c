@@ -0,0 +1,259 @@
+#include "taskimpl.h"
+
+/*
+ * 跨线程的通道
+ *
+ * Channel 只能在调度线程里用. Xchan 是一个有界的多生产者多消费者队列, 任何线程都可以
+ * 收发: 协程和用户自己创建的线程(存储引擎, 压缩线程池...)混在一起也可以.
+ *
+ * 每个 Xchan 一把 pthread 互斥锁保护环形缓冲区和两个等待队列. 等待者放在自己的栈上:
+ *  - 线程在自己的条件变量上等
+ *  - 协程挂起, 不占线程. 调度线程里的唤醒者直接 taskready; 别的线程用 taskwakeasync,
+ *    经过 eventfd 由 fdtask 叫醒, 不需要轮询
+ * 唤醒者负责把等待者从队列上摘下来, 被唤醒的一方重新检查条件, 条件不满足就再排队.
+ */
+
+typedef struct Xwaiter Xwaiter;
+struct Xwaiter {
+    Taskwake w;           /* 协程等待者 */
+    pthread_cond_t *cond; /* 线程等待者, 协程是 nil */
+    int done;             /* 已经被唤醒 */
+    Xwaiter *next;
+};
+
+typedef struct Xwaitq Xwaitq;
+struct Xwaitq {
+    Xwaiter *head;
+    Xwaiter *tail;
+};
+
+struct Xchan {
+    pthread_mutex_t lk;
+    uint elemsize;
+    uint bufsize;
+    uint nbuf;
+    uint off;
+    uchar *buf;
+    Xwaitq recvq; /* 等着收的 */
+    Xwaitq sendq; /* 等着发的 */
+};
+
+/**
+ * @brief 创建一个跨线程通道
+ *
+ * @param elemsize 每个元素的大小
+ * @param bufsize 缓冲的元素个数, 至少是 1
+ * @return Xchan*
+ */
+Xchan *xchancreate(int elemsize, int bufsize)
+{
+    Xchan *c;
+
+    if (bufsize < 1) {
+        bufsize = 1;
+    }
+    if ((c = malloc(sizeof *c + bufsize * elemsize)) == nil) {
+        fprint(2, "out of memory\n");
+        abort();
+    }
+    memset(c, 0, sizeof *c);
+    pthread_mutex_init(&c->lk, nil);
+    c->elemsize = elemsize;
+    c->bufsize = bufsize;
+    c->buf = (uchar *)(c + 1);
+    return c;
+}
+
+/**
+ * @brief 释放跨线程通道, 调用者保证已经没有人在用它
+ *
+ * @param c
+ */
+void xchanfree(Xchan *c)
+{
+    if (c == nil) {
+        return;
+    }
+    pthread_mutex_destroy(&c->lk);
+    free(c);
+}
+
+static void xqput(Xwaitq *q, Xwaiter *w)
+{
+    w->next = nil;
+    if (q->tail) {
+        q->tail->next = w;
+    } else {
+        q->head = w;
+    }
+    q->tail = w;
+}
+
+static Xwaiter *xqget(Xwaitq *q)
+{
+    Xwaiter *w;
+
+    if ((w = q->head) != nil && (q->head = w->next) == nil) {
+        q->tail = nil;
+    }
+    return w;
+}
+
+/**
+ * @brief 在 q 上排队等待, 被唤醒之后返回, 调用者持有 c->lk, 返回时仍然持有
+ */
+static void xwait(Xchan *c, Xwaitq *q)
+{
+    Xwaiter w;
+    pthread_cond_t cond;
+
+    w.done = 0;
+    if (proc() == nil) {
+        pthread_cond_init(&cond, nil);
+        w.cond = &cond;
+        xqput(q, &w);
+        while (!w.done) {
+            pthread_cond_wait(&cond, &c->lk);
+        }
+        pthread_cond_destroy(&cond);
+        return;
+    }
+
+    /* 别的调度线程可能在我们切走之前就唤醒我们, 见 task.c 的 oncpu */
+    w.cond = nil;
+    w.w.task = taskrunning;
+    xqput(q, &w);
+    pthread_mutex_unlock(&c->lk);
+    taskstate("xchan");
+    taskswitch();
+    pthread_mutex_lock(&c->lk);
+}
+
+/**
+ * @brief 唤醒 q 上排在最前面的等待者, 调用者持有 c->lk
+ */
+static void xwake(Xwaitq *q)
+{
+    Xwaiter *w;
+
+    if ((w = xqget(q)) == nil) {
+        return;
+    }
+    w->done = 1;
+    if (w->cond) {
+        pthread_cond_signal(w->cond);
+    } else if (proc() != nil) {
+        taskready(w->w.task);
+    } else {
+        taskwakeasync(&w->w);
+    }
+}
+
+/**
+ * @brief 不阻塞地发送, 调用者持有 c->lk
+ */
+static int xchansend1(Xchan *c, void *v)
+{
+    if (c->nbuf == c->bufsize) {
+        return -1;
+    }
+    memmove(c->buf + (c->off + c->nbuf) % c->bufsize * c->elemsize, v, c->elemsize);
+    c->nbuf++;
+    xwake(&c->recvq);
+    return 1;
+}
+
+/**
+ * @brief 不阻塞地接收, 调用者持有 c->lk
+ */
+static int xchanrecv1(Xchan *c, void *v)
+{
+    if (c->nbuf == 0) {
+        return -1;
+    }
+    memmove(v, c->buf + c->off * c->elemsize, c->elemsize);
+    if (++c->off == c->bufsize) {
+        c->off = 0;
+    }
+    c->nbuf--;
+    xwake(&c->sendq);
+    return 1;
+}
+
+/**
+ * @brief 发送一个元素, 缓冲区满的时候等待
+ *
+ * 可以在任何线程里调用: 协程挂起等待, 别的线程阻塞在条件变量上
+ *
+ * @param c
+ * @param v
+ * @return int 1
+ */
+int xchansend(Xchan *c, void *v)
+{
+    if (proc() != nil) {
+        taskwakeinit();
+    }
+    pthread_mutex_lock(&c->lk);
+    while (xchansend1(c, v) < 0) {
+        xwait(c, &c->sendq);
+    }
+    pthread_mutex_unlock(&c->lk);
+    return 1;
+}
+
+/**
+ * @brief 不阻塞地发送一个元素
+ *
+ * @param c
+ * @param v
+ * @return int 成功返回 1, 缓冲区满返回 -1
+ */
+int xchannbsend(Xchan *c, void *v)
+{
+    int r;
+
+    pthread_mutex_lock(&c->lk);
+    r = xchansend1(c, v);
+    pthread_mutex_unlock(&c->lk);
+    return r;
+}
+
+/**
+ * @brief 接收一个元素, 缓冲区空的时候等待
+ *
+ * 可以在任何线程里调用: 协程挂起等待, 别的线程阻塞在条件变量上
+ *
+ * @param c
+ * @param v
+ * @return int 1
+ */
+int xchanrecv(Xchan *c, void *v)
+{
+    if (proc() != nil) {
+        taskwakeinit();
+    }
+    pthread_mutex_lock(&c->lk);
+    while (xchanrecv1(c, v) < 0) {
+        xwait(c, &c->recvq);
+    }
+    pthread_mutex_unlock(&c->lk);
+    return 1;
+}
+
+/**
+ * @brief 不阻塞地接收一个元素
+ *
+ * @param c
+ * @param v
+ * @return int 成功返回 1, 缓冲区空返回 -1
+ */
+int xchannbrecv(Xchan *c, void *v)
+{
+    int r;
+
+    pthread_mutex_lock(&c->lk);
+    r = xchanrecv1(c, v);
+    pthread_mutex_unlock(&c->lk);
+    return r;
+}